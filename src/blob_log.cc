@@ -0,0 +1,325 @@
+#include "blob_log.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(OS_LINUX)
+#include <sys/sendfile.h>
+#endif
+
+#include <algorithm>
+
+#include "base/file_util.h"
+#include "base/logging.h"
+#include "base/posix/eintr_wrapper.h"
+#include "base/stringprintf.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "scoped_mutex.h"
+
+namespace lockbox {
+
+namespace {
+
+const uint32_t kRecordMagic = 0x424c4f42;  // "BLOB"
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t key_length;
+  uint64_t value_length;
+};
+
+// Reads exactly |length| bytes at |offset|.
+bool ReadFully(int fd, int64_t offset, int64_t length, char* out) {
+  while (length > 0) {
+    const ssize_t count = HANDLE_EINTR(pread(fd, out, length, offset));
+    if (count <= 0) {
+      return false;
+    }
+    out += count;
+    offset += count;
+    length -= count;
+  }
+  return true;
+}
+
+} // namespace
+
+string BlobLog::Location::ToString() const {
+  return base::StringPrintf("%u:%lld:%lld", segment,
+                            static_cast<long long>(offset),
+                            static_cast<long long>(length));
+}
+
+bool BlobLog::Location::FromString(const string& str, Location* location) {
+  CHECK(location);
+  vector<string> fields;
+  base::SplitString(str, ':', &fields);
+  unsigned segment = 0;
+  if (fields.size() != 3 || !base::StringToUint(fields[0], &segment) ||
+      !base::StringToInt64(fields[1], &(location->offset)) ||
+      !base::StringToInt64(fields[2], &(location->length))) {
+    return false;
+  }
+  location->segment = segment;
+  return true;
+}
+
+BlobLog::Segment::~Segment() {
+  close(fd);
+}
+
+BlobLog::BlobLog(const base::FilePath& dir, int64_t segment_bytes,
+                 int64_t min_value_size)
+    : dir_(dir), segment_bytes_(segment_bytes),
+      min_value_size_(min_value_size), active_(0), active_bytes_(0) {
+  CHECK_GT(segment_bytes, 0);
+}
+
+BlobLog::~BlobLog() {
+}
+
+bool BlobLog::Open() {
+  if (!file_util::CreateDirectory(dir_)) {
+    LOG(ERROR) << "Cannot create " << dir_.value();
+    return false;
+  }
+
+  ScopedMutexLock lock(&mutex_);
+  file_util::FileEnumerator files(dir_, false /* recursive */,
+                                  file_util::FileEnumerator::FILES,
+                                  "*.blob");
+  for (base::FilePath path = files.Next(); !path.empty();
+       path = files.Next()) {
+    unsigned segment = 0;
+    if (!base::StringToUint(path.BaseName().RemoveExtension().value(),
+                            &segment)) {
+      LOG(WARNING) << "Ignoring " << path.value();
+      continue;
+    }
+    const int fd = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY));
+    if (fd < 0) {
+      PLOG(ERROR) << "Cannot open " << path.value();
+      return false;
+    }
+    segments_[segment].reset(new Segment(fd));
+    active_ = std::max(active_, static_cast<uint32_t>(segment));
+  }
+  LOG(INFO) << "Opened " << segments_.size() << " blob segments in "
+            << dir_.value();
+  return Roll();
+}
+
+bool BlobLog::Append(const string& key, const string& value,
+                     Location* location) {
+  CHECK(location);
+  const int64_t record_bytes =
+      sizeof(RecordHeader) + key.size() + value.size();
+
+  // Reserve the record's space under the lock and write it outside of it.
+  std::shared_ptr<Segment> segment;
+  int64_t start = 0;
+  {
+    ScopedMutexLock lock(&mutex_);
+    if (active_bytes_ > 0 && active_bytes_ + record_bytes > segment_bytes_ &&
+        !Roll()) {
+      return false;
+    }
+    segment = segments_[active_];
+    location->segment = active_;
+    start = active_bytes_;
+    active_bytes_ += record_bytes;
+    ++segment->writers;
+  }
+
+  RecordHeader header;
+  header.magic = kRecordMagic;
+  header.key_length = key.size();
+  header.value_length = value.size();
+  struct iovec iov[3];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = const_cast<char*>(key.data());
+  iov[1].iov_len = key.size();
+  iov[2].iov_base = const_cast<char*>(value.data());
+  iov[2].iov_len = value.size();
+  const ssize_t written = HANDLE_EINTR(pwritev(segment->fd, iov, 3, start));
+
+  {
+    ScopedMutexLock lock(&mutex_);
+    --segment->writers;
+  }
+  if (written != record_bytes) {
+    PLOG(ERROR) << "Short blob write to segment " << location->segment;
+    return false;
+  }
+  location->offset = start + sizeof(header) + key.size();
+  location->length = value.size();
+  return true;
+}
+
+bool BlobLog::Read(const Location& location, string* value) {
+  CHECK(value);
+  std::shared_ptr<Segment> segment = Find(location.segment);
+  if (!segment.get()) {
+    return false;
+  }
+  value->resize(location.length);
+  if (location.length > 0 &&
+      !ReadFully(segment->fd, location.offset, location.length,
+                 &((*value)[0]))) {
+    PLOG(ERROR) << "Short blob read at " << location.ToString();
+    value->clear();
+    return false;
+  }
+  return true;
+}
+
+bool BlobLog::Send(const Location& location, int64_t skip, int64_t count,
+                   int socket) {
+  std::shared_ptr<Segment> segment = Find(location.segment);
+  if (!segment.get() || skip < 0 || skip + count > location.length) {
+    return false;
+  }
+  off_t position = location.offset + skip;
+  while (count > 0) {
+#if defined(OS_LINUX)
+    const ssize_t sent =
+        HANDLE_EINTR(sendfile(socket, segment->fd, &position, count));
+#else
+    char buffer[64 << 10];
+    ssize_t sent = HANDLE_EINTR(pread(
+        segment->fd, buffer,
+        std::min<int64_t>(count, sizeof(buffer)), position));
+    if (sent > 0) {
+      sent = HANDLE_EINTR(send(socket, buffer, sent, 0));
+      position += std::max<ssize_t>(sent, 0);
+    }
+#endif
+    if (sent <= 0) {
+      PLOG(WARNING) << "Blob send failed at " << location.ToString();
+      return false;
+    }
+    count -= sent;
+  }
+  return true;
+}
+
+bool BlobLog::Sync(uint32_t segment) {
+  std::shared_ptr<Segment> file = Find(segment);
+  if (!file.get()) {
+    return false;
+  }
+#if defined(OS_LINUX)
+  const int ret = HANDLE_EINTR(fdatasync(file->fd));
+#else
+  const int ret = HANDLE_EINTR(fsync(file->fd));
+#endif
+  if (ret != 0) {
+    PLOG(ERROR) << "Cannot sync blob segment " << segment;
+    return false;
+  }
+  return true;
+}
+
+void BlobLog::SealedSegments(vector<uint32_t>* segments) {
+  CHECK(segments);
+  segments->clear();
+  ScopedMutexLock lock(&mutex_);
+  for (const auto& iter : segments_) {
+    if (iter.first != active_ && iter.second->writers == 0) {
+      segments->push_back(iter.first);
+    }
+  }
+}
+
+bool BlobLog::Scan(uint32_t segment, vector<Record>* records,
+                   int64_t* bytes) {
+  CHECK(records);
+  CHECK(bytes);
+  records->clear();
+  std::shared_ptr<Segment> file = Find(segment);
+  struct stat info;
+  if (!file.get() || fstat(file->fd, &info) != 0) {
+    return false;
+  }
+  *bytes = info.st_size;
+
+  int64_t position = 0;
+  RecordHeader header;
+  while (position + static_cast<int64_t>(sizeof(header)) <= *bytes) {
+    if (!ReadFully(file->fd, position, sizeof(header),
+                   reinterpret_cast<char*>(&header))) {
+      return false;
+    }
+    if (header.magic != kRecordMagic) {
+      LOG(ERROR) << "Corrupt blob segment " << segment << " at " << position;
+      return false;
+    }
+    const int64_t key_offset = position + sizeof(header);
+    const int64_t end =
+        key_offset + header.key_length + header.value_length;
+    if (end > *bytes) {
+      // Torn by a crash while it was being appended to.
+      break;
+    }
+
+    Record record;
+    record.key.resize(header.key_length);
+    if (header.key_length > 0 &&
+        !ReadFully(file->fd, key_offset, header.key_length,
+                   &(record.key[0]))) {
+      return false;
+    }
+    record.location.segment = segment;
+    record.location.offset = key_offset + header.key_length;
+    record.location.length = header.value_length;
+    records->push_back(record);
+    position = end;
+  }
+  return true;
+}
+
+void BlobLog::Remove(uint32_t segment) {
+  ScopedMutexLock lock(&mutex_);
+  CHECK(segment != active_);
+  if (segments_.erase(segment) == 0) {
+    return;
+  }
+  if (unlink(SegmentPath(segment).value().c_str()) != 0) {
+    PLOG(ERROR) << "Cannot remove blob segment " << segment;
+  }
+}
+
+bool BlobLog::Roll() {
+  const uint32_t next = active_ + 1;
+  const base::FilePath path = SegmentPath(next);
+  const int fd = HANDLE_EINTR(open(path.value().c_str(),
+                                   O_RDWR | O_CREAT | O_EXCL, 0600));
+  if (fd < 0) {
+    PLOG(ERROR) << "Cannot create " << path.value();
+    return false;
+  }
+  segments_[next].reset(new Segment(fd));
+  active_ = next;
+  active_bytes_ = 0;
+  return true;
+}
+
+base::FilePath BlobLog::SegmentPath(uint32_t segment) const {
+  return dir_.Append(base::StringPrintf("%08u.blob", segment));
+}
+
+std::shared_ptr<BlobLog::Segment> BlobLog::Find(uint32_t segment) {
+  ScopedMutexLock lock(&mutex_);
+  auto iter = segments_.find(segment);
+  if (iter == segments_.end()) {
+    return std::shared_ptr<Segment>();
+  }
+  return iter->second;
+}
+
+} // namespace lockbox
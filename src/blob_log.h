@@ -0,0 +1,129 @@
+// Append-only log of large values kept outside leveldb.
+//
+// Values are appended to numbered segment files in one directory, each framed
+// by its key and length so that a segment can be scanned for what it holds.
+// The caller stores the returned Location in leveldb instead of the value and
+// reads the value back with a single pread. Nothing is ever rewritten in place:
+// space held by dropped values is reclaimed a segment at a time, by appending
+// the segment's live values again and then removing it.
+//
+//  lockbox::BlobLog blobs(base::FilePath("/tmp/BLOBS"), 256 << 20, 64 << 10);
+//  CHECK(blobs.Open());
+//  lockbox::BlobLog::Location location;
+//  blobs.Append(key, value, &location);
+//  blobs.Read(location, &value);
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/files/file_path.h"
+
+using std::map;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace lockbox {
+
+class BlobLog {
+ public:
+  struct Location {
+    Location() : segment(0), offset(0), length(0) {}
+
+    // SEGMENT:OFFSET:LENGTH, as kept in leveldb.
+    string ToString() const;
+    static bool FromString(const string& str, Location* location);
+
+    uint32_t segment;
+
+    // Of the value within the segment file.
+    int64_t offset;
+    int64_t length;
+  };
+
+  struct Record {
+    string key;
+    Location location;
+  };
+
+  // Segments are rolled once they pass |segment_bytes|. Values shorter than
+  // |min_value_size| are better left in leveldb; see min_value_size().
+  BlobLog(const base::FilePath& dir, int64_t segment_bytes,
+          int64_t min_value_size);
+
+  ~BlobLog();
+
+  // Creates the directory if needed and opens the segments already in it.
+  // Appends always go to a new segment, so a tail torn by a crash is never
+  // written after.
+  bool Open();
+
+  int64_t min_value_size() const { return min_value_size_; }
+
+  // Appends |value|, filed under |key|, and sets |location| to where it went.
+  // Safe to call from several threads; the writes proceed in parallel.
+  bool Append(const string& key, const string& value, Location* location);
+
+  // Reads the value at |location|. Fails if its segment has been removed.
+  bool Read(const Location& location, string* value);
+
+  // Writes |count| bytes of the value at |location|, starting |skip| bytes in,
+  // to |socket| without copying them through user space. Fails without
+  // writing anything if the segment has been removed.
+  bool Send(const Location& location, int64_t skip, int64_t count,
+            int socket);
+
+  // Flushes what has been appended to |segment| to disk. Appends are not
+  // synced otherwise.
+  bool Sync(uint32_t segment);
+
+  // Sets |segments| to the segments no longer appended to, oldest first.
+  void SealedSegments(vector<uint32_t>* segments);
+
+  // Sets |records| to the records of sealed |segment| and |bytes| to its size.
+  bool Scan(uint32_t segment, vector<Record>* records, int64_t* bytes);
+
+  // Deletes |segment|. Reads already under way finish.
+  void Remove(uint32_t segment);
+
+ private:
+  struct Segment {
+    explicit Segment(int fd) : fd(fd), writers(0) {}
+    ~Segment();
+
+    const int fd;
+
+    // Appends that have reserved space in the segment but not yet written it.
+    // Requires |mutex_|.
+    int writers;
+  };
+
+  // Seals the segment being appended to and starts the next one. Requires
+  // |mutex_|.
+  bool Roll();
+
+  base::FilePath SegmentPath(uint32_t segment) const;
+
+  std::shared_ptr<Segment> Find(uint32_t segment);
+
+  const base::FilePath dir_;
+  const int64_t segment_bytes_;
+  const int64_t min_value_size_;
+
+  mutex mutex_;
+  map<uint32_t, std::shared_ptr<Segment> > segments_;
+
+  // The segment being appended to and the space reserved in it so far.
+  uint32_t active_;
+  int64_t active_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlobLog);
+};
+
+} // namespace lockbox
@@ -0,0 +1,303 @@
+#include "chunk_store.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <set>
+
+#include "base/logging.h"
+#include "base/posix/eintr_wrapper.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "hash_util.h"
+#include "scoped_mutex.h"
+
+using std::set;
+
+namespace lockbox {
+
+namespace {
+
+bool SendFully(int socket, const char* data, int64_t length) {
+  while (length > 0) {
+    const ssize_t count =
+        HANDLE_EINTR(send(socket, data, length, MSG_NOSIGNAL));
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    length -= count;
+  }
+  return true;
+}
+
+} // namespace
+
+ChunkStore::ChunkStore(DBManagerServer* manager, BlobLog* blobs)
+    : manager_(manager), blobs_(blobs) {
+  CHECK(manager);
+}
+
+ChunkStore::~ChunkStore() {
+}
+
+bool ChunkStore::Put(const string& data, string* hash) {
+  CHECK(hash);
+  hash->assign(SHA1Hex(data));
+
+  ScopedMutexLock lock(LockFor(*hash));
+  ChunkInfo info;
+  if (GetInfo(*hash, &info)) {
+    ++info.refs;
+    return SetInfo(*hash, info);
+  }
+
+  // Write the bytes before the reference so that a counted chunk always has
+  // its data.
+  info.refs = 1;
+  info.size = data.size();
+  if (blobs_ && info.size >= blobs_->min_value_size()) {
+    BlobLog::Location location;
+    if (!blobs_->Append(*hash, data, &location)) {
+      return false;
+    }
+    info.blob = location.ToString();
+  } else if (!manager_->Put(DBManager::Options(ServerDB::CHUNK_DATA, ""),
+                            *hash, data)) {
+    return false;
+  }
+  return SetInfo(*hash, info);
+}
+
+bool ChunkStore::AddRef(const string& hash, int64_t* size) {
+  CHECK(size);
+  ScopedMutexLock lock(LockFor(hash));
+  ChunkInfo info;
+  if (!GetInfo(hash, &info)) {
+    return false;
+  }
+  *size = info.size;
+  ++info.refs;
+  return SetInfo(hash, info);
+}
+
+bool ChunkStore::Release(const string& hash) {
+  ScopedMutexLock lock(LockFor(hash));
+  ChunkInfo info;
+  if (!GetInfo(hash, &info)) {
+    LOG(WARNING) << "Releasing unknown chunk " << hash;
+    return false;
+  }
+  if (info.refs > 1) {
+    --info.refs;
+    return SetInfo(hash, info);
+  }
+
+  // Bytes in the blob log stay there until their segment is compacted.
+  const bool deleted =
+      manager_->Delete(DBManager::Options(ServerDB::CHUNK_REFS, ""), hash);
+  if (!info.blob.empty()) {
+    return deleted;
+  }
+  return manager_->Delete(DBManager::Options(ServerDB::CHUNK_DATA, ""), hash);
+}
+
+bool ChunkStore::Contains(const string& hash) {
+  ChunkInfo info;
+  return GetInfo(hash, &info);
+}
+
+bool ChunkStore::Get(const string& hash, string* data) {
+  CHECK(data);
+  ChunkInfo info;
+  if (!GetInfo(hash, &info)) {
+    return false;
+  }
+  if (info.blob.empty()) {
+    return manager_->Get(DBManager::Options(ServerDB::CHUNK_DATA, ""),
+                         hash, data);
+  }
+  if (ReadBlob(info.blob, data)) {
+    return true;
+  }
+
+  // The chunk's segment may have been compacted away since |info| was read.
+  // Compaction moves chunks under their stripe, so this read sees where to.
+  ScopedMutexLock lock(LockFor(hash));
+  return GetInfo(hash, &info) && !info.blob.empty() &&
+      ReadBlob(info.blob, data);
+}
+
+bool ChunkStore::Sync(const vector<string>& hashes) {
+  map<uint32_t, vector<string> > by_segment;
+  ChunkInfo info;
+  for (const string& hash : hashes) {
+    BlobLog::Location location;
+    if (GetInfo(hash, &info) && !info.blob.empty() &&
+        BlobLog::Location::FromString(info.blob, &location)) {
+      by_segment[location.segment].push_back(hash);
+    }
+  }
+  for (const auto& iter : by_segment) {
+    if (blobs_ && blobs_->Sync(iter.first)) {
+      continue;
+    }
+    // The segment may have been compacted away since, which syncs the copies
+    // before pointing the references at them.
+    for (const string& hash : iter.second) {
+      BlobLog::Location location;
+      if (GetInfo(hash, &info) && !info.blob.empty() &&
+          BlobLog::Location::FromString(info.blob, &location) &&
+          location.segment == iter.first) {
+        return false;
+      }
+    }
+  }
+  return manager_->Sync(DBManager::Options(ServerDB::CHUNK_DATA, "")) &&
+      manager_->Sync(DBManager::Options(ServerDB::CHUNK_REFS, ""));
+}
+
+bool ChunkStore::Send(const string& hash, int64_t size, int64_t from,
+                      int64_t count, int socket) {
+  ChunkInfo info;
+  if (!GetInfo(hash, &info) || info.size != size || from < 0 ||
+      from + count > size) {
+    return false;
+  }
+  if (!info.blob.empty() && blobs_) {
+    BlobLog::Location location;
+    CHECK(BlobLog::Location::FromString(info.blob, &location)) << info.blob;
+    if (blobs_->Send(location, from, count, socket)) {
+      return true;
+    }
+
+    // Nothing was sent if the segment was compacted away meanwhile, in which
+    // case the chunk now lives elsewhere. Otherwise the socket failed.
+    const string failed = info.blob;
+    if (!GetInfo(hash, &info) || info.blob == failed) {
+      return false;
+    }
+  }
+
+  string data;
+  if (!Get(hash, &data) || static_cast<int64_t>(data.size()) != size) {
+    return false;
+  }
+  return SendFully(socket, data.data() + from, count);
+}
+
+void ChunkStore::BlobSegments(vector<uint32_t>* segments) {
+  CHECK(segments);
+  segments->clear();
+  if (blobs_) {
+    blobs_->SealedSegments(segments);
+  }
+}
+
+int64_t ChunkStore::CompactBlobSegment(uint32_t segment) {
+  vector<BlobLog::Record> records;
+  int64_t bytes = 0;
+  if (!blobs_ || !blobs_->Scan(segment, &records, &bytes)) {
+    return 0;
+  }
+
+  // A record is live while its chunk's reference still points at it.
+  vector<BlobLog::Record> live;
+  int64_t live_bytes = 0;
+  ChunkInfo info;
+  for (const BlobLog::Record& record : records) {
+    if (GetInfo(record.key, &info) &&
+        info.blob == record.location.ToString()) {
+      live.push_back(record);
+      live_bytes += record.location.length;
+    }
+  }
+  if (live_bytes * 2 >= bytes) {
+    return 0;
+  }
+
+  // Copy the live chunks forward and make the copies durable before any
+  // reference points at them, then make the references durable before the old
+  // copies go. A crash at any point leaves every chunk's reference pointing at
+  // bytes that are on disk.
+  string data;
+  vector<BlobLog::Location> moved(live.size());
+  vector<bool> was_moved(live.size(), false);
+  set<uint32_t> written;
+  for (size_t i = 0; i < live.size(); ++i) {
+    const BlobLog::Record& record = live[i];
+    ScopedMutexLock lock(LockFor(record.key));
+    if (!GetInfo(record.key, &info) ||
+        info.blob != record.location.ToString()) {
+      continue;  // Released since the scan.
+    }
+    if (!blobs_->Read(record.location, &data) ||
+        !blobs_->Append(record.key, data, &(moved[i]))) {
+      LOG(ERROR) << "Cannot move chunk " << record.key << " out of blob "
+                 << "segment " << segment;
+      return 0;
+    }
+    was_moved[i] = true;
+    written.insert(moved[i].segment);
+  }
+  for (uint32_t target : written) {
+    if (!blobs_->Sync(target)) {
+      return 0;
+    }
+  }
+
+  for (size_t i = 0; i < live.size(); ++i) {
+    const BlobLog::Record& record = live[i];
+    ScopedMutexLock lock(LockFor(record.key));
+    if (!was_moved[i] || !GetInfo(record.key, &info) ||
+        info.blob != record.location.ToString()) {
+      continue;  // Not moved, or released since; the copy is dead space.
+    }
+    info.blob = moved[i].ToString();
+    if (!SetInfo(record.key, info)) {
+      return 0;
+    }
+  }
+  if (!manager_->Sync(DBManager::Options(ServerDB::CHUNK_REFS, ""))) {
+    return 0;
+  }
+  blobs_->Remove(segment);
+  return bytes - live_bytes;
+}
+
+mutex* ChunkStore::LockFor(const string& hash) {
+  return &locks_[std::hash<string>()(hash) % kNumLockStripes];
+}
+
+bool ChunkStore::GetInfo(const string& hash, ChunkInfo* info) {
+  string value;
+  manager_->Get(DBManager::Options(ServerDB::CHUNK_REFS, ""), hash, &value);
+  vector<string> fields;
+  base::SplitString(value, ',', &fields);
+  if (fields.size() != 2 && fields.size() != 3) {
+    return false;
+  }
+  CHECK(base::StringToInt64(fields[0], &(info->refs))) << value;
+  CHECK(base::StringToInt64(fields[1], &(info->size))) << value;
+  info->blob = fields.size() == 3 ? fields[2] : "";
+  return info->refs > 0;
+}
+
+bool ChunkStore::SetInfo(const string& hash, const ChunkInfo& info) {
+  string value = base::Int64ToString(info.refs) + "," +
+      base::Int64ToString(info.size);
+  if (!info.blob.empty()) {
+    value += "," + info.blob;
+  }
+  return manager_->Put(DBManager::Options(ServerDB::CHUNK_REFS, ""), hash,
+                       value);
+}
+
+bool ChunkStore::ReadBlob(const string& blob, string* data) {
+  BlobLog::Location location;
+  CHECK(BlobLog::Location::FromString(blob, &location)) << blob;
+  return blobs_ && blobs_->Read(location, data);
+}
+
+} // namespace lockbox
@@ -0,0 +1,102 @@
+// Content-addressed chunk storage shared by every top dir on the server. Each
+// unique chunk is kept once in CHUNK_DATA under its SHA1, with a reference
+// count and size in CHUNK_REFS. Package manifests in TOP_DIR_MANIFEST hold one
+// reference per chunk they list.
+//
+// Given a BlobLog, chunks of at least its min_value_size() are appended to the
+// log instead, and CHUNK_REFS also records where. leveldb then only rewrites
+// the small reference rows as it compacts. Dropped chunks leave dead space in
+// the log until CompactBlobSegment() copies a segment's live chunks forward.
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "blob_log.h"
+#include "db_manager_server.h"
+
+using std::map;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace lockbox {
+
+class ChunkStore {
+ public:
+  // Does not take ownership of |manager| or |blobs|. |blobs| may be NULL to
+  // keep every chunk in leveldb.
+  ChunkStore(DBManagerServer* manager, BlobLog* blobs);
+
+  ~ChunkStore();
+
+  // Takes a reference on the chunk holding |data|, storing the bytes if this is
+  // the first reference. Sets |hash| to the chunk's SHA1.
+  bool Put(const string& data, string* hash);
+
+  // Takes a reference on the already stored chunk |hash|. Sets |size| to its
+  // length. Returns false if the chunk is unknown.
+  bool AddRef(const string& hash, int64_t* size);
+
+  // Drops a reference on |hash|, deleting the bytes with the last one.
+  bool Release(const string& hash);
+
+  bool Contains(const string& hash);
+
+  bool Get(const string& hash, string* data);
+
+  // Makes the bytes and references of chunks |hashes| durable, so that a
+  // synced write naming them survives a power loss.
+  bool Sync(const vector<string>& hashes);
+
+  // Writes |count| bytes of chunk |hash|, of |size| bytes, starting |from|
+  // bytes in, to |socket|.
+  bool Send(const string& hash, int64_t size, int64_t from, int64_t count,
+            int socket);
+
+  // Sets |segments| to the blob log segments that CompactBlobSegment() may
+  // work on.
+  void BlobSegments(vector<uint32_t>* segments);
+
+  // Removes |segment| from the blob log if less than half of it is still
+  // referenced, first appending the chunks that are again. Returns the number
+  // of bytes freed.
+  int64_t CompactBlobSegment(uint32_t segment);
+
+ private:
+  struct ChunkInfo {
+    ChunkInfo() : refs(0), size(0) {}
+
+    int64_t refs;
+    int64_t size;
+
+    // Where the chunk is in the blob log, or empty if it is in CHUNK_DATA.
+    string blob;
+  };
+
+  // Reference count updates are read-modify-write, so they are serialized per
+  // hash on one of these stripes.
+  static const int kNumLockStripes = 64;
+
+  mutex* LockFor(const string& hash);
+
+  // Returns false if |hash| is not stored.
+  bool GetInfo(const string& hash, ChunkInfo* info);
+
+  bool SetInfo(const string& hash, const ChunkInfo& info);
+
+  bool ReadBlob(const string& blob, string* data);
+
+  DBManagerServer* manager_;
+  BlobLog* blobs_;
+
+  mutex locks_[kNumLockStripes];
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkStore);
+};
+
+} // namespace lockbox
@@ -0,0 +1,110 @@
+#include "chunker.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+using std::min;
+
+namespace lockbox {
+
+namespace {
+
+// Bytes of history that influence the gear hash: each step shifts the hash
+// left by one, so older bytes fall off the top of the 64-bit value.
+const size_t kGearWindow = 64;
+
+// Random values per byte, generated with splitmix64 from a fixed seed. Clients
+// and servers must agree on this table for boundaries to line up.
+class GearTable {
+ public:
+  GearTable() {
+    uint64 state = 0x4c6f636b626f78ULL;
+    for (int i = 0; i < 256; i++) {
+      state += 0x9e3779b97f4a7c15ULL;
+      uint64 z = state;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      values_[i] = z ^ (z >> 31);
+    }
+  }
+
+  uint64 operator[](unsigned char byte) const {
+    return values_[byte];
+  }
+
+ private:
+  uint64 values_[256];
+};
+
+const GearTable& Gear() {
+  static const GearTable table;
+  return table;
+}
+
+// Tests the top bits of the hash, which depend on the whole window, rather than
+// the bottom bits, which depend only on the last few bytes.
+uint64 BoundaryMask(size_t avg_size) {
+  int bits = 0;
+  while ((static_cast<size_t>(1) << bits) < avg_size) {
+    bits++;
+  }
+  return bits == 0 ? 0 : (~static_cast<uint64>(0)) << (64 - bits);
+}
+
+} // namespace
+
+ContentChunker::ContentChunker(size_t min_size, size_t avg_size,
+                               size_t max_size)
+    : min_size_(min_size),
+      max_size_(max_size),
+      mask_(BoundaryMask(avg_size)) {
+  CHECK(avg_size > 0 && (avg_size & (avg_size - 1)) == 0) << avg_size;
+  CHECK(min_size < avg_size && avg_size < max_size);
+}
+
+ContentChunker::ContentChunker()
+    : min_size_(kMinChunkSize),
+      max_size_(kMaxContentChunkSize),
+      mask_(BoundaryMask(kAvgChunkSize)) {
+}
+
+void ContentChunker::Split(const char* data, size_t size,
+                           vector<size_t>* lengths) const {
+  CHECK(lengths);
+  lengths->clear();
+
+  size_t offset = 0;
+  while (offset < size) {
+    const size_t length = NextBoundary(data + offset, size - offset);
+    lengths->push_back(length);
+    offset += length;
+  }
+}
+
+size_t ContentChunker::NextBoundary(const char* data, size_t size) const {
+  if (size <= min_size_) {
+    return size;
+  }
+
+  const GearTable& gear = Gear();
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  const size_t end = min(size, max_size_);
+
+  // Warm the hash over the window preceding the first candidate boundary.
+  uint64 hash = 0;
+  size_t i = min_size_ > kGearWindow ? min_size_ - kGearWindow : 0;
+  for (; i < min_size_; i++) {
+    hash = (hash << 1) + gear[bytes[i]];
+  }
+
+  for (; i < end; i++) {
+    hash = (hash << 1) + gear[bytes[i]];
+    if ((hash & mask_) == 0) {
+      return i + 1;
+    }
+  }
+  return end;
+}
+
+} // namespace lockbox
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "base/basictypes.h"
+
+using std::vector;
+
+namespace lockbox {
+
+const size_t kMinChunkSize = 256 << 10;
+const size_t kAvgChunkSize = 1 << 20;
+const size_t kMaxContentChunkSize = 4 << 20;
+
+// Splits data at content-defined boundaries picked by a gear rolling hash. A
+// boundary depends only on the bytes just before it, so an insertion or
+// deletion changes the chunks around the edit rather than every chunk after
+// it. Identical runs of bytes therefore split into identical chunks, which the
+// server stores once.
+class ContentChunker {
+ public:
+  // |avg_size| must be a power of two.
+  ContentChunker(size_t min_size, size_t avg_size, size_t max_size);
+
+  ContentChunker();
+
+  // Sets |lengths| to the lengths of the consecutive chunks of |data|.
+  void Split(const char* data, size_t size, vector<size_t>* lengths) const;
+
+ private:
+  size_t NextBoundary(const char* data, size_t size) const;
+
+  const size_t min_size_;
+  const size_t max_size_;
+  const uint64 mask_;
+
+  DISALLOW_COPY_AND_ASSIGN(ContentChunker);
+};
+
+} // namespace lockbox
@@ -0,0 +1,132 @@
+#include "chunker.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "testing/gtest/include/gtest/gtest.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace lockbox {
+namespace {
+
+// Small sizes keep the inputs small while exercising every rule.
+const size_t kMin = 256;
+const size_t kAvg = 1024;
+const size_t kMax = 4096;
+
+// Deterministic bytes, the same on every platform.
+string FixedData(size_t size, uint32_t seed) {
+  string data(size, '\0');
+  uint32_t state = seed;
+  for (size_t i = 0; i < size; ++i) {
+    state = state * 1103515245u + 12345u;
+    data[i] = static_cast<char>(state >> 24);
+  }
+  return data;
+}
+
+vector<string> Chunks(const ContentChunker& chunker, const string& data) {
+  vector<size_t> lengths;
+  chunker.Split(data.data(), data.size(), &lengths);
+  vector<string> chunks;
+  size_t offset = 0;
+  for (size_t length : lengths) {
+    chunks.push_back(data.substr(offset, length));
+    offset += length;
+  }
+  EXPECT_EQ(data.size(), offset);
+  return chunks;
+}
+
+} // namespace
+
+TEST(ContentChunkerTest, EmptyAndShortInput) {
+  const ContentChunker chunker(kMin, kAvg, kMax);
+  vector<size_t> lengths;
+  chunker.Split("", 0, &lengths);
+  EXPECT_TRUE(lengths.empty());
+
+  const string data = FixedData(kMin, 1);
+  chunker.Split(data.data(), data.size(), &lengths);
+  ASSERT_EQ(1u, lengths.size());
+  EXPECT_EQ(kMin, lengths[0]);
+}
+
+// Clients and servers must agree on where chunks end; a change to the gear
+// table or the boundary test shows up here.
+TEST(ContentChunkerTest, PinnedBoundaries) {
+  const ContentChunker chunker(kMin, kAvg, kMax);
+  const string data = FixedData(16 << 10, 1);
+  vector<size_t> lengths;
+  chunker.Split(data.data(), data.size(), &lengths);
+
+  const size_t expected[] = {
+    609, 448, 997, 316, 707, 1043, 654, 2495, 2764, 403, 2703, 485, 459, 1771,
+    530,
+  };
+  EXPECT_EQ(vector<size_t>(expected, expected + arraysize(expected)),
+            lengths);
+}
+
+TEST(ContentChunkerTest, RespectsMinAndMaxSizes) {
+  const ContentChunker chunker(kMin, kAvg, kMax);
+  const string data = FixedData(1 << 20, 2);
+  vector<size_t> lengths;
+  chunker.Split(data.data(), data.size(), &lengths);
+  ASSERT_GT(lengths.size(), 1u);
+  for (size_t i = 0; i + 1 < lengths.size(); ++i) {
+    EXPECT_GE(lengths[i], kMin) << i;
+    EXPECT_LE(lengths[i], kMax) << i;
+  }
+  EXPECT_LE(lengths.back(), kMax);
+
+  // Without content boundaries, every chunk but the last is cut at the max.
+  const string zeros(10 * kMax + 100, '\0');
+  chunker.Split(zeros.data(), zeros.size(), &lengths);
+  ASSERT_EQ(11u, lengths.size());
+  for (size_t i = 0; i < 10; ++i) {
+    EXPECT_EQ(kMax, lengths[i]) << i;
+  }
+  EXPECT_EQ(100u, lengths.back());
+}
+
+TEST(ContentChunkerTest, InsertionOnlyChangesNearbyChunks) {
+  const ContentChunker chunker(kMin, kAvg, kMax);
+  const string data = FixedData(256 << 10, 3);
+  string edited = data;
+  edited.insert(data.size() / 2, "inserted bytes");
+
+  const vector<string> before = Chunks(chunker, data);
+  const vector<string> after = Chunks(chunker, edited);
+
+  // Chunks wholly before the edit are kept, and past it the boundaries line up
+  // again within a chunk or two, so only the chunks around it are new.
+  map<string, int> unmatched;
+  for (const string& chunk : before) {
+    ++unmatched[chunk];
+  }
+  size_t changed = 0;
+  for (const string& chunk : after) {
+    if (unmatched[chunk] > 0) {
+      --unmatched[chunk];
+    } else {
+      ++changed;
+    }
+  }
+  EXPECT_GE(changed, 1u);
+  EXPECT_LE(changed, 3u);
+  EXPECT_GT(before.size(), 50u);
+
+  // The edit cannot move the boundaries before it.
+  size_t offset = 0;
+  for (size_t i = 0; offset + before[i].size() <= data.size() / 2; ++i) {
+    EXPECT_EQ(before[i], after[i]) << i;
+    offset += before[i].size();
+  }
+}
+
+} // namespace lockbox
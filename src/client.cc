@@ -1,21 +1,34 @@
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "base/basictypes.h"
 #include "base/file_util.h"
 #include "base/memory/scoped_ptr.h"
+#include "base/posix/eintr_wrapper.h"
 #include "base/strings/string_number_conversions.h"
 #include "base/strings/string_split.h"
+#include "chunker.h"
 #include "client.h"
 #include "crypto/openssl_util.h"
 #include "crypto/rsa_private_key.h"
 #include "db_manager_client.h"
 #include "file_event_queue_handler.h"
+#include "file_index.h"
 #include "file_util.h"
 #include "file_watcher_thread.h"
+#include "hash_util.h"
 #include "gflags/gflags.h"
 #include "leveldb/db.h"
 #include "lockbox_types.h"
+#include "package_util.h"
 #include "queue_filter.h"
 #include "rsa.h"
 #include "rsa_public_key_openssl.h"
@@ -23,9 +36,13 @@
 #include <openssl/bio.h>
 #include <openssl/x509.h>
 
+DECLARE_int32(file_event_workers);
+DECLARE_int32(file_index_threads);
 DECLARE_string(register_top_dir);
 DECLARE_string(share);
 
+using std::set;
+
 namespace lockbox {
 
 void Client::RegisterUser() {
@@ -84,6 +101,7 @@ void Client::RegisterUser() {
 
 void Client::Start() {
   // Prepare to start the various watchers.
+  map<TopDirID, lockbox::FileIndex*> top_dir_indexes;
   map<TopDirID, lockbox::FileWatcherThread*> top_dir_watchers;
   map<TopDirID, lockbox::FileEventQueueHandler*> top_dir_queues;
 
@@ -123,8 +141,7 @@ void Client::Start() {
   DBManagerClient::Options options;
   options.type = lockbox::ClientDB::TOP_DIR_LOCATION;
   options.name.clear();
-  leveldb::DB* db = dbm_->db(options);
-  scoped_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+  scoped_ptr<leveldb::Iterator> it(dbm_->NewIterator(options));
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
     // Get the TOP DIR id.
     const TopDirID& top_dir_id = it->key().ToString();
@@ -140,23 +157,32 @@ void Client::Start() {
     options.type = ClientDB::RELPATH_LOCK;
     dbm_->Clean(options);
 
-    // Per top directory init and start.
+    // Per top directory init and start. Only the files changed since the last
+    // run are queued.
+    lockbox::FileIndex* file_index =
+        new lockbox::FileIndex(dbm_, top_dir_id, abs_path,
+                               FLAGS_file_index_threads);
+    top_dir_indexes[top_dir_id] = file_index;
+
     lockbox::FileWatcherThread* file_watcher =
         new lockbox::FileWatcherThread(dbm_);
     file_watcher->Start();
-    file_watcher->AddDirectory(abs_path, true /* recursive */);
+    file_watcher->AddIndexedDirectory(abs_path, file_index);
     LOG(INFO) << "Starting watcher for " << top_dir_id << " --> "
               << abs_path;
     top_dir_watchers[top_dir_id] = file_watcher;
 
     lockbox::FileEventQueueHandler* event_queue =
         new lockbox::FileEventQueueHandler(top_dir_id, dbm_, this, &encryptor,
-                                           user_auth_);
+                                           user_auth_, file_index,
+                                           FLAGS_file_event_workers);
     top_dir_queues[top_dir_id] = event_queue;
   }
 
-  // With DBs started, we can start interacting with the updates/server.
-  UpdateFromServer update_from_server(user_auth_, this, dbm_);
+  // With DBs started, we can start interacting with the updates/server. Waiting
+  // for updates holds the connection for a while, so it gets its own.
+  Client updates_client(conn_info_, user_auth_, dbm_);
+  UpdateFromServer update_from_server(user_auth_, &updates_client, dbm_);
 
   // Use the top dir locations to seed the watcher.
 
@@ -200,4 +226,152 @@ void Client::Share() {
 void Client::RegisterTopDir() {
 }
 
+int64 Client::UploadPackageChunked(const RemotePackage& pkg) {
+  RemotePackage header;
+  CopyPackageHeader(pkg, &header);
+
+  string upload_id;
+  Exec<void, string&, const UserAuth&, const RemotePackage&>(
+      &LockboxServiceClient::BeginUpload, upload_id, *user_auth_, header);
+  CHECK(!upload_id.empty());
+
+  // Split at content-defined boundaries so that unchanged runs of the payload
+  // produce the same chunks as before and need not be sent again.
+  const string& data = pkg.payload.data;
+  vector<size_t> lengths;
+  ContentChunker().Split(data.data(), data.size(), &lengths);
+  vector<string> hashes;
+  size_t position = 0;
+  for (size_t length : lengths) {
+    hashes.push_back(SHA1Hex(data.substr(position, length)));
+    position += length;
+  }
+
+  PackageChunk chunk;
+  chunk.upload_id = upload_id;
+  size_t offset = 0;
+  for (size_t begin = 0; begin < lengths.size(); begin += kMissingChunksBatch) {
+    const size_t end = std::min(begin + kMissingChunksBatch, lengths.size());
+    vector<string> batch(hashes.begin() + begin, hashes.begin() + end);
+    vector<string> missing_list;
+    Exec<void, vector<string>&, const UserAuth&, const vector<string>&,
+         const string&>(&LockboxServiceClient::MissingChunks, missing_list,
+                        *user_auth_, batch, header.top_dir);
+    const set<string> missing(missing_list.begin(), missing_list.end());
+
+    for (size_t i = begin; i < end; ++i) {
+      chunk.offset = offset;
+      chunk.chunk_sha1 = hashes[i];
+      if (missing.count(hashes[i]) > 0) {
+        chunk.data.assign(data, offset, lengths[i]);
+      } else {
+        chunk.data.clear();
+      }
+      const int64 received =
+          Exec<int64, const UserAuth&, const PackageChunk&>(
+              &LockboxServiceClient::AppendChunk, *user_auth_, chunk);
+      CHECK(received == static_cast<int64>(offset + lengths[i]))
+          << "Chunk rejected at " << offset << " for " << pkg.rel_path_id;
+      offset += lengths[i];
+    }
+  }
+
+  return Exec<int64, const UserAuth&, const string&>(
+      &LockboxServiceClient::CommitUpload, *user_auth_, upload_id);
+}
+
+void Client::DownloadPackageChunked(const DownloadRequest& request,
+                                    RemotePackage* pkg) {
+  CHECK(pkg);
+  Exec<void, RemotePackage&, const DownloadRequest&>(
+      &LockboxServiceClient::DownloadPackageHeader, *pkg, request);
+
+  string& data = pkg->payload.data;
+  data.reserve(pkg->payload_size);
+
+  // Whatever the side channel does not deliver is fetched through Thrift.
+  DownloadTicket ticket;
+  Exec<void, DownloadTicket&, const DownloadRequest&>(
+      &LockboxServiceClient::GetDownloadTicket, ticket, request);
+  if (!ticket.ticket.empty() && !StreamPayload(ticket, &data)) {
+    LOG(WARNING) << "Download side channel failed for " << request.pkg_name
+                 << " after " << data.size() << " bytes";
+  }
+
+  string range;
+  while (static_cast<int64>(data.size()) < pkg->payload_size) {
+    Exec<void, string&, const DownloadRequest&, int64_t, int32_t>(
+        &LockboxServiceClient::DownloadRange, range, request,
+        static_cast<int64_t>(data.size()), kPackageChunkSize);
+    CHECK(!range.empty()) << "Short download for " << request.pkg_name;
+    data.append(range);
+  }
+}
+
+int Client::ConnectSideChannel(int port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addresses = NULL;
+  if (getaddrinfo(conn_info_.host.c_str(), base::IntToString(port).c_str(),
+                  &hints, &addresses) != 0) {
+    return -1;
+  }
+  int socket_fd = -1;
+  for (struct addrinfo* address = addresses; address;
+       address = address->ai_next) {
+    socket_fd = socket(address->ai_family, address->ai_socktype,
+                       address->ai_protocol);
+    if (socket_fd < 0) {
+      continue;
+    }
+    if (HANDLE_EINTR(connect(socket_fd, address->ai_addr,
+                             address->ai_addrlen)) == 0) {
+      break;
+    }
+    close(socket_fd);
+    socket_fd = -1;
+  }
+  freeaddrinfo(addresses);
+  return socket_fd;
+}
+
+bool Client::StreamPayload(const DownloadTicket& ticket, string* data) {
+  const int socket_fd = ConnectSideChannel(ticket.port);
+  if (socket_fd < 0) {
+    return false;
+  }
+
+  const string request =
+      ticket.ticket + " " + base::Int64ToString(data->size()) + "\n";
+  unsigned char prefix[8];
+  int64 length = 0;
+  bool ok = HANDLE_EINTR(send(socket_fd, request.data(), request.size(),
+                              MSG_NOSIGNAL)) ==
+      static_cast<ssize_t>(request.size()) &&
+      HANDLE_EINTR(recv(socket_fd, prefix, sizeof(prefix), MSG_WAITALL)) ==
+      static_cast<ssize_t>(sizeof(prefix));
+  if (ok) {
+    for (int i = 0; i < 8; ++i) {
+      length = (length << 8) | prefix[i];
+    }
+    ok = static_cast<int64>(data->size()) + length == ticket.payload_size;
+  }
+
+  char buffer[64 << 10];
+  while (ok && length > 0) {
+    const ssize_t count = HANDLE_EINTR(recv(
+        socket_fd, buffer, std::min<int64>(length, sizeof(buffer)), 0));
+    if (count <= 0) {
+      ok = false;
+      break;
+    }
+    data->append(buffer, count);
+    length -= count;
+  }
+  close(socket_fd);
+  return ok;
+}
+
 } // namespace lockbox
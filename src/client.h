@@ -20,6 +20,7 @@
 #include <thrift/transport/TSocket.h>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
 
 #include "scoped_mutex.h"
 #include "db_manager_client.h"
@@ -33,13 +34,23 @@ namespace lockbox {
 
 const int kNumTransportAttempts = 3;
 
+// Payload bytes requested per DownloadRange.
+const int kPackageChunkSize = 1 << 20;
+
+// Chunk hashes checked per MissingChunks call.
+const size_t kMissingChunksBatch = 256;
+
 class Client {
  public:
   struct ConnInfo {
-    ConnInfo(std::string host, int port) : host(host), port(port) {}
+    ConnInfo(std::string host, int port)
+        : host(host), port(port), compact_protocol(false) {}
 
     std::string host;
     int port;
+
+    // Must match the server's --compact_protocol.
+    bool compact_protocol;
   };
 
   // Does not take ownership of |user_auth| or |dbm|.
@@ -47,16 +58,17 @@ class Client {
     : socket_(new apache::thrift::transport::TSocket(conn_info.host,
                                                        conn_info.port)),
       transport_(new apache::thrift::transport::TFramedTransport(socket_)),
-      protocol_(new apache::thrift::protocol::TBinaryProtocol(transport_)),
+      protocol_(NewProtocol(transport_, conn_info.compact_protocol)),
       service_client_(protocol_),
-      host_(conn_info.host),
-      port_(conn_info.port),
+      conn_info_(conn_info),
       user_auth_(user_auth),
       dbm_(dbm) {
   }
 
   virtual ~Client() {}
 
+  const ConnInfo& conn_info() const { return conn_info_; }
+
   void RegisterUser();
 
   void RegisterTopDir();
@@ -65,6 +77,20 @@ class Client {
 
   void Start();
 
+  // Sends |pkg| through the chunked upload API, kPackageChunkSize bytes at a
+  // time. Returns the number of payload bytes stored on the server.
+  int64 UploadPackageChunked(const RemotePackage& pkg);
+
+  // Fetches the package named by |request|, streaming the payload from the
+  // server's download side channel if it has one and through the chunked
+  // download API otherwise.
+  void DownloadPackageChunked(const DownloadRequest& request,
+                              RemotePackage* pkg);
+
+  // Opens a connection to |port| of the server's host, for its side channels.
+  // Returns the socket, or -1.
+  int ConnectSideChannel(int port);
+
   // Driver for the LockboxServiceClient code.
   template <typename R, typename... Args>
   R Exec(R(LockboxServiceClient::*func)(Args...), Args... args) {
@@ -74,6 +100,22 @@ class Client {
   }
 
  private:
+  // Appends to |data| the payload named by |ticket| from offset data->size()
+  // on. Returns false if the side channel failed; |data| then holds what
+  // arrived before it did.
+  bool StreamPayload(const DownloadTicket& ticket, string* data);
+
+  static boost::shared_ptr<apache::thrift::protocol::TProtocol> NewProtocol(
+      boost::shared_ptr<apache::thrift::transport::TTransport> transport,
+      bool compact) {
+    if (compact) {
+      return boost::shared_ptr<apache::thrift::protocol::TProtocol>(
+          new apache::thrift::protocol::TCompactProtocol(transport));
+    }
+    return boost::shared_ptr<apache::thrift::protocol::TProtocol>(
+        new apache::thrift::protocol::TBinaryProtocol(transport));
+  }
+
   // Specialized driver for the Thrift API. In particular, the template wrappers
   // are necessary to account for some void return types given that the Thrift
   // code offers functions with void and non-void return types.
@@ -144,8 +186,7 @@ class Client {
   LockboxServiceClient service_client_;
   mutex socket_mutex_;
 
-  std::string host_;
-  int port_;
+  ConnInfo conn_info_;
   UserAuth* user_auth_;
   DBManagerClient* dbm_;
 };
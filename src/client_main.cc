@@ -11,6 +11,8 @@
 
 DEFINE_string(host, "", "Host to connect to for service.");
 DEFINE_int32(port, 8888, "Port to connect to for host.");
+DEFINE_bool(compact_protocol, false,
+            "Speak TCompactProtocol; must match the server.");
 
 DEFINE_string(email, "", "User's email address.");
 DEFINE_string(password, "", "User's password");
@@ -24,6 +26,11 @@ DEFINE_string(unregister_top_dir, "",
                 "Absolute path to new directory (requires restart).");
 
 DEFINE_bool(daemon, true, "Run the app as daemon monitoring process.");
+DEFINE_int32(file_event_workers, 4,
+             "Files of each top directory synced in parallel, each over its "
+             "own connection.");
+DEFINE_int32(file_index_threads, 8,
+             "Threads statting and, where changed, hashing files at startup.");
 
 DEFINE_string(share, "", "Comma-separated value: DIRECTORY,EMAIL");
 DEFINE_string(unshare, "", "Comma-separated value: DIRECTORY,EMAIL");
@@ -32,6 +39,7 @@ int main(int argc, char **argv) {
   google::ParseCommandLineFlags(&argc, &argv, false);
 
   lockbox::Client::ConnInfo conn_info(FLAGS_host, FLAGS_port);
+  conn_info.compact_protocol = FLAGS_compact_protocol;
   lockbox::DBManagerClient client_db(FLAGS_config_path);
 
   lockbox::UserAuth user_auth;
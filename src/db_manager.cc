@@ -1,40 +1,129 @@
 #include "db_manager.h"
+
+#include <chrono>
+#include <functional>
+
 #include "lockbox_types.h"
 #include "leveldb_util.h"
 
+#include "base/file_util.h"
 #include "base/files/file_path.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/strings/string_number_conversions.h"
 #include "base/strings/string_split.h"
 #include "base/string_util.h"
 #include "base/stl_util.h"
+#include "base/stringprintf.h"
 #include "base/logging.h"
 #include "leveldb/write_batch.h"
 #include "leveldb/db.h"
 #include "guid_creator.h"
+#include "scoped_mutex.h"
+#include "trace.h"
 
 using base::FilePath;
 
 namespace lockbox {
 
+namespace {
+
+// FNV-1a, which keeps a table on the same shard from one run to the next.
+uint32_t HashTableKey(const string& key) {
+  uint32_t hash = 2166136261u;
+  for (char c : key) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Records how the tables are laid out under the database base directory, as
+// "shards=N", zero meaning one database per table.
+const char kLayoutFile[] = "LAYOUT";
+
+} // namespace
+
 DBManager::DBManager(const string& db_location_base,
-                     const map<int, const char*> values_to_names)
+                     const map<int, const char*> values_to_names,
+                     const StoreOptions& store_options)
     : db_location_base_(db_location_base),
-      values_to_names_(values_to_names) {
+      values_to_names_(values_to_names),
+      store_options_(store_options),
+      block_cache_(leveldb::NewLRUCache(store_options.block_cache_bytes)) {
+  db_options_.create_if_missing = true;
+  db_options_.block_cache = block_cache_.get();
+
+  CheckLayout();
+
+  if (store_options_.shards > 0) {
+    db_options_.write_buffer_size =
+        store_options_.write_buffer_bytes / store_options_.shards;
+    for (int i = 0; i < store_options_.shards; ++i) {
+      const string path = FilePath(db_location_base_).Append(
+          base::StringPrintf("SHARD_%03d", i)).value();
+      LOG(INFO) << "Opening shard " << path;
+      shards_.push_back(std::shared_ptr<leveldb::DB>(
+          OpenDB(path, db_options_)));
+    }
+  }
+}
+
+void DBManager::CheckLayout() {
+  const FilePath base(db_location_base_);
+  const FilePath marker = base.Append(kLayoutFile);
+  const string wanted = base::StringPrintf("shards=%d\n",
+                                           store_options_.shards);
+
+  string found;
+  if (file_util::ReadFileToString(marker, &found)) {
+    LOG_IF(FATAL, found != wanted)
+        << "The databases under " << db_location_base_ << " were created with "
+        << found.substr(0, found.find('\n')) << " but this run asks for "
+        << wanted.substr(0, wanted.size() - 1) << ". Changing the layout would "
+        << "open empty databases in place of the stored ones, and no migration "
+        << "between layouts is provided.";
+    return;
+  }
+
+  // Stores created before the marker: infer their layout from what is on disk.
+  int shards = 0;
+  while (file_util::DirectoryExists(
+             base.Append(base::StringPrintf("SHARD_%03d", shards)))) {
+    ++shards;
+  }
+  bool tables = false;
+  for (auto& iter : values_to_names_) {
+    tables = tables || file_util::DirectoryExists(base.Append(iter.second));
+  }
+  LOG_IF(FATAL, shards > 0 && tables)
+      << "Both sharded and per-table databases are under "
+      << db_location_base_ << "; cannot tell which layout is in use.";
+  if (shards > 0 || tables) {
+    LOG_IF(FATAL, shards != store_options_.shards)
+        << "The databases under " << db_location_base_ << " were created with "
+        << "shards=" << shards << " but this run asks for "
+        << wanted.substr(0, wanted.size() - 1) << ", and no migration between "
+        << "layouts is provided.";
+  }
+
+  CHECK(file_util::CreateDirectory(base)) << db_location_base_;
+  CHECK_EQ(static_cast<int>(wanted.size()),
+           file_util::WriteFile(marker, wanted.data(), wanted.size()))
+      << "Cannot write " << marker.value();
 }
 
 DBManager::~DBManager() {
-  STLDeleteContainerPairSecondPointers(db_map_.begin(), db_map_.end());
+  // Close the databases before the cache they share.
+  db_map_.clear();
+  shards_.clear();
 }
 
 // TODO(tierney): Refactor for check.
 bool DBManager::Get(const Options& options,
                     const string& key,
                     string* value) {
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  leveldb::DB* db = iter->second;
-  leveldb::Status s = db->Get(leveldb::ReadOptions(), key, value);
+  const Table t = table(options);
+  leveldb::Status s = t.db->Get(leveldb::ReadOptions(), t.prefix + key, value);
   return s.ok();
 }
 
@@ -44,10 +133,7 @@ bool DBManager::GetList(const Options& options,
   CHECK(values);
   values->clear();
 
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  leveldb::DB* db = iter->second;
-  leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
+  scoped_ptr<leveldb::Iterator> it(NewIterator(options));
   for (it->Seek(key_prefix);
        it->Valid() && StartsWithASCII(it->key().ToString(), key_prefix,
                                       true /* case sensitive */);
@@ -63,29 +149,54 @@ bool DBManager::GetMap(const Options& options,
   CHECK(kvs);
   kvs->clear();
 
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  leveldb::DB* db = iter->second;
-  leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
+  scoped_ptr<leveldb::Iterator> it(NewIterator(options));
   for (it->Seek(key_prefix);
        it->Valid() && StartsWithASCII(it->key().ToString(), key_prefix,
                                       true /* case sensitive */);
        it->Next()) {
-    LOG(INFO) << "Adding update (key): " << it->key().ToString();
     kvs->insert(make_pair(it->key().ToString(), it->value().ToString()));
   }
   return (!kvs->empty());
 }
 
+bool DBManager::GetMapPage(const Options& options,
+                           const string& key_prefix,
+                           const string& start_after,
+                           size_t max,
+                           map<string, string>* kvs,
+                           bool* more) {
+  CHECK(kvs);
+  CHECK(more);
+  kvs->clear();
+  *more = false;
+
+  scoped_ptr<leveldb::Iterator> it(NewIterator(options));
+  if (start_after.empty()) {
+    it->Seek(key_prefix);
+  } else {
+    it->Seek(start_after);
+    if (it->Valid() && it->key() == leveldb::Slice(start_after)) {
+      it->Next();
+    }
+  }
+  for (; it->Valid() && StartsWithASCII(it->key().ToString(), key_prefix,
+                                        true /* case sensitive */);
+       it->Next()) {
+    if (kvs->size() == max) {
+      *more = true;
+      break;
+    }
+    kvs->insert(kvs->end(),
+                make_pair(it->key().ToString(), it->value().ToString()));
+  }
+  return (!kvs->empty());
+}
+
 bool DBManager::Put(const Options& options,
                     const string& key,
                     const string& value) {
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end())
-      << values_to_names_.find(options.type)->second
-      << " " << options.name;
-  leveldb::DB* db = iter->second;
-  leveldb::Status s = db->Put(leveldb::WriteOptions(), key, value);
+  const Table t = table(options);
+  leveldb::Status s = t.db->Put(leveldb::WriteOptions(), t.prefix + key, value);
   return s.ok();
 }
 
@@ -93,41 +204,102 @@ bool DBManager::Put(const Options& options,
 bool DBManager::Append(const Options& options,
                        const string& key_prefix,
                        const string& new_value) {
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  leveldb::DB* db = iter->second;
-
-  // Gen key.
-
-  // Gen GUID.
-  const string guid = CreateGUIDString();
-  const string key_guid = key_prefix + "_" + guid;
+  const Table t = table(options);
 
   // Write the key_GUID.
-  LOG(INFO) << "Appending " << key_guid << " : " << new_value;
-  db->Put(leveldb::WriteOptions(), key_guid, new_value);
+  const string key_guid = AppendKey(key_prefix);
+  TRACE(2) << "Appending " << key_guid << " (" << new_value.size() << ")";
+  t.db->Put(leveldb::WriteOptions(), t.prefix + key_guid, new_value);
 
   return true;
 }
 
 bool DBManager::Delete(const Options& options, const string& key) {
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  leveldb::DB* db = iter->second;
-  leveldb::Status s = db->Delete(leveldb::WriteOptions(), key);
+  const Table t = table(options);
+  leveldb::Status s = t.db->Delete(leveldb::WriteOptions(), t.prefix + key);
+  return s.ok();
+}
+
+bool DBManager::DeleteRange(const Options& options, const string& first_key,
+                            const string& last_key, size_t expected) {
+  const Table t = table(options);
+  scoped_ptr<leveldb::Iterator> it(NewIterator(options));
+  leveldb::WriteBatch batch;
+  size_t found = 0;
+  for (it->Seek(first_key);
+       it->Valid() && it->key().compare(leveldb::Slice(last_key)) <= 0;
+       it->Next()) {
+    if (++found > expected) {
+      return false;
+    }
+    batch.Delete(t.prefix + it->key().ToString());
+  }
+  if (found != expected) {
+    return false;
+  }
+  leveldb::Status s = t.db->Write(leveldb::WriteOptions(), &batch);
   return s.ok();
 }
 
+void DBManager::CompactRange(const Options& options, const string& first_key,
+                             const string& last_key) {
+  const Table t = table(options);
+  const string begin = t.prefix + first_key;
+  const string end = t.prefix + last_key;
+  leveldb::Slice begin_slice(begin);
+  leveldb::Slice end_slice(end);
+  t.db->CompactRange(&begin_slice, &end_slice);
+}
+
+bool DBManager::Write(Batch* batch, bool sync) {
+  CHECK(batch);
+  bool ret = true;
+  for (auto iter = batch->writes_.begin(); iter != batch->writes_.end();
+       ++iter) {
+    leveldb::WriteOptions write_options;
+    write_options.sync = sync;
+    leveldb::Status s = iter->first->Write(write_options, &(iter->second));
+    if (!s.ok()) {
+      LOG(ERROR) << "Batch write failed: " << s.ToString();
+      ret = false;
+    }
+  }
+  batch->writes_.clear();
+  return ret;
+}
+
+bool DBManager::Sync(const Options& options) {
+  const Table t = table(options);
+  leveldb::WriteOptions write_options;
+  write_options.sync = true;
+  // leveldb logs and syncs even an empty batch, and with it everything
+  // written before.
+  leveldb::WriteBatch empty;
+  leveldb::Status s = t.db->Write(write_options, &empty);
+  if (!s.ok()) {
+    LOG(ERROR) << "Sync failed: " << s.ToString();
+    return false;
+  }
+  return true;
+}
+
+string DBManager::AppendKey(const string& key_prefix) {
+  // Microseconds since the epoch, zero-padded so that keys sort by time, and a
+  // GUID to keep keys generated in the same microsecond apart.
+  const int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  return base::StringPrintf("%s_%020lld-%s", key_prefix.c_str(),
+                            static_cast<long long>(now_us),
+                            CreateGUIDString().c_str());
+}
+
 bool DBManager::First(const Options& options, string* key, string* value) {
   CHECK(key);
   CHECK(value);
   key->clear();
   value->clear();
 
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  leveldb::DB* db = iter->second;
-  scoped_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+  scoped_ptr<leveldb::Iterator> it(NewIterator(options));
   it->SeekToFirst();
   if (!it->Valid()) {
     return false;
@@ -144,18 +316,28 @@ bool DBManager::NewTopDir(const Options& options) {
 
 bool DBManager::Track(const Options& options) {
   const string new_key = GenKey(options);
+  boost::unique_lock<boost::shared_mutex> lock(tables_mutex_);
   CHECK(!ContainsKey(db_map_, new_key));
-  const string new_path = GenPath(db_location_base_, options);
-  LOG(INFO) << "Tracking: " << new_path;
-  db_map_[new_key] = OpenDB(new_path);
+  Table& t = db_map_[new_key];
+  if (!shards_.empty()) {
+    t.db = ShardFor(new_key);
+    t.prefix = TablePrefix(options);
+    return true;
+  }
+
+  t.path = GenPath(db_location_base_, options);
+  LOG(INFO) << "Tracking: " << t.path;
+  if (store_options_.max_open_tables > 0 && !options.name.empty()) {
+    // Opened by table() on first use.
+    t.lazy = true;
+    return true;
+  }
+  t.db.reset(OpenDB(t.path, db_options_));
   return true;
 }
 
 uint64_t DBManager::MaxID(const Options& options) {
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  leveldb::DB* db = iter->second;
-  leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
+  scoped_ptr<leveldb::Iterator> it(NewIterator(options));
   uint64_t max = 0;
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
     uint64_t val = 0;
@@ -198,10 +380,161 @@ string DBManager::GenKey(const Options& options) {
   return key;
 }
 
-leveldb::DB* DBManager::db(const Options& options) {
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  return iter->second;
+DBManager::Batch::Batch(DBManager* manager) : manager_(manager) {
+  CHECK(manager);
+}
+
+DBManager::Batch::~Batch() {
+  LOG_IF(WARNING, !writes_.empty()) << "Dropping unwritten batch.";
+}
+
+void DBManager::Batch::Put(const Options& options, const string& key,
+                           const string& value) {
+  const Table t = manager_->table(options);
+  writes_[t.db].Put(t.prefix + key, value);
+}
+
+void DBManager::Batch::Append(const Options& options, const string& key_prefix,
+                              const string& new_value) {
+  const Table t = manager_->table(options);
+  writes_[t.db].Put(t.prefix + manager_->AppendKey(key_prefix), new_value);
+}
+
+void DBManager::Batch::Delete(const Options& options, const string& key) {
+  const Table t = manager_->table(options);
+  writes_[t.db].Delete(t.prefix + key);
+}
+
+namespace {
+
+void ReleaseDB(void* arg1, void* /* arg2 */) {
+  delete reinterpret_cast<std::shared_ptr<leveldb::DB>*>(arg1);
+}
+
+} // namespace
+
+leveldb::Iterator* DBManager::NewIterator(const Options& options) {
+  const Table t = table(options);
+  leveldb::Iterator* it = NewPrefixIterator(
+      t.db->NewIterator(leveldb::ReadOptions()), t.prefix);
+
+  // Keep the database open for as long as the iterator is alive.
+  it->RegisterCleanup(&ReleaseDB, new std::shared_ptr<leveldb::DB>(t.db),
+                      NULL);
+  return it;
+}
+
+DBManager::Table DBManager::table(const Options& options) {
+  const string key = GenKey(options);
+  boost::shared_lock<boost::shared_mutex> lock(tables_mutex_);
+  auto iter = db_map_.find(key);
+  CHECK(iter != db_map_.end())
+      << values_to_names_.find(options.type)->second
+      << " " << options.name;
+  Table& t = iter->second;
+  if (!t.lazy) {
+    return t;
+  }
+  return OpenLazy(key, &t);
+}
+
+DBManager::Table DBManager::OpenLazy(const string& key, Table* table) {
+  std::unique_lock<mutex> lock(lru_mutex_);
+  while (true) {
+    if (table->opening) {
+      lru_cv_.wait(lock);
+      continue;
+    }
+    if (table->db) {
+      lru_.splice(lru_.begin(), lru_, table->lru_position);
+      return *table;
+    }
+    if (!ContainsKey(live_, key)) {
+      break;
+    }
+
+    // A reader may still hold the handle from before the table was closed;
+    // leveldb allows only one handle per database, so reuse it. If it is
+    // being destroyed, wait for CloseLazy().
+    table->db = table->closed.lock();
+    if (table->db) {
+      break;
+    }
+    lru_cv_.wait(lock);
+  }
+  table->closed.reset();
+
+  if (!table->db) {
+    table->opening = true;
+    live_.insert(key);
+    const string path = table->path;
+    lock.unlock();
+    std::shared_ptr<leveldb::DB> db(
+        OpenDB(path, db_options_),
+        std::bind(&DBManager::CloseLazy, this, key, std::placeholders::_1));
+    lock.lock();
+    table->db = db;
+    table->opening = false;
+    tables_opened_.Increment();
+    lru_cv_.notify_all();
+  }
+  lru_.push_front(key);
+  table->lru_position = lru_.begin();
+
+  vector<std::shared_ptr<leveldb::DB> > closing;
+  while (lru_.size() > static_cast<size_t>(store_options_.max_open_tables)) {
+    Table& victim = db_map_.find(lru_.back())->second;
+    VLOG(1) << "Closing " << lru_.back() << " (" << tables_opened_.Get()
+            << " opened, " << tables_evicted_.Get() << " closed)";
+    victim.closed = victim.db;
+    closing.push_back(victim.db);
+    victim.db.reset();
+    lru_.pop_back();
+    tables_evicted_.Increment();
+  }
+  const Table ret = *table;
+
+  // Dropping the last handles closes the databases, unless a reader still
+  // holds one; whoever drops it last runs CloseLazy().
+  lock.unlock();
+  closing.clear();
+  return ret;
+}
+
+void DBManager::CloseLazy(const string& key, leveldb::DB* db) {
+  delete db;
+  ScopedMutexLock lock(&lru_mutex_);
+  live_.erase(key);
+  lru_cv_.notify_all();
+}
+
+void DBManager::DumpStats(string* out) {
+  CHECK(out);
+  size_t open = 0;
+  {
+    ScopedMutexLock lock(&lru_mutex_);
+    open = lru_.size();
+  }
+  base::StringAppendF(out, "Lockbox.Db.Tables open=%zu max_open=%d "
+                      "opened=%lld evicted=%lld\n", open,
+                      store_options_.max_open_tables,
+                      static_cast<long long>(tables_opened_.Get()),
+                      static_cast<long long>(tables_evicted_.Get()));
+}
+
+string DBManager::TablePrefix(const Options& options) {
+  auto found = values_to_names_.find(options.type);
+  CHECK(found != values_to_names_.end());
+  string prefix(found->second);
+  prefix.push_back('\0');
+  prefix.append(options.name);
+  prefix.push_back('\0');
+  return prefix;
+}
+
+std::shared_ptr<leveldb::DB> DBManager::ShardFor(const string& table_key) {
+  CHECK(!shards_.empty());
+  return shards_[HashTableKey(table_key) % shards_.size()];
 }
 
 } // namespace lockbox
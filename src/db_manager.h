@@ -1,16 +1,33 @@
 #pragma once
 
+#if defined(OS_MACOSX)
+#define BOOST_NO_CXX11_NUMERIC_LIMITS 1
+#endif
+
+#include <boost/thread/shared_mutex.hpp>
+#include <condition_variable>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "base/basictypes.h"
 #include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "leveldb/cache.h"
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "lockbox_types.h"
 #include "counter.h"
 
+using std::condition_variable;
+using std::list;
 using std::map;
+using std::mutex;
+using std::set;
 using std::string;
 using std::vector;
 
@@ -30,8 +47,68 @@ class DBManager {
     string name;
   };
 
-  explicit DBManager(const string& db_location_base,
-                     const map<int, const char*> values_to_names);
+  // Controls how tables (a type, plus a name for TopDir types) map onto leveldb
+  // instances.
+  struct StoreOptions {
+    StoreOptions()
+        : shards(0),
+          block_cache_bytes(8 << 20),
+          write_buffer_bytes(16 << 20),
+          max_open_tables(0) {}
+
+    // Number of shared databases holding every table under a per-table key
+    // prefix. Zero keeps one database per table.
+    int shards;
+
+    // Block cache shared by every database the manager opens.
+    size_t block_cache_bytes;
+
+    // Memtable budget, split evenly across the shards. Unused with one
+    // database per table.
+    size_t write_buffer_bytes;
+
+    // With one database per table, the most TopDir databases kept open at once.
+    // They are opened on first use and the least recently used is closed to
+    // make room. Zero opens every database when it is tracked and keeps it
+    // open.
+    int max_open_tables;
+  };
+
+  // Puts and deletes collected per database and applied together by Write().
+  // Each database's share of the batch is applied atomically.
+  //
+  //  DBManager::Batch batch(&manager);
+  //  batch.Put(DBManager::Options(ServerDB::TOP_DIR_RELPATH, top_dir), k, v);
+  //  batch.Append(DBManager::Options(ServerDB::UPDATE_ACTION_QUEUE, ""), k, v);
+  //  manager.Write(&batch, true /* sync */);
+  class Batch {
+   public:
+    // Does not take ownership of |manager|.
+    explicit Batch(DBManager* manager);
+
+    ~Batch();
+
+    void Put(const Options& options, const string& key, const string& value);
+
+    void Append(const Options& options, const string& key_prefix,
+                const string& new_value);
+
+    void Delete(const Options& options, const string& key);
+
+    bool empty() const { return writes_.empty(); }
+
+   private:
+    friend class DBManager;
+
+    DBManager* manager_;
+    map<std::shared_ptr<leveldb::DB>, leveldb::WriteBatch> writes_;
+
+    DISALLOW_COPY_AND_ASSIGN(Batch);
+  };
+
+  DBManager(const string& db_location_base,
+            const map<int, const char*> values_to_names,
+            const StoreOptions& store_options);
 
   virtual ~DBManager();
 
@@ -42,6 +119,13 @@ class DBManager {
   virtual bool GetMap(const Options& options, const string& key_prefix,
                       map<string, string>* kvs);
 
+  // Like GetMap(), but returns at most |max| entries, starting after the key
+  // |start_after| (or at the first key with |key_prefix| if empty). Sets |more|
+  // if entries beyond the last one returned remain.
+  virtual bool GetMapPage(const Options& options, const string& key_prefix,
+                          const string& start_after, size_t max,
+                          map<string, string>* kvs, bool* more);
+
   virtual bool Put(const Options& options, const string& key, const string& value);
 
   virtual bool Append(const Options& options,
@@ -50,6 +134,27 @@ class DBManager {
 
   virtual bool Delete(const Options& options, const string& key);
 
+  // Deletes the keys from |first_key| through |last_key| in one write, provided
+  // there are exactly |expected| of them; otherwise deletes nothing and
+  // returns false.
+  virtual bool DeleteRange(const Options& options, const string& first_key,
+                           const string& last_key, size_t expected);
+
+  // Compacts the keys from |first_key| through |last_key|, e.g. to drop the
+  // tombstones left by a large DeleteRange().
+  virtual void CompactRange(const Options& options, const string& first_key,
+                            const string& last_key);
+
+  // Applies and clears |batch|. With |sync| set, every database written is
+  // synced before returning. A crash part way can still leave the batch applied
+  // to some databases and not others, unless all of its tables share one
+  // database, as they do with sharding.
+  virtual bool Write(Batch* batch, bool sync);
+
+  // Makes the writes already applied to the table of |options| durable, e.g.
+  // after a run of unsynced ones.
+  virtual bool Sync(const Options& options);
+
   virtual bool First(const Options& options, string* key, string* value);
 
   virtual bool NewTopDir(const Options& options);
@@ -64,13 +169,97 @@ class DBManager {
   // Creates keys of the name THIS_IS_A_TYPE and THIS_IS_A_TYPEOPTIONS_NAME.
   virtual string GenKey(const Options& options);
 
-  virtual leveldb::DB* db(const Options& options);
+  // Returns an iterator over the keys of the table for |options|. The caller
+  // owns the iterator.
+  virtual leveldb::Iterator* NewIterator(const Options& options);
+
+  // Number of times a lazily opened database was opened and closed.
+  int64_t tables_opened() { return tables_opened_.Get(); }
+  int64_t tables_evicted() { return tables_evicted_.Get(); }
+
+  // Appends to |out| how many databases are open against the cap and how many
+  // times lazily opened ones were opened and closed, for sizing the cap.
+  void DumpStats(string* out);
 
  protected:
+  // Where a table's keys live: a database of its own, or a shard shared with
+  // other tables, in which case every key carries |prefix|.
+  struct Table {
+    Table() : lazy(false), opening(false) {}
+
+    std::shared_ptr<leveldb::DB> db;
+    string prefix;
+
+    // Lazily opened tables keep their location and, while open, their place in
+    // the LRU list. A closed table remembers its last handle in case a reader
+    // still holds it. The database is opened outside of any lock; |opening|
+    // keeps others from opening it meanwhile. All but |lazy| and |path|
+    // require |lru_mutex_|.
+    bool lazy;
+    string path;
+    list<string>::iterator lru_position;
+    std::weak_ptr<leveldb::DB> closed;
+    bool opening;
+  };
+
+  // Returns the table for |options|, opening it if need be. The returned handle
+  // keeps the database open for as long as the caller holds it.
+  Table table(const Options& options);
+
+  // Generates the key under which Append() stores a value for |key_prefix|.
+  // Keys sort in the order they were generated, give or take clock skew
+  // between threads.
+  string AppendKey(const string& key_prefix);
+
   string db_location_base_;
-  map<string, leveldb::DB*> db_map_;
+  map<string, Table> db_map_;
   map<int, const char*> values_to_names_;
 
+ private:
+  // Records the layout of a new store under |db_location_base_|, and refuses
+  // to go on if an existing store was created with a different number of
+  // shards, as its tables would not be found.
+  void CheckLayout();
+
+  // Prefix that keeps the keys of the table for |options| apart from those of
+  // other tables in the same shard.
+  string TablePrefix(const Options& options);
+
+  std::shared_ptr<leveldb::DB> ShardFor(const string& table_key);
+
+  // Returns the lazy table |key|, opening it if need be and closing the least
+  // recently used ones beyond the cap. Requires |tables_mutex_|, shared.
+  Table OpenLazy(const string& key, Table* table);
+
+  // Deleter of lazy table |key|'s handle. Takes |lru_mutex_|, so the last
+  // handle must not be dropped under it.
+  void CloseLazy(const string& key, leveldb::DB* db);
+
+  StoreOptions store_options_;
+  scoped_ptr<leveldb::Cache> block_cache_;
+  leveldb::Options db_options_;
+  vector<std::shared_ptr<leveldb::DB> > shards_;
+
+  // Guards |db_map_|. Lookups share it, so that without a cap on open tables
+  // they do not serialize.
+  boost::shared_mutex tables_mutex_;
+
+  // Guards |lru_| and the state of lazy tables. Signalled when one finishes
+  // opening or closing.
+  mutex lru_mutex_;
+  condition_variable lru_cv_;
+
+  // Keys of the open lazy tables, most recently used first.
+  list<string> lru_;
+
+  // Keys of the lazy tables with a handle that is not destroyed yet, open or
+  // closed. leveldb holds the database's lock file until the handle is gone,
+  // so the table cannot be opened again before then.
+  set<string> live_;
+
+  Counter tables_opened_;
+  Counter tables_evicted_;
+
 };
 
 } // namespace lockbox
@@ -1,5 +1,7 @@
 #include "db_manager_client.h"
 
+#include <chrono>
+
 #include "base/memory/scoped_ptr.h"
 #include "base/stringprintf.h"
 #include "leveldb_util.h"
@@ -11,7 +13,7 @@ namespace lockbox {
 // TODO(tierney): Consider moving most of this activity to an init function
 // outside the constructor.
 DBManagerClient::DBManagerClient(const string& db_location_base)
-    : DBManager(db_location_base, _ClientDB_VALUES_TO_NAMES) {
+    : DBManager(db_location_base, _ClientDB_VALUES_TO_NAMES, StoreOptions()) {
   // Initialize the databases and cache the mapping data that we have on disk.
   for (auto& iter : _ClientDB_VALUES_TO_NAMES) {
     ClientDB::type val = static_cast<ClientDB::type>(iter.first);
@@ -26,15 +28,13 @@ DBManagerClient::DBManagerClient(const string& db_location_base)
     Options options;
     LOG(INFO) << "Type to open " << val;
     options.type = val;
-    string key = DBManager::GenKey(options);
-    LOG(INFO) << "Type to open " << key;
-
-    string path = DBManager::GenPath(db_location_base, options);
-    db_map_[key] = OpenDB(path);
+    LOG(INFO) << "Type to open " << DBManager::GenKey(options);
+    DBManager::Track(options);
   }
 }
 
 DBManagerClient::~DBManagerClient() {
+  STLDeleteValues(&path_locks_);
 }
 
 bool DBManagerClient::Get(const Options& options,
@@ -58,7 +58,13 @@ bool DBManagerClient::Put(const Options& options,
     CHECK(!options.name.empty());
   }
 
-  return DBManager::Put(options, key, value);
+  if (!DBManager::Put(options, key, value)) {
+    return false;
+  }
+  if (IsUpdateQueue(options)) {
+    NotifyUpdateQueues(options.name);
+  }
+  return true;
 }
 
 bool DBManagerClient::Append(const Options& options,
@@ -69,7 +75,13 @@ bool DBManagerClient::Append(const Options& options,
   if (options.type > ClientDB::TOP_DIR_PLACEHOLDER) {
     CHECK(!options.name.empty());
   }
-  return DBManager::Append(options, key, new_value);
+  if (!DBManager::Append(options, key, new_value)) {
+    return false;
+  }
+  if (IsUpdateQueue(options)) {
+    NotifyUpdateQueues(options.name);
+  }
+  return true;
 }
 
 bool DBManagerClient::NewTopDir(const Options& options) {
@@ -114,15 +126,43 @@ uint64_t DBManagerClient::MaxID(const Options& options) {
 void DBManagerClient::Clean(const Options& options) {
   LOG(INFO) << "Cleaning database " << options.type << " for "
             << options.name;
-  auto iter = db_map_.find(GenKey(options));
-  CHECK(iter != db_map_.end());
-  leveldb::DB* db = iter->second;
-  scoped_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+  scoped_ptr<leveldb::Iterator> it(NewIterator(options));
   for (it->SeekToFirst(); it->Valid(); it->Next()) {
     Delete(options, it->key().ToString());
   }
 }
 
+void DBManagerClient::WaitForUpdateQueues(const string& top_dir,
+                                          int timeout_ms) {
+  std::unique_lock<mutex> lock(queue_signals_mutex_);
+  QueueSignal& signal = queue_signals_[top_dir];
+  signal.cv.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                     [&signal] { return signal.pending; });
+  signal.pending = false;
+}
+
+void DBManagerClient::NotifyUpdateQueues(const string& top_dir) {
+  std::unique_lock<mutex> lock(queue_signals_mutex_);
+  QueueSignal& signal = queue_signals_[top_dir];
+  signal.pending = true;
+  lock.unlock();
+  signal.cv.notify_all();
+}
+
+mutex* DBManagerClient::PathLock(const string& path) {
+  ScopedMutexLock lock(&path_locks_mutex_);
+  mutex*& path_lock = path_locks_[path];
+  if (!path_lock) {
+    path_lock = new mutex();
+  }
+  return path_lock;
+}
+
+bool DBManagerClient::IsUpdateQueue(const Options& options) {
+  return options.type == ClientDB::UPDATE_QUEUE_SERVER ||
+      options.type == ClientDB::UPDATE_QUEUE_CLIENT;
+}
+
 string DBManagerClient::RelpathGuidToPath(const string& guid,
                                           const string& top_dir) {
   DBManager::Options options;
@@ -141,11 +181,7 @@ bool DBManagerClient::AcquireLockPath(const string& guid,
   const string path(RelpathGuidToPath(guid, top_dir));
   CHECK(!path.empty());
 
-  if (!ContainsKey(path_locks_, path)) {
-    path_locks_.insert(make_pair(path, new mutex()));
-  }
-
-  ScopedMutexLock lock(path_locks_.at(path));
+  ScopedMutexLock lock(PathLock(path));
 
   // do something to the locked path.
   DBManager::Options options;
@@ -166,9 +202,7 @@ bool DBManagerClient::ReleaseLockPath(const string& guid,
                                       const string& top_dir) {
   const string path(RelpathGuidToPath(guid, top_dir));
 
-  CHECK(ContainsKey(path_locks_, path));
-
-  ScopedMutexLock lock(path_locks_.at(path));
+  ScopedMutexLock lock(PathLock(path));
 
   // do something to the locked path.
   DBManager::Options options;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <condition_variable>
 #include <string>
 #include <mutex>
 #include <map>
@@ -11,6 +12,7 @@
 #include "counter.h"
 #include "db_manager.h"
 
+using std::condition_variable;
 using std::string;
 using std::mutex;
 using std::map;
@@ -25,6 +27,8 @@ class DBManagerClient : public DBManager {
 
   bool Get(const Options& options, const string& key, string* value);
 
+  // Puts and appends to UPDATE_QUEUE_SERVER and UPDATE_QUEUE_CLIENT wake the
+  // top dir's WaitForUpdateQueues().
   bool Put(const Options& options, const string& key, const string& value);
 
   bool Append(const Options& options,
@@ -45,6 +49,14 @@ class DBManagerClient : public DBManager {
 
   void Clean(const Options& options);
 
+  // Blocks until NotifyUpdateQueues(|top_dir|) has been called since the last
+  // wait returned, or until |timeout_ms| passes.
+  void WaitForUpdateQueues(const string& top_dir, int timeout_ms);
+
+  // Wakes WaitForUpdateQueues(|top_dir|). Call after writing the top dir's
+  // update queues other than through Put() or Append(), e.g. with a Batch.
+  void NotifyUpdateQueues(const string& top_dir);
+
   TopDirID TopDirPathToID(const string& path);
   string RelpathGuidToPath(const string& guid, const string& top_dir);
   bool AcquireLockPath(const string& guid, const string& top_dir);
@@ -56,8 +68,26 @@ class DBManagerClient : public DBManager {
                                    const int action);
 
  private:
+  struct QueueSignal {
+    QueueSignal() : pending(false) {}
+
+    // Set by a notification that no waiter has consumed yet.
+    bool pending;
+    condition_variable cv;
+  };
+
+  static bool IsUpdateQueue(const Options& options);
+
+  // Returns the mutex serializing lock changes on |path|.
+  mutex* PathLock(const string& path);
+
+  mutex path_locks_mutex_;
   map<string, mutex*> path_locks_;
 
+  // Per top dir. Never erased, so waiters can hold on to their entry.
+  mutex queue_signals_mutex_;
+  map<string, QueueSignal> queue_signals_;
+
   DISALLOW_COPY_AND_ASSIGN(DBManagerClient);
 };
 
@@ -13,6 +13,7 @@
 #include "base/stl_util.h"
 #include "base/logging.h"
 #include "guid_creator.h"
+#include "trace.h"
 #include "leveldb/write_batch.h"
 #include "leveldb/db.h"
 
@@ -22,8 +23,9 @@ using std::vector;
 
 namespace lockbox {
 
-DBManagerServer::DBManagerServer(const string& db_location_base)
-    : DBManager(db_location_base, _ServerDB_VALUES_TO_NAMES) {
+DBManagerServer::DBManagerServer(const string& db_location_base,
+                                 const StoreOptions& store_options)
+    : DBManager(db_location_base, _ServerDB_VALUES_TO_NAMES, store_options) {
 
   // Setting the base database pointers.
   for (auto& iter : _ServerDB_VALUES_TO_NAMES) {
@@ -39,11 +41,8 @@ DBManagerServer::DBManagerServer(const string& db_location_base)
     Options options;
     LOG(INFO) << "Type to open " << val;
     options.type = val;
-    string key = DBManager::GenKey(options);
-    LOG(INFO) << "Type to open " << key;
-
-    string path = DBManager::GenPath(db_location_base, options);
-    db_map_[key] = OpenDB(path);
+    LOG(INFO) << "Type to open " << DBManager::GenKey(options);
+    DBManager::Track(options);
 
   }
 
@@ -56,21 +55,10 @@ DBManagerServer::~DBManagerServer() {
 void DBManagerServer::InitTopDirs() {
   // Iterate through all of the USER_TOP_DIR profiles and cache the top_dir
   // information in a set. Then we prime the appropriate maps with the keys for
-  // the top_dirs.
-  Options user_top_dir_options;
-  user_top_dir_options.type = ServerDB::USER_TOP_DIR;
-
-  leveldb::DB* db = DBManager::db(user_top_dir_options);
-  scoped_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
-
+  // the top_dirs. With a cap on open tables this only registers them; their
+  // databases open on first use.
   set<string> top_dirs;
-  for (it->SeekToFirst(); it->Valid(); it->Next()) {
-    vector<string> user_top_dirs;
-    base::SplitString(it->value().ToString(), ',', &user_top_dirs);
-    for (const string& top_dir_val : user_top_dirs) {
-      top_dirs.insert(top_dir_val);
-    }
-  }
+  GetTopDirs(&top_dirs);
 
   Options new_top_dir_options;
   new_top_dir_options.type = ServerDB::TOP_DIR_PLACEHOLDER;
@@ -140,7 +128,7 @@ bool DBManagerServer::Track(const Options& options) {
   CHECK(!options.name.empty());
 
   string key = GenKey(options);
-  LOG(INFO) << "Generated mutex for " << key;
+  TRACE(2) << "Generated mutex for " << key;
 
   CHECK(!ContainsKey(db_mutex_, key)) << "Already have a mutex for " << key;
 
@@ -189,11 +177,22 @@ UserID DBManagerServer::EmailToUserID(const string& email) {
   return user_id;
 }
 
+void DBManagerServer::GetTopDirs(set<string>* top_dirs) {
+  CHECK(top_dirs);
+  scoped_ptr<leveldb::Iterator> it(
+      DBManager::NewIterator(Options(ServerDB::USER_TOP_DIR, "")));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    vector<string> user_top_dirs;
+    base::SplitString(it->value().ToString(), ',', &user_top_dirs);
+    top_dirs->insert(user_top_dirs.begin(), user_top_dirs.end());
+  }
+}
+
 bool DBManagerServer::AddEmailToTopDir(const string& email,
                                        const TopDirID& top_dir) {
   UserID user(EmailToUserID(email));
   if (user.empty()) {
-    LOG(INFO) << "Could not find email " << email;
+    TRACE(1) << "Could not find email " << email;
     return false;
   }
   Append(DBManager::Options(ServerDB::USER_TOP_DIR, ""),
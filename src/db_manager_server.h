@@ -14,6 +14,7 @@
 #pragma once
 
 #include <mutex>
+#include <set>
 #include <string>
 
 #include "base/basictypes.h"
@@ -22,16 +23,17 @@
 #include "db_manager.h"
 #include "leveldb/db.h"
 #include "lockbox_types.h"
-#include "update_queue_sync.h"
 
 using std::mutex;
+using std::set;
 using std::string;
 
 namespace lockbox {
 
 class DBManagerServer : public DBManager {
  public:
-  DBManagerServer(const string& db_location_base);
+  DBManagerServer(const string& db_location_base,
+                  const StoreOptions& store_options);
 
   virtual ~DBManagerServer();
 
@@ -64,6 +66,9 @@ class DBManagerServer : public DBManager {
   UserID EmailToUserID(const string& email);
   bool AddEmailToTopDir(const string& email, const TopDirID& top_dir);
 
+  // Sets |top_dirs| to every top dir some user has.
+  void GetTopDirs(set<string>* top_dirs);
+
  private:
   void InitTopDirs();
 
@@ -72,7 +77,6 @@ class DBManagerServer : public DBManager {
   Counter num_top_dirs_;
 
   map<string, mutex*> db_mutex_;
-  Sync* sync_;
 
   DISALLOW_COPY_AND_ASSIGN(DBManagerServer);
 };
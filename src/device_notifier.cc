@@ -0,0 +1,98 @@
+#include "device_notifier.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "base/logging.h"
+
+namespace lockbox {
+
+namespace {
+
+// Devices left alone this long are dropped. Well past the time between a
+// request taking its token and parking.
+const time_t kIdleSeconds = 60;
+
+} // namespace
+
+DeviceNotifier::DeviceNotifier(int max_waiters)
+    : max_waiters_(max_waiters), waiters_(0), sequence_(0),
+      pruned_through_(0), last_pruned_(time(NULL)) {
+}
+
+DeviceNotifier::~DeviceNotifier() {
+}
+
+uint64_t DeviceNotifier::Token(const DeviceID& device) {
+  std::unique_lock<mutex> lock(mutex_);
+  return sequence_;
+}
+
+bool DeviceNotifier::Wait(const DeviceID& device, uint64_t token,
+                          int timeout_ms) {
+  std::unique_lock<mutex> lock(mutex_);
+  if (waiters_ >= max_waiters_) {
+    return false;
+  }
+
+  std::unique_ptr<Device>& entry = devices_[device];
+  if (!entry) {
+    entry.reset(new Device());
+    if (token < pruned_through_) {
+      // A notification since |token| may have gone with a dropped entry;
+      // have the caller look again rather than risk missing it.
+      return true;
+    }
+  }
+
+  Device* waiting = entry.get();
+  ++waiting->waiters;
+  ++waiters_;
+  waiting->cv.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                       [&]{ return waiting->version > token; });
+  --waiters_;
+  --waiting->waiters;
+  waiting->touched = time(NULL);
+  MaybePrune(waiting->touched);
+  return true;
+}
+
+void DeviceNotifier::Notify(const DeviceID& device) {
+  {
+    std::unique_lock<mutex> lock(mutex_);
+    std::unique_ptr<Device>& entry = devices_[device];
+    if (!entry) {
+      entry.reset(new Device());
+    }
+    entry->version = ++sequence_;
+    entry->touched = time(NULL);
+    entry->cv.notify_all();
+    MaybePrune(entry->touched);
+  }
+
+  for (const Listener& listener : listeners_) {
+    listener(device);
+  }
+}
+
+void DeviceNotifier::AddListener(const Listener& listener) {
+  listeners_.push_back(listener);
+}
+
+void DeviceNotifier::MaybePrune(time_t now) {
+  if (now - last_pruned_ < kIdleSeconds) {
+    return;
+  }
+  last_pruned_ = now;
+  for (auto iter = devices_.begin(); iter != devices_.end();) {
+    const Device& device = *(iter->second);
+    if (device.waiters == 0 && now - device.touched >= kIdleSeconds) {
+      pruned_through_ = std::max(pruned_through_, device.version);
+      devices_.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+} // namespace lockbox
@@ -0,0 +1,103 @@
+// Parks long-poll requests until their device has updates.
+//
+// Take a token before checking the device's queue and pass it to Wait() if the
+// queue was empty; a Notify() that lands in between makes Wait() return at
+// once instead of being missed.
+//
+//  const uint64_t token = notifier.Token(device);
+//  if (!HasUpdates(device)) {
+//    notifier.Wait(device, token, timeout_ms);
+//  }
+//
+// Each parked request holds a server thread, so clients that can should wait
+// on the NotifyServer side channel instead, which listens here for Notify().
+//
+// Devices are only tracked while a request waits for them or for a while after
+// they were notified, so that devices that stop polling cost nothing.
+
+#pragma once
+
+#include <condition_variable>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "lockbox_types.h"
+
+using std::condition_variable;
+using std::map;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace lockbox {
+
+class DeviceNotifier {
+ public:
+  typedef std::function<void(const DeviceID& device)> Listener;
+
+  // At most |max_waiters| requests are parked at once; each holds a server
+  // thread while it waits.
+  explicit DeviceNotifier(int max_waiters);
+
+  ~DeviceNotifier();
+
+  uint64_t Token(const DeviceID& device);
+
+  // Waits until |device| is notified after |token| was taken or |timeout_ms|
+  // passes. Returns false, without waiting, if |max_waiters| requests are
+  // parked already.
+  bool Wait(const DeviceID& device, uint64_t token, int timeout_ms);
+
+  // Wakes the requests parked for |device| and calls the listeners.
+  void Notify(const DeviceID& device);
+
+  // Has |listener| called, without any lock held, on every Notify(). Add
+  // listeners before the first Notify().
+  void AddListener(const Listener& listener);
+
+ private:
+  struct Device {
+    Device() : version(0), waiters(0), touched(0) {}
+
+    // Token as of the last Notify(), or 0.
+    uint64_t version;
+
+    int waiters;
+
+    // When the device was last notified or waited for.
+    time_t touched;
+
+    condition_variable cv;
+  };
+
+  // Drops the devices nobody waits for that were left alone for a while, at
+  // most once a minute. Requires |mutex_|.
+  void MaybePrune(time_t now);
+
+  const int max_waiters_;
+
+  mutex mutex_;
+  int waiters_;
+
+  // Source of tokens. Every Notify() takes a new one.
+  uint64_t sequence_;
+
+  // The newest version of a dropped device. A token older than it may have
+  // missed a notification of a device that is gone.
+  uint64_t pruned_through_;
+
+  time_t last_pruned_;
+  map<DeviceID, std::unique_ptr<Device> > devices_;
+
+  vector<Listener> listeners_;
+
+  DISALLOW_COPY_AND_ASSIGN(DeviceNotifier);
+};
+
+} // namespace lockbox
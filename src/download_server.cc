@@ -0,0 +1,183 @@
+#include "download_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <vector>
+
+#include "base/logging.h"
+#include "base/posix/eintr_wrapper.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "guid_creator.h"
+#include "scoped_mutex.h"
+
+using std::vector;
+
+namespace lockbox {
+
+namespace {
+
+// How long a ticket may be redeemed for.
+const time_t kTicketSeconds = 10 * 60;
+
+// A client that stops reading or writing for this long is dropped.
+const int kSocketTimeoutSeconds = 30;
+
+// Longest request line accepted.
+const size_t kMaxRequestBytes = 256;
+
+} // namespace
+
+DownloadServer::DownloadServer(PackageStore* store, int port, int num_threads)
+    : store_(store), port_(port), num_threads_(num_threads), listen_fd_(-1),
+      stopping_(false) {
+  CHECK(store);
+  CHECK_GT(num_threads, 0);
+}
+
+DownloadServer::~DownloadServer() {
+  if (listen_fd_ < 0) {
+    return;
+  }
+  // Shutting the socket down wakes the threads blocked in accept().
+  stopping_ = true;
+  shutdown(listen_fd_, SHUT_RDWR);
+  threads_.join_all();
+  close(listen_fd_);
+}
+
+bool DownloadServer::Start() {
+  CHECK_LT(listen_fd_, 0);
+
+  // A client hanging up mid-sendfile must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    PLOG(ERROR) << "Cannot create download socket";
+    return false;
+  }
+  const int on = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port_);
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listen_fd_, num_threads_ * 4) != 0) {
+    PLOG(ERROR) << "Cannot listen for downloads on " << port_;
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+
+  for (int i = 0; i < num_threads_; ++i) {
+    threads_.create_thread(boost::bind(&DownloadServer::Serve, this));
+  }
+  LOG(INFO) << "Serving downloads on " << port_;
+  return true;
+}
+
+string DownloadServer::IssueTicket(const string& top_dir,
+                                   const string& hash) {
+  const time_t now = time(NULL);
+  Ticket ticket;
+  ticket.top_dir = top_dir;
+  ticket.hash = hash;
+  ticket.expires = now + kTicketSeconds;
+  const string id = CreateGUIDString();
+
+  ScopedMutexLock lock(&tickets_mutex_);
+  for (auto iter = tickets_.begin(); iter != tickets_.end();) {
+    if (iter->second.expires < now) {
+      tickets_.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+  tickets_[id] = ticket;
+  return id;
+}
+
+void DownloadServer::Serve() {
+  while (!stopping_) {
+    const int socket = HANDLE_EINTR(accept(listen_fd_, NULL, NULL));
+    if (socket < 0) {
+      if (!stopping_) {
+        PLOG(WARNING) << "Download accept failed";
+      }
+      continue;
+    }
+    Handle(socket);
+    close(socket);
+  }
+}
+
+void DownloadServer::Handle(int socket) {
+  struct timeval timeout;
+  timeout.tv_sec = kSocketTimeoutSeconds;
+  timeout.tv_usec = 0;
+  setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // The request is one short line; read it a byte at a time so that nothing
+  // past it is consumed.
+  string request;
+  char c = 0;
+  while (request.size() < kMaxRequestBytes &&
+         HANDLE_EINTR(recv(socket, &c, 1, 0)) == 1 && c != '\n') {
+    request.push_back(c);
+  }
+  vector<string> fields;
+  base::SplitString(request, ' ', &fields);
+  int64_t offset = 0;
+  Ticket ticket;
+  if (c != '\n' || fields.size() != 2 ||
+      !base::StringToInt64(fields[1], &offset) || offset < 0 ||
+      !Redeem(fields[0], &ticket)) {
+    LOG(WARNING) << "Bad download request";
+    return;
+  }
+
+  RemotePackage header;
+  if (!store_->GetHeader(ticket.top_dir, ticket.hash, &header)) {
+    LOG(WARNING) << "Download of unknown package " << ticket.hash;
+    return;
+  }
+  const int64_t length = std::max<int64_t>(header.payload_size - offset, 0);
+  unsigned char prefix[8];
+  for (int i = 0; i < 8; ++i) {
+    prefix[i] = static_cast<uint64_t>(length) >> (56 - 8 * i);
+  }
+  if (HANDLE_EINTR(send(socket, prefix, sizeof(prefix), MSG_NOSIGNAL)) !=
+      static_cast<ssize_t>(sizeof(prefix))) {
+    return;
+  }
+  if (!store_->SendRange(ticket.top_dir, header, offset, length, socket)) {
+    LOG(WARNING) << "Download of " << ticket.hash << " cut short";
+  }
+}
+
+bool DownloadServer::Redeem(const string& ticket, Ticket* redeemed) {
+  ScopedMutexLock lock(&tickets_mutex_);
+  auto iter = tickets_.find(ticket);
+  if (iter == tickets_.end() || iter->second.expires < time(NULL)) {
+    return false;
+  }
+  *redeemed = iter->second;
+  return true;
+}
+
+} // namespace lockbox
@@ -0,0 +1,81 @@
+// Side channel that streams stored payloads straight to the client's socket.
+//
+// A client asks the Thrift service for a ticket, then connects to this port and
+// sends "TICKET OFFSET\n". The server answers with the number of payload bytes
+// that follow, as 8 bytes in network order, and the payload from OFFSET on.
+// Chunks kept in the blob log go from the segment file to the socket with
+// sendfile, so serving them takes next to no CPU or memory in the server.
+// Tickets are good for any number of connections until they expire, so an
+// interrupted download resumes from where it stopped.
+//
+//  lockbox::DownloadServer downloads(&store, 9091, 8);
+//  CHECK(downloads.Start());
+//  const string ticket = downloads.IssueTicket(top_dir, hash);
+
+#pragma once
+
+#if defined(OS_MACOSX)
+#define BOOST_NO_CXX11_NUMERIC_LIMITS 1
+#endif
+
+#include <atomic>
+#include <boost/thread/thread.hpp>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "base/basictypes.h"
+#include "package_store.h"
+
+using std::map;
+using std::mutex;
+using std::string;
+
+namespace lockbox {
+
+class DownloadServer {
+ public:
+  // Does not take ownership of |store|. Serves |num_threads| connections at a
+  // time.
+  DownloadServer(PackageStore* store, int port, int num_threads);
+
+  ~DownloadServer();
+
+  // Starts listening and serving.
+  bool Start();
+
+  int port() const { return port_; }
+
+  // Returns a ticket for reading the payload of package |hash| of |top_dir|.
+  string IssueTicket(const string& top_dir, const string& hash);
+
+ private:
+  struct Ticket {
+    string top_dir;
+    string hash;
+    time_t expires;
+  };
+
+  // Accepts and serves connections until the server is destroyed.
+  void Serve();
+
+  void Handle(int socket);
+
+  bool Redeem(const string& ticket, Ticket* redeemed);
+
+  PackageStore* store_;
+  const int port_;
+  const int num_threads_;
+
+  int listen_fd_;
+  std::atomic<bool> stopping_;
+  boost::thread_group threads_;
+
+  mutex tickets_mutex_;
+  map<string, Ticket> tickets_;
+
+  DISALLOW_COPY_AND_ASSIGN(DownloadServer);
+};
+
+} // namespace lockbox
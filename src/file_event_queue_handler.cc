@@ -2,7 +2,6 @@
 
 #include <vector>
 
-#include "base/md5.h"
 #include "base/sha1.h"
 #include "base/strings/string_number_conversions.h"
 #include "base/memory/scoped_ptr.h"
@@ -24,14 +23,11 @@ namespace lockbox {
 
 namespace {
 
-// TODO(tierney): If memory becomes an issue, here is one place that can be
-// improved. Incrementally read file and run contents through MD5 digest
-// updater.
-string FileToMD5(const string& path) {
-  string contents;
-  CHECK(file_util::ReadFileToString(base::FilePath(path), &contents));
-  return base::MD5String(contents);
-}
+// How long an idle handler sleeps before looking at its queues again unasked.
+const int kIdleQueueCheckMs = 10 * 1000;
+
+// Actions handed to a worker before the handler waits for it to catch up.
+const size_t kMaxActionsPerWorker = 64;
 
 } // namespace
 
@@ -39,56 +35,41 @@ FileEventQueueHandler::FileEventQueueHandler(const string& top_dir_id,
                                              DBManagerClient* dbm,
                                              Client* client,
                                              Encryptor* encryptor,
-                                             UserAuth* user_auth)
+                                             UserAuth* user_auth,
+                                             FileIndex* index,
+                                             int num_workers)
     : dbm_(dbm),
-      client_(client),
       encryptor_(encryptor),
       user_auth_(user_auth),
-      thread_(new boost::thread(
-          boost::bind(&FileEventQueueHandler::Run, this))),
-      top_dir_id_(top_dir_id) {
+      index_(index),
+      top_dir_id_(top_dir_id),
+      workers_(num_workers),
+      thread_(NULL) {
   CHECK(dbm);
   CHECK(client);
   CHECK(encryptor);
   CHECK(user_auth);
+  CHECK(index);
+  CHECK_GT(num_workers, 0);
   LOG(INFO) << "Starting FileEventQueueHandler for " << top_dir_id;
 
-  // Enumerate the files and check the latest times. We can hold off on hashes
-  // until we have more information.
   DBManagerClient::Options options;
   options.type = ClientDB::TOP_DIR_LOCATION;
   CHECK(dbm_->Get(options, top_dir_id_, &top_dir_path_));
-  PrepareMaps();
-}
 
-FileEventQueueHandler::~FileEventQueueHandler() {
+  for (int i = 0; i < num_workers; ++i) {
+    workers_[i].client.reset(new Client(client->conn_info(), user_auth, dbm));
+    workers_[i].upload_client.reset(
+        new Client(client->conn_info(), user_auth, dbm));
+    worker_threads_.create_thread(
+        boost::bind(&FileEventQueueHandler::Work, this, i));
+    worker_threads_.create_thread(
+        boost::bind(&FileEventQueueHandler::Upload, this, i));
+  }
+  thread_ = new boost::thread(boost::bind(&FileEventQueueHandler::Run, this));
 }
 
-// Enumerate the files and check the latest times. We can hold off on hashes
-// until we have more information.
-void FileEventQueueHandler::PrepareMaps() {
-  file_util::FileEnumerator enumerator(
-      base::FilePath(top_dir_path_),
-      true /* recursive */,
-      file_util::FileEnumerator::FILES |
-      file_util::FileEnumerator::DIRECTORIES);
-
-  while (true) {
-    base::FilePath fp(enumerator.Next());
-    if (fp.value().empty()) {
-      break;
-    }
-
-    file_util::FileEnumerator::FindInfo info;
-    enumerator.GetFindInfo(&info);
-    time_t mtime =
-        file_util::FileEnumerator::GetLastModifiedTime(info).ToTimeT();
-    path_mtime_[fp.value()] = mtime;
-
-    // TODO(tierney): This could be an epically slow operation.
-    // Open up all files and hash them, mapping the path to the hash.
-    path_hashes_[fp.value()] = FileToMD5(fp.value());
-  }
+FileEventQueueHandler::~FileEventQueueHandler() {
 }
 
 namespace {
@@ -119,30 +100,131 @@ void FileEventQueueHandler::Run() {
   while (true) {
     // Should grab entries from both the server and the local client changes. If
     // there are changes from the cloud, we should prioritize those.
+    if (Dispatch(ClientDB::UPDATE_QUEUE_SERVER) > 0 ||
+        Dispatch(ClientDB::UPDATE_QUEUE_CLIENT) > 0) {
+      continue;
+    }
+
+    // Nothing new in either queue. Sleep until something is queued; the
+    // timeout only matters for writes that did not go through |dbm_|.
+    dbm_->WaitForUpdateQueues(top_dir_id_, kIdleQueueCheckMs);
+  }
+}
 
-    string key, value;
-    // Prioritize the remote actions first.
-    if (dbm_->First(
-            DBManager::Options(ClientDB::UPDATE_QUEUE_SERVER, top_dir_id_),
-            &key, &value)) {
-      HandleRemoteAction(key, value);
-      dbm_->Delete(
-          DBManager::Options(ClientDB::UPDATE_QUEUE_SERVER, top_dir_id_),
-          key);
+int FileEventQueueHandler::Dispatch(ClientDB::type queue) {
+  const DBManager::Options options(queue, top_dir_id_);
+  scoped_ptr<leveldb::Iterator> it(dbm_->NewIterator(options));
+
+  // In-flight actions stay in the queue until handled, but there are at most
+  // kMaxActionsPerWorker of them per worker to step over.
+  int dispatched = 0;
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    Action action;
+    action.queue = queue;
+    action.key = it->key().ToString();
+    {
+      // The iterator is a snapshot, so an action finished since it was taken
+      // is still in it. FinishAction() deletes the key before it leaves
+      // |in_flight_|, so checking both under the lock sees one or the other.
+      ScopedMutexLock lock(&workers_mutex_);
+      if (in_flight_.count(action.key) > 0 ||
+          !dbm_->Get(options, action.key, &(action.value))) {
+        continue;
+      }
+    }
+    action.partition = PartitionKey(action);
+    Worker& worker =
+        workers_[std::hash<string>()(action.partition) % workers_.size()];
+
+    std::unique_lock<mutex> lock(workers_mutex_);
+    while (worker.actions.size() >= kMaxActionsPerWorker) {
+      workers_cv_.wait(lock);
+    }
+    in_flight_.insert(action.key);
+    worker.actions.push_back(action);
+    lock.unlock();
+    workers_cv_.notify_all();
+    ++dispatched;
+  }
+  return dispatched;
+}
+
+void FileEventQueueHandler::Work(int index) {
+  Worker& worker = workers_[index];
+  while (true) {
+    std::unique_lock<mutex> lock(workers_mutex_);
+    while (worker.actions.empty()) {
+      workers_cv_.wait(lock);
+    }
+    const Action action = worker.actions.front();
+    worker.actions.pop_front();
+    workers_cv_.notify_all();
+
+    // The file's previous change must be recorded before this one is read
+    // against it.
+    while (worker.uploading.count(action.partition) > 0) {
+      workers_cv_.wait(lock);
+    }
+    lock.unlock();
+
+    scoped_ptr<PendingUpload> upload;
+    if (action.queue == ClientDB::UPDATE_QUEUE_SERVER) {
+      HandleRemoteAction(worker.client.get(), action.key, action.value);
+    } else {
+      HandleLocalAction(worker.client.get(), action.key, action.value,
+                        &upload);
+    }
+    if (!upload.get()) {
+      FinishAction(&worker, action);
       continue;
     }
 
-    if (dbm_->First(
-            DBManager::Options(ClientDB::UPDATE_QUEUE_CLIENT, top_dir_id_),
-            &key, &value)) {
-      HandleLocalAction(key, value);
-      dbm_->Delete(
-          DBManager::Options(ClientDB::UPDATE_QUEUE_CLIENT, top_dir_id_),
-          key);
+    upload->action = action;
+    lock.lock();
+    worker.uploading.insert(action.partition);
+    lock.unlock();
+    CHECK(worker.uploads.put(upload.release(), true /* block */, 0));
+  }
+}
+
+void FileEventQueueHandler::Upload(int index) {
+  Worker& worker = workers_[index];
+  while (true) {
+    scoped_ptr<PendingUpload> upload(static_cast<PendingUpload*>(
+        worker.uploads.get(true /* block */, 0)));
+    CHECK(upload.get());
+
+    // Upload the package. Cloud needs to update the appropriate user's
+    // update queues.
+    LOG(INFO) << "Uploading " << upload->path;
+    int64 ret = worker.upload_client->UploadPackageChunked(upload->package);
+    LOG(INFO) << "Uploaded " << ret << " bytes for " << upload->path;
+    CHECK(dbm_->Write(upload->batch.get(), true /* sync */));
+
+    // Release the lock.
+    worker.upload_client->Exec<void, const PathLockRequest&>(
+        &LockboxServiceClient::ReleaseLockRelPath,
+        upload->path_lock);
+    if (!upload->local_lock.empty()) {
+      dbm_->ReleaseLockPath(upload->local_lock, top_dir_id_);
     }
+
+    worker.uploads.task_done();
+    FinishAction(&worker, upload->action);
   }
 }
 
+void FileEventQueueHandler::FinishAction(Worker* worker,
+                                         const Action& action) {
+  dbm_->Delete(DBManager::Options(action.queue, top_dir_id_), action.key);
+
+  std::unique_lock<mutex> lock(workers_mutex_);
+  in_flight_.erase(action.key);
+  worker->uploading.erase(action.partition);
+  lock.unlock();
+  workers_cv_.notify_all();
+}
+
 namespace {
 
 void SplitKey(const string& key, string* timestamp, string* top_dir,
@@ -173,7 +255,21 @@ void SplitKey(const string& key, string* timestamp, string* top_dir,
 
 } // namespace
 
-void FileEventQueueHandler::HandleRemoteAction(const string& key,
+string FileEventQueueHandler::PartitionKey(const Action& action) {
+  if (action.queue == ClientDB::UPDATE_QUEUE_CLIENT) {
+    string ts, path;
+    ParseTimestampPath(action.key, &ts, &path);
+    return RemoveBaseFromInput(top_dir_path_, path);
+  }
+
+  string timestamp, top_dir, rel_path_guid, device, hash;
+  SplitKey(action.key, &timestamp, &top_dir, &rel_path_guid, &device, &hash);
+  const string rel_path(dbm_->RelpathGuidToPath(rel_path_guid, top_dir));
+  return rel_path.empty() ? rel_path_guid : rel_path;
+}
+
+void FileEventQueueHandler::HandleRemoteAction(Client* client,
+                                               const string& key,
                                                const string& value) {
   (void)value;
   // Value stored in the |key|.
@@ -188,18 +284,19 @@ void FileEventQueueHandler::HandleRemoteAction(const string& key,
 
   const string rel_path(dbm_->RelpathGuidToPath(rel_path_guid, top_dir));
   if (!rel_path.empty()) {
-    HandleRemoteModAction(timestamp, top_dir, top_dir_path,
+    HandleRemoteModAction(client, timestamp, top_dir, top_dir_path,
                           rel_path_guid, rel_path, device, hash);
   } else {
     // TODO(tierney): Haven't seen this file before.
     LOG(WARNING) << "Haven't seen this file before.";
 
-    HandleRemoteAddAction(timestamp, top_dir, top_dir_path,
+    HandleRemoteAddAction(client, timestamp, top_dir, top_dir_path,
                           rel_path_guid, device, hash);
   }
 }
 
-void FileEventQueueHandler::HandleRemoteAddAction(const string& timestamp,
+void FileEventQueueHandler::HandleRemoteAddAction(Client* client,
+                                                  const string& timestamp,
                                                   const string& top_dir,
                                                   const string& top_dir_path,
                                                   const string& rel_path_guid,
@@ -217,8 +314,7 @@ void FileEventQueueHandler::HandleRemoteAddAction(const string& timestamp,
   request.pkg_name = hash;
 
   RemotePackage package;
-  client_->Exec<void, RemotePackage&, const DownloadRequest&>(
-      &LockboxServiceClient::DownloadPackage, package, request);
+  client->DownloadPackageChunked(request, &package);
   CHECK(package.type == PackageType::SNAPSHOT) << "New path not a snapshot";
 
   // Decrypt the path.
@@ -257,11 +353,25 @@ void FileEventQueueHandler::HandleRemoteAddAction(const string& timestamp,
                << file_contents.size();
   }
 
+  // Record the file as synced, so that neither a restart nor its first local
+  // change mistakes it for a new one.
+  DBManager::Batch batch(dbm_);
+  batch.Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir),
+            rel_path, file_contents);
+  batch.Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir),
+            rel_path, SHA1Hex(file_contents));
+  FileIndex::Entry entry;
+  if (FileIndex::Stat(full_path, &entry)) {
+    index_->Put(full_path, entry, &batch);
+  }
+  CHECK(dbm_->Write(&batch, true /* sync */));
+
   // Unlock the path.
   dbm_->ReleaseLockPath(rel_path_guid, top_dir);
 }
 
-void FileEventQueueHandler::HandleRemoteModAction(const string& timestamp,
+void FileEventQueueHandler::HandleRemoteModAction(Client* client,
+                                                  const string& timestamp,
                                                   const string& top_dir,
                                                   const string& top_dir_path,
                                                   const string& rel_path_guid,
@@ -293,8 +403,7 @@ void FileEventQueueHandler::HandleRemoteModAction(const string& timestamp,
 
   // Grab the package from the cloud.
   RemotePackage package;
-  client_->Exec<void, RemotePackage&, const DownloadRequest&>(
-      &LockboxServiceClient::DownloadPackage, package, request);
+  client->DownloadPackageChunked(request, &package);
 
   // Learn the action type from the type of the package (DELTA | SNAPSHOT).
 
@@ -309,12 +418,11 @@ void FileEventQueueHandler::HandleRemoteModAction(const string& timestamp,
 
     // Determine what the deltas previous is supposed to be and if we have that
     // previous file on disk.
-    const string current_file_hash = SHA1Hex(current_file);
 
     // Get downloaded packages hash.
 
     // Get hash fptr.
-    // client_->Exec();
+    // client->Exec();
 
     // if hash fptr is our current versions fptr, then apply delta.
 
@@ -334,37 +442,52 @@ void FileEventQueueHandler::HandleRemoteModAction(const string& timestamp,
     CHECK(bytes_written == reconstructed.size());
 
     // Store the reconstructed hash and keep the pointers.
-    dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir),
+    DBManager::Batch batch(dbm_);
+    batch.Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir),
               rel_path, reconstructed);
     const string reconstructed_hash = SHA1Hex(reconstructed);
-    dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir),
+    batch.Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir),
               rel_path, reconstructed_hash);
+    FileIndex::Entry entry;
+    if (FileIndex::Stat(full_path, &entry)) {
+      index_->Put(full_path, entry, &batch);
+    }
+    CHECK(dbm_->Write(&batch, true /* sync */));
   }
 
   // Case: Snapshot.
   if (package.type == PackageType::SNAPSHOT) {
-    string current_file;
     string abs_path = top_dir_path + rel_path;
-    file_util::ReadFileToString(base::FilePath(abs_path), &current_file);
 
-    // See if the current file and the decrypted file are the same.
     string payload;
     encryptor_->Decrypt(package.payload.data,
                         package.payload.user_enc_session,
                         &payload);
 
-    SetIgnorableAction(abs_path, to_string(FW::Actions::Modified));
-    const unsigned bytes_written = file_util::WriteFile(base::FilePath(abs_path),
-                                                        payload.c_str(),
-                                                        payload.size());
-    CHECK(bytes_written == payload.size());
+    // See if the current file and the decrypted file are the same. Only the
+    // file's hash is needed for that, not its contents.
+    const string payload_hash = SHA1Hex(payload);
+    string current_file_hash;
+    if (!SHA1HexFile(abs_path, &current_file_hash) ||
+        current_file_hash != payload_hash) {
+      SetIgnorableAction(abs_path, to_string(FW::Actions::Modified));
+      const unsigned bytes_written =
+          file_util::WriteFile(base::FilePath(abs_path), payload.c_str(),
+                               payload.size());
+      CHECK(bytes_written == payload.size());
+    }
 
     // Store the payload hash and keep the pointers.
-    dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir),
+    DBManager::Batch batch(dbm_);
+    batch.Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir),
               rel_path, payload);
-    const string payload_hash = SHA1Hex(payload);
-    dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir),
+    batch.Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir),
               rel_path, payload_hash);
+    FileIndex::Entry entry;
+    if (FileIndex::Stat(abs_path, &entry)) {
+      index_->Put(abs_path, entry, &batch);
+    }
+    CHECK(dbm_->Write(&batch, true /* sync */));
 
   }
 
@@ -389,8 +512,9 @@ void FileEventQueueHandler::SetIgnorableAction(const string& abs_path,
   ignorable_actions_.insert(key);
 }
 
-void FileEventQueueHandler::HandleLocalAction(const string& ts_path,
-                                              const string& event_type) {
+void FileEventQueueHandler::HandleLocalAction(
+    Client* client, const string& ts_path, const string& event_type,
+    scoped_ptr<PendingUpload>* upload) {
   // For a local action.
   string ts, path;
   ParseTimestampPath(ts_path, &ts, &path);
@@ -407,7 +531,7 @@ void FileEventQueueHandler::HandleLocalAction(const string& ts_path,
   bool success = false;
   switch (fw_action) {
     case FW::Actions::Add:
-      success = HandleAddAction(path);
+      success = HandleAddAction(client, path, upload);
       if (!success) {
         LOG(WARNING) << "Someone else add won... ";
         CHECK(false);
@@ -420,7 +544,7 @@ void FileEventQueueHandler::HandleLocalAction(const string& ts_path,
       LOG(WARNING) << "Delete not implemented.";
       break;
     case FW::Actions::Modified:
-      success = HandleModAction(path);
+      success = HandleModAction(client, path, upload);
       CHECK(success) << "Someone else mod won...";
       break;
     default:
@@ -428,7 +552,8 @@ void FileEventQueueHandler::HandleLocalAction(const string& ts_path,
   }
 }
 
-bool FileEventQueueHandler::HandleModAction(const string& path) {
+bool FileEventQueueHandler::HandleModAction(
+    Client* client, const string& path, scoped_ptr<PendingUpload>* upload) {
   // TODO(tierney): Check that the hash of the file before and after are the
   // same (unmodified). Otherwise we need to start over.
 
@@ -441,7 +566,17 @@ bool FileEventQueueHandler::HandleModAction(const string& path) {
 
   if (path_guid.empty()) {
     LOG(ERROR) << "Got mod before a GUID was assigned.";
-    return HandleAddAction(path);
+    return HandleAddAction(client, path, upload);
+  }
+
+  // A file that still matches its index entry is as it was last synced, e.g.
+  // when the event is our own write of a download, so it is not even read.
+  FileIndex::Entry entry;
+  const bool have_entry = FileIndex::Stat(path, &entry);
+  FileIndex::Entry indexed;
+  if (have_entry && index_->Lookup(path, &indexed) && indexed == entry) {
+    LOG(INFO) << "File unchanged since it was synced: " << path;
+    return true;
   }
 
   // Lock the file in the cloud.
@@ -453,7 +588,7 @@ bool FileEventQueueHandler::HandleModAction(const string& path) {
 
   // Acquire the lock on the cloud.
   PathLockResponse response;
-  client_->Exec<void, PathLockResponse&, const PathLockRequest&>(
+  client->Exec<void, PathLockResponse&, const PathLockRequest&>(
       &LockboxServiceClient::AcquireLockRelPath,
       response,
       path_lock);
@@ -498,17 +633,22 @@ bool FileEventQueueHandler::HandleModAction(const string& path) {
   dbm_->Get(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir_id_),
             relative_path, &prev_hash);
 
-  // Read the file from the disk.
+  // The delta needs the whole file anyway, so read it once and hash that to
+  // tell a file that was only touched.
   string current;
   file_util::ReadFileToString(base::FilePath(path), &current);
-
-  const string current_sha1_hex(SHA1Hex(current));
+  const string current_sha1_hex = SHA1Hex(current);
   if (current_sha1_hex == prev_hash) {
     LOG(INFO) << "File actually unchanged according to SHA1";
+    if (have_entry) {
+      DBManager::Batch batch(dbm_);
+      index_->Put(path, entry, &batch);
+      CHECK(dbm_->Write(&batch, false /* sync */));
+    }
 
     // Release the lock.
     // TODO(tierney): Locking path remotely should be a scoped operation.
-    client_->Exec<void, const PathLockRequest&>(
+    client->Exec<void, const PathLockRequest&>(
         &LockboxServiceClient::ReleaseLockRelPath,
         path_lock);
     return true;
@@ -517,9 +657,10 @@ bool FileEventQueueHandler::HandleModAction(const string& path) {
   // Compute the difference.
   const string delta = Delta::Generate(output, current);
 
-  // Model for changing between the delta and the snapshot.
+  // Model for changing between the delta and the snapshot. The server asks for
+  // a snapshot once the chain of deltas behind the head grows too long.
   bool use_delta = true;
-  if (delta.size() >= current.size()) {
+  if (delta.size() >= current.size() || response.want_snapshot) {
     use_delta = false;
   }
   const string& to_encrypt = use_delta ? delta : current;
@@ -543,39 +684,37 @@ bool FileEventQueueHandler::HandleModAction(const string& path) {
     package.delta_prev_hash.data_sha1 = SHA1Hex(package.delta_prev_hash.data);
   }
 
-  // Upload the package. Cloud needs to update the appropriate user's
-  // update queues.
-  LOG(INFO) << "Uploading " << path;
-  int64 ret = client_->Exec<int64, const UserAuth&, const RemotePackage&>(
-      &LockboxServiceClient::UploadPackage, *user_auth_, package);
-  LOG(INFO) << "Uploaded " << ret << " bytes for " << path;
-
-  // Store the data in the local client db. SHOULD ACTUALLY STORE THE WHOLE
-  // VERSION. THIS WAY WE CAN AVOID RECONSTRUCTION COSTS.
+  // Store the data in the local client db once uploaded. SHOULD ACTUALLY STORE
+  // THE WHOLE VERSION. THIS WAY WE CAN AVOID RECONSTRUCTION COSTS.
   options.type = ClientDB::DATA;
   options.name = top_dir_id_;
   const string hash(SHA1Hex(package.payload.data));
 
   serial_pkg.clear();
   ThriftToString(package, &serial_pkg);
-  dbm_->Put(options, hash, serial_pkg);
+  scoped_ptr<DBManager::Batch> batch(new DBManager::Batch(dbm_));
+  batch->Put(options, hash, serial_pkg);
 
   // Put into relpath the latest hash.
-  dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_HASH, top_dir_id_),
-            relative_path, hash);
-  dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir_id_),
-            relative_path, current);
-  dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir_id_),
-            relative_path, current_sha1_hex);
+  batch->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_HASH, top_dir_id_),
+             relative_path, hash);
+  batch->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir_id_),
+             relative_path, current);
+  batch->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir_id_),
+             relative_path, current_sha1_hex);
+  if (have_entry) {
+    index_->Put(path, entry, batch.get());
+  }
 
   // Then set the fptr.
-  dbm_->Put(DBManager::Options(ClientDB::FPTRS, top_dir_id_), hash, prev_hash);
-
-  // Release the lock.
-  client_->Exec<void, const PathLockRequest&>(
-      &LockboxServiceClient::ReleaseLockRelPath,
-      path_lock);
-
+  batch->Put(DBManager::Options(ClientDB::FPTRS, top_dir_id_), hash, prev_hash);
+
+  // The uploader sends the package, writes |batch| and releases the lock.
+  upload->reset(new PendingUpload);
+  (*upload)->path = path;
+  std::swap((*upload)->package, package);
+  (*upload)->batch.reset(batch.release());
+  (*upload)->path_lock = path_lock;
   return true;
 }
 
@@ -583,14 +722,15 @@ bool FileEventQueueHandler::HandleModAction(const string& path) {
 //   return false;
 // }
 
-bool FileEventQueueHandler::HandleAddAction(const string& path) {
+bool FileEventQueueHandler::HandleAddAction(
+    Client* client, const string& path, scoped_ptr<PendingUpload>* upload) {
   // Register path.
   string path_guid;
   RegisterRelativePathRequest rel_path_req;
   rel_path_req.user.email = user_auth_->email;
   rel_path_req.user.password = user_auth_->password;
   rel_path_req.top_dir = top_dir_id_;
-  client_->Exec<void, string&, const RegisterRelativePathRequest&>(
+  client->Exec<void, string&, const RegisterRelativePathRequest&>(
       &LockboxServiceClient::RegisterRelativePath,
       path_guid,
       rel_path_req);
@@ -620,7 +760,7 @@ bool FileEventQueueHandler::HandleAddAction(const string& path) {
 
   // Acquire the lock on the cloud.
   PathLockResponse response;
-  client_->Exec<void, PathLockResponse&, const PathLockRequest&>(
+  client->Exec<void, PathLockResponse&, const PathLockRequest&>(
       &LockboxServiceClient::AcquireLockRelPath,
       response,
       path_lock);
@@ -633,6 +773,8 @@ bool FileEventQueueHandler::HandleAddAction(const string& path) {
     return false;
   }
 
+  FileIndex::Entry entry;
+  const bool have_entry = FileIndex::Stat(path, &entry);
   string current;
   file_util::ReadFileToString(base::FilePath(path), &current);
 
@@ -650,43 +792,40 @@ bool FileEventQueueHandler::HandleAddAction(const string& path) {
   //                     &out_path);
   // LOG(INFO) << "Is it what we expect? " << out_path;
 
-  // Upload the package. Cloud needs to update the appropriate user's
-  // update queues.
-  LOG(INFO) << "Uploading " << path;
-  int64 ret = client_->Exec<int64, const UserAuth&, const RemotePackage&>(
-      &LockboxServiceClient::UploadPackage, *user_auth_, package);
-  LOG(INFO) << "Uploaded " << ret << " bytes for " << path;
-
-  // Store the data in the local client db.
+  // Store the data in the local client db once uploaded.
   options.type = ClientDB::DATA;
   options.name = top_dir_id_;
   const string hash(SHA1Hex(package.payload.data));
 
   // Place the contents of the previous file.
   const string current_file_sha1_hex(SHA1Hex(current));
-  dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir_id_),
-            relative_path, current);
-  dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir_id_),
-            relative_path, current_file_sha1_hex);
+  scoped_ptr<DBManager::Batch> batch(new DBManager::Batch(dbm_));
+  batch->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE, top_dir_id_),
+             relative_path, current);
+  batch->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH, top_dir_id_),
+             relative_path, current_file_sha1_hex);
+  if (have_entry) {
+    index_->Put(path, entry, batch.get());
+  }
 
   string serial_pkg;
   ThriftToString(package, &serial_pkg);
-  dbm_->Put(options, hash, serial_pkg);
+  batch->Put(options, hash, serial_pkg);
 
   // Put into relpath the latest hash.
-  dbm_->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_HASH, top_dir_id_),
-            relative_path, hash);
+  batch->Put(DBManager::Options(ClientDB::RELPATHS_HEAD_HASH, top_dir_id_),
+             relative_path, hash);
 
   // Then set the fptr.
-  dbm_->Put(DBManager::Options(ClientDB::FPTRS, top_dir_id_), hash, "");
-
-  // Release the lock.
-  client_->Exec<void, const PathLockRequest&>(
-      &LockboxServiceClient::ReleaseLockRelPath,
-      path_lock);
-
-  dbm_->ReleaseLockPath(path_guid, top_dir_id_);
-
+  batch->Put(DBManager::Options(ClientDB::FPTRS, top_dir_id_), hash, "");
+
+  // The uploader sends the package, writes |batch| and releases both locks.
+  upload->reset(new PendingUpload);
+  (*upload)->path = path;
+  std::swap((*upload)->package, package);
+  (*upload)->batch.reset(batch.release());
+  (*upload)->path_lock = path_lock;
+  (*upload)->local_lock = path_guid;
   return true;
 }
 
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
 #include <map>
 #include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 #if defined(OS_MACOSX)
 #define BOOST_NO_CXX11_NUMERIC_LIMITS 1
@@ -11,14 +14,20 @@
 
 #include <boost/thread/thread.hpp>
 
+#include "base/memory/scoped_ptr.h"
 #include "client.h"
 #include "db_manager_client.h"
 #include "encryptor.h"
+#include "file_index.h"
+#include "queue.h"
 
+using std::condition_variable;
+using std::deque;
 using std::map;
 using std::mutex;
 using std::set;
 using std::string;
+using std::vector;
 
 namespace lockbox {
 
@@ -27,30 +36,115 @@ namespace lockbox {
 // prepared. If it appears that a path has been locked, then the client waits
 // for the updates from the cloud before presenting a conflicting view to the
 // end-user.
+//
+// Actions are handled by a pool of workers, each with its own connection to the
+// server, so that different files are read, encrypted and uploaded in
+// parallel. Actions are partitioned on the file's relative path: those on one
+// file go to the same worker and are handled in the order they were queued.
+//
+// Each worker is a two stage pipeline. The worker thread reads, diffs and
+// encrypts a local change and hands the package over a bounded queue to its
+// uploader thread, which has a connection of its own. The next file is then
+// prepared while the last one uploads. A file's next action waits for the
+// upload of its previous one, whose head it builds on.
 class FileEventQueueHandler {
  public:
-  // Does not take ownership of |dbm| or |client|.
-  explicit FileEventQueueHandler(const string& top_dir,
-                                 DBManagerClient* dbm,
-                                 Client* client,
-                                 Encryptor* encryptor,
-                                 UserAuth* user_auth);
+  // Does not take ownership of |dbm|, |client| or |index|. Workers connect the
+  // way |client| does. Each file synced either way is recorded in |index|.
+  FileEventQueueHandler(const string& top_dir,
+                        DBManagerClient* dbm,
+                        Client* client,
+                        Encryptor* encryptor,
+                        UserAuth* user_auth,
+                        FileIndex* index,
+                        int num_workers);
 
   virtual ~FileEventQueueHandler();
 
+  // Hands queued actions to the workers.
   void Run();
 
  private:
-  void PrepareMaps();
+  // An entry of UPDATE_QUEUE_SERVER or UPDATE_QUEUE_CLIENT.
+  struct Action {
+    ClientDB::type queue;
+    string key;
+    string value;
 
-  void HandleRemoteAction(const string& key, const string& value);
-  void HandleRemoteAddAction(const string& timestamp,
+    // See PartitionKey().
+    string partition;
+  };
+
+  // A package prepared by a worker, waiting for its uploader.
+  struct PendingUpload {
+    // Deleted from its queue once the package is recorded.
+    Action action;
+
+    string path;
+    RemotePackage package;
+
+    // Records the package locally once it is uploaded.
+    scoped_ptr<DBManager::Batch> batch;
+
+    // Cloud lock to release after the upload.
+    PathLockRequest path_lock;
+
+    // Relpath GUID of the local lock to release after the upload, if any.
+    string local_lock;
+  };
+
+  struct Worker {
+    Worker() : uploads(kMaxPendingUploads) {}
+
+    scoped_ptr<Client> client;
+    scoped_ptr<Client> upload_client;
+
+    // Of PendingUpload, owned.
+    Queue uploads;
+
+    // Actions handed to the worker and not started yet. Requires
+    // |workers_mutex_|.
+    deque<Action> actions;
+
+    // Partitions with a package on |uploads| or being uploaded. Requires
+    // |workers_mutex_|.
+    set<string> uploading;
+  };
+
+  // Packages a worker prepares ahead of its uploader.
+  static const int kMaxPendingUploads = 4;
+
+  // Handles the actions of worker |index|, passing local changes on to its
+  // uploader.
+  void Work(int index);
+
+  // Uploads and records the packages prepared by worker |index|.
+  void Upload(int index);
+
+  // Deletes |action| from its queue and lets the next action of its partition
+  // on |worker| start.
+  void FinishAction(Worker* worker, const Action& action);
+
+  // Hands the entries of |queue| that are not in flight yet to the workers,
+  // waiting for room where a worker has a backlog. Returns how many it handed
+  // out.
+  int Dispatch(ClientDB::type queue);
+
+  // Relative path of the file that |action| is about, or the relpath GUID of a
+  // file not known here yet.
+  string PartitionKey(const Action& action);
+
+  void HandleRemoteAction(Client* client, const string& key,
+                          const string& value);
+  void HandleRemoteAddAction(Client* client,
+                             const string& timestamp,
                              const string& top_dir,
                              const string& top_dir_path,
                              const string& rel_path_guid,
                              const string& device,
                              const string& hash);
-  void HandleRemoteModAction(const string& timestamp,
+  void HandleRemoteModAction(Client* client,
+                             const string& timestamp,
                              const string& top_dir,
                              const string& top_dir_path,
                              const string& rel_path_guid,
@@ -58,28 +152,40 @@ class FileEventQueueHandler {
                              const string& device,
                              const string& hash);
 
-  void HandleLocalAction(const string& ts_path, const string& event_type);
+  // Local actions that change a file set |upload| to the package to upload.
+  void HandleLocalAction(Client* client, const string& ts_path,
+                         const string& event_type,
+                         scoped_ptr<PendingUpload>* upload);
   // Accompanying local action methods.
-  bool HandleAddAction(const string& path);
-  bool HandleModAction(const string& path);
+  bool HandleAddAction(Client* client, const string& path,
+                       scoped_ptr<PendingUpload>* upload);
+  bool HandleModAction(Client* client, const string& path,
+                       scoped_ptr<PendingUpload>* upload);
 
   void SetIgnorableAction(const string& abs_path, const string& event_type);
   bool IgnorableAction(const string& abs_path, const string& event_type);
 
   DBManagerClient* dbm_;
-  Client* client_;
   Encryptor* encryptor_;
   UserAuth* user_auth_;
+  FileIndex* index_;
 
-  boost::thread* thread_;
   const string top_dir_id_;
   string top_dir_path_;
 
+  mutex workers_mutex_;
+  // Signalled when a worker is given an action or finishes one.
+  condition_variable workers_cv_;
+  vector<Worker> workers_;
+  // Keys of the actions handed to workers and not yet deleted from their
+  // queues.
+  set<string> in_flight_;
+
+  boost::thread* thread_;
+  boost::thread_group worker_threads_;
+
   set<string> ignorable_actions_;
   mutex ignorables_mutex_;
-
-  map<string, string> path_hashes_;
-  map<string, time_t> path_mtime_;
 };
 
 } // namespace lockbox
@@ -0,0 +1,205 @@
+#include "file_index.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <set>
+
+#include "base/file_util.h"
+#include "base/files/file_path.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/stringprintf.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "hash_util.h"
+#include "util.h"
+
+using std::set;
+
+namespace lockbox {
+
+bool FileIndex::Entry::operator==(const Entry& other) const {
+  return inode == other.inode && size == other.size &&
+      mtime_ns == other.mtime_ns;
+}
+
+string FileIndex::Entry::ToString() const {
+  return base::StringPrintf("%llu,%lld,%lld",
+                            static_cast<unsigned long long>(inode),
+                            static_cast<long long>(size),
+                            static_cast<long long>(mtime_ns));
+}
+
+bool FileIndex::Entry::FromString(const string& str, Entry* entry) {
+  CHECK(entry);
+  vector<string> fields;
+  base::SplitString(str, ',', &fields);
+  uint64 inode = 0;
+  int64 size = 0;
+  int64 mtime_ns = 0;
+  if (fields.size() != 3 || !base::StringToUint64(fields[0], &inode) ||
+      !base::StringToInt64(fields[1], &size) ||
+      !base::StringToInt64(fields[2], &mtime_ns)) {
+    return false;
+  }
+  entry->inode = inode;
+  entry->size = size;
+  entry->mtime_ns = mtime_ns;
+  return true;
+}
+
+FileIndex::FileIndex(DBManagerClient* dbm, const string& top_dir_id,
+                     const string& top_dir_path, int num_threads)
+    : dbm_(dbm), top_dir_id_(top_dir_id), top_dir_path_(top_dir_path),
+      num_threads_(num_threads) {
+  CHECK(dbm);
+  CHECK_GT(num_threads, 0);
+}
+
+FileIndex::~FileIndex() {
+}
+
+void FileIndex::Scan(vector<string>* added, vector<string>* modified) {
+  CHECK(added);
+  CHECK(modified);
+  added->clear();
+  modified->clear();
+
+  vector<string> paths;
+  file_util::FileEnumerator enumerator(base::FilePath(top_dir_path_),
+                                       true /* recursive */,
+                                       file_util::FileEnumerator::FILES);
+  for (base::FilePath path = enumerator.Next(); !path.empty();
+       path = enumerator.Next()) {
+    paths.push_back(path.value());
+  }
+
+  // Each thread fills in its own stride of |results|.
+  vector<Scanned> results(paths.size());
+  boost::thread_group threads;
+  for (int i = 0; i < num_threads_; ++i) {
+    threads.create_thread(boost::bind(&FileIndex::ScanSome, this,
+                                      boost::cref(paths), i, num_threads_,
+                                      &results));
+  }
+  threads.join_all();
+
+  const DBManager::Options options(ClientDB::FILE_INDEX, top_dir_id_);
+  DBManager::Batch batch(dbm_);
+  set<string> present;
+  int touched = 0;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    present.insert(RelativePath(paths[i]));
+    switch (results[i].state) {
+      case Scanned::UNCHANGED:
+        break;
+      case Scanned::TOUCHED:
+        Put(paths[i], results[i].entry, &batch);
+        ++touched;
+        break;
+      case Scanned::ADDED:
+        added->push_back(paths[i]);
+        break;
+      case Scanned::MODIFIED:
+        modified->push_back(paths[i]);
+        break;
+    }
+  }
+
+  // Drop the entries of files removed while the client was down.
+  int gone = 0;
+  scoped_ptr<leveldb::Iterator> it(dbm_->NewIterator(options));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    const string rel_path = it->key().ToString();
+    if (present.count(rel_path) == 0) {
+      batch.Delete(options, rel_path);
+      ++gone;
+    }
+  }
+  if (!batch.empty()) {
+    CHECK(dbm_->Write(&batch, true /* sync */));
+  }
+
+  LOG(INFO) << "Scanned " << paths.size() << " files of " << top_dir_path_
+            << ": " << added->size() << " added, " << modified->size()
+            << " modified, " << touched << " touched, " << gone << " gone";
+}
+
+bool FileIndex::Stat(const string& abs_path, Entry* entry) {
+  CHECK(entry);
+  struct stat info;
+  if (stat(abs_path.c_str(), &info) != 0) {
+    return false;
+  }
+#if defined(OS_MACOSX)
+  const struct timespec& mtime = info.st_mtimespec;
+#else
+  const struct timespec& mtime = info.st_mtim;
+#endif
+  entry->inode = info.st_ino;
+  entry->size = info.st_size;
+  entry->mtime_ns = static_cast<int64_t>(mtime.tv_sec) * 1000000000 +
+      mtime.tv_nsec;
+  return true;
+}
+
+bool FileIndex::Lookup(const string& abs_path, Entry* entry) {
+  CHECK(entry);
+  string value;
+  return dbm_->Get(DBManager::Options(ClientDB::FILE_INDEX, top_dir_id_),
+                   RelativePath(abs_path), &value) &&
+      Entry::FromString(value, entry);
+}
+
+void FileIndex::Put(const string& abs_path, const Entry& entry,
+                    DBManager::Batch* batch) {
+  CHECK(batch);
+  batch->Put(DBManager::Options(ClientDB::FILE_INDEX, top_dir_id_),
+             RelativePath(abs_path), entry.ToString());
+}
+
+void FileIndex::ScanSome(const vector<string>& paths, size_t first,
+                         size_t stride, vector<Scanned>* results) {
+  for (size_t i = first; i < paths.size(); i += stride) {
+    Scanned& result = (*results)[i];
+    if (!Stat(paths[i], &(result.entry))) {
+      // Removed since it was listed; the watcher reports that.
+      continue;
+    }
+
+    Entry indexed;
+    if (Lookup(paths[i], &indexed) && indexed == result.entry) {
+      continue;
+    }
+    const string rel_path = RelativePath(paths[i]);
+
+    // Only now is the file worth reading. Files synced before the index
+    // existed have no entry and get hashed once here.
+    string head_hash;
+    dbm_->Get(DBManager::Options(ClientDB::RELPATHS_HEAD_FILE_HASH,
+                                 top_dir_id_),
+              rel_path, &head_hash);
+    string sha1_hex;
+    if (!SHA1HexFile(paths[i], &sha1_hex)) {
+      continue;
+    }
+    if (!head_hash.empty() && sha1_hex == head_hash) {
+      result.state = Scanned::TOUCHED;
+      continue;
+    }
+
+    string path_guid;
+    dbm_->Get(DBManager::Options(ClientDB::LOCATION_RELPATH_ID, top_dir_id_),
+              rel_path, &path_guid);
+    result.state = path_guid.empty() ? Scanned::ADDED : Scanned::MODIFIED;
+  }
+}
+
+string FileIndex::RelativePath(const string& abs_path) const {
+  return RemoveBaseFromInput(top_dir_path_, abs_path);
+}
+
+} // namespace lockbox
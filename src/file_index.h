@@ -0,0 +1,92 @@
+// Persisted index of the files of one top dir, kept in FILE_INDEX under each
+// file's relative path as INODE,SIZE,MTIME_NS. An entry describes the file as
+// it was when its contents were last synced, and is written in the same batch
+// as that sync's RELPATHS_HEAD_FILE_HASH.
+//
+// On startup Scan() stats every file, on several threads, and only hashes the
+// files whose metadata no longer matches their entry, so that a restart costs
+// time in proportion to what changed while the client was down rather than to
+// the size of the folder.
+//
+//  lockbox::FileIndex index(&dbm, top_dir_id, top_dir_path, 8);
+//  vector<string> added, modified;
+//  index.Scan(&added, &modified);
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "db_manager_client.h"
+
+using std::string;
+using std::vector;
+
+namespace lockbox {
+
+class FileIndex {
+ public:
+  struct Entry {
+    Entry() : inode(0), size(0), mtime_ns(0) {}
+
+    bool operator==(const Entry& other) const;
+
+    string ToString() const;
+    static bool FromString(const string& str, Entry* entry);
+
+    uint64_t inode;
+    int64_t size;
+    int64_t mtime_ns;
+  };
+
+  // Does not take ownership of |dbm|. Scans on |num_threads| threads.
+  FileIndex(DBManagerClient* dbm, const string& top_dir_id,
+            const string& top_dir_path, int num_threads);
+
+  ~FileIndex();
+
+  // Sets |added| to the absolute paths of the files that are not tracked yet
+  // and |modified| to those of tracked files whose contents differ from their
+  // head. Entries of files that were only touched are brought up to date, and
+  // those of files that are gone are dropped.
+  void Scan(vector<string>* added, vector<string>* modified);
+
+  // Sets |entry| from the file at |abs_path|. Take it before reading the file,
+  // so that a write racing the read shows up as a change on the next scan.
+  static bool Stat(const string& abs_path, Entry* entry);
+
+  // Sets |entry| to the indexed entry of the file at |abs_path|. Returns false
+  // if there is none.
+  bool Lookup(const string& abs_path, Entry* entry);
+
+  // Adds to |batch| the entry of the file at |abs_path|.
+  void Put(const string& abs_path, const Entry& entry,
+           DBManager::Batch* batch);
+
+ private:
+  // What Scan() found for one file.
+  struct Scanned {
+    Scanned() : state(UNCHANGED) {}
+
+    enum State { UNCHANGED, TOUCHED, ADDED, MODIFIED };
+
+    State state;
+    Entry entry;
+  };
+
+  // Scans every |stride|th of |paths|, starting with |first|, into |results|.
+  void ScanSome(const vector<string>& paths, size_t first, size_t stride,
+                vector<Scanned>* results);
+
+  string RelativePath(const string& abs_path) const;
+
+  DBManagerClient* dbm_;
+  const string top_dir_id_;
+  const string top_dir_path_;
+  const int num_threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileIndex);
+};
+
+} // namespace lockbox
@@ -20,6 +20,42 @@ FileWatcherThread::~FileWatcherThread() {
   delete updater_;
 }
 
+void FileWatcherThread::WatchDirectory(const string& path, bool recursive) {
+  file_watcher_.addWatch(path, this);
+  if (!recursive) {
+    return;
+  }
+
+  vector<string> sub_dirs;
+  EnumerateDirectories(path, &sub_dirs);
+  for (auto& sub_dir : sub_dirs) {
+    file_watcher_.addWatch(sub_dir, this);
+  }
+}
+
+void FileWatcherThread::AddIndexedDirectory(const string& path,
+                                            FileIndex* index) {
+  CHECK(index);
+
+  // Watch first so that nothing changed during the scan is missed.
+  WatchDirectory(path, true /* recursive */);
+
+  vector<string> added, modified;
+  index->Scan(&added, &modified);
+  for (const string& abs_filepath : added) {
+    base::FilePath filepath(abs_filepath);
+    db_manager_->AddNewFileToUnfilteredQueue(filepath.DirName().value(),
+                                             filepath.BaseName().value(),
+                                             FW::Actions::Add);
+  }
+  for (const string& abs_filepath : modified) {
+    base::FilePath filepath(abs_filepath);
+    db_manager_->AddNewFileToUnfilteredQueue(filepath.DirName().value(),
+                                             filepath.BaseName().value(),
+                                             FW::Actions::Modified);
+  }
+}
+
 void FileWatcherThread::AddDirectory(const string& path, bool recursive) {
   file_watcher_.addWatch(path, this);
 
@@ -11,6 +11,7 @@
 #include <boost/bimap.hpp>
 
 #include "db_manager_client.h"
+#include "file_index.h"
 #include "file_watcher/file_watcher.h"
 
 using std::string;
@@ -30,6 +31,11 @@ class FileWatcherThread : public FW::FileWatchListener {
 
   void AddDirectory(const string& path, bool recursive);
 
+  // Watches |path| and everything under it, but only queues the files that
+  // |index| finds added or modified since the last run. Does not take
+  // ownership of |index|.
+  void AddIndexedDirectory(const string& path, FileIndex* index);
+
   void RemoveDirectory(const string& path);
 
   void handleFileAction(FW::WatchID watchid, const string& dir,
@@ -41,6 +47,8 @@ class FileWatcherThread : public FW::FileWatchListener {
   void Run();
 
  private:
+  void WatchDirectory(const string& path, bool recursive);
+
   boost::thread* updater_;
   DBManagerClient* db_manager_;
   FW::FileWatcher file_watcher_;
@@ -1,13 +1,81 @@
 #include "hash_util.h"
 
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "base/logging.h"
+#include "base/posix/eintr_wrapper.h"
 #include "base/sha1.h"
 #include "base/strings/string_number_conversions.h"
 
+using std::vector;
+
 namespace lockbox {
 
+namespace {
+
+// Large enough to amortize the read calls, small enough to stay in cache.
+const size_t kReadBufferBytes = 256 << 10;
+
+} // namespace
+
 string SHA1Hex(const string& input) {
   const string raw_sha1(base::SHA1HashString(input));
   return base::HexEncode(raw_sha1.c_str(), raw_sha1.length());
 }
 
+SHA1Hasher::SHA1Hasher() : context_(EVP_MD_CTX_new()) {
+  CHECK(context_);
+  CHECK_EQ(1, EVP_DigestInit_ex(context_, EVP_sha1(), NULL));
+}
+
+SHA1Hasher::~SHA1Hasher() {
+  EVP_MD_CTX_free(context_);
+}
+
+void SHA1Hasher::Update(const char* data, size_t length) {
+  CHECK_EQ(1, EVP_DigestUpdate(context_, data, length));
+}
+
+string SHA1Hasher::Hex() const {
+  // Finish a copy, leaving this context open.
+  EVP_MD_CTX* copy = EVP_MD_CTX_new();
+  CHECK(copy);
+  CHECK_EQ(1, EVP_MD_CTX_copy_ex(copy, context_));
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  CHECK_EQ(1, EVP_DigestFinal_ex(copy, digest, &length));
+  EVP_MD_CTX_free(copy);
+  return base::HexEncode(digest, length);
+}
+
+bool SHA1HexFile(const string& path, string* hex) {
+  CHECK(hex);
+  const int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(WARNING) << "Cannot open " << path;
+    return false;
+  }
+#if defined(OS_LINUX)
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  SHA1Hasher hasher;
+  vector<char> buffer(kReadBufferBytes);
+  ssize_t count = 0;
+  while ((count = HANDLE_EINTR(read(fd, &(buffer[0]), buffer.size()))) > 0) {
+    hasher.Update(&(buffer[0]), count);
+  }
+  close(fd);
+  if (count < 0) {
+    PLOG(WARNING) << "Cannot read " << path;
+    return false;
+  }
+  *hex = hasher.Hex();
+  return true;
+}
+
 } // namespace lockbox
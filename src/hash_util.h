@@ -1,11 +1,43 @@
 #pragma once
 
+#include <openssl/evp.h>
+
 #include <string>
 
+#include "base/basictypes.h"
+
 using std::string;
 
 namespace lockbox {
 
 string SHA1Hex(const string& input);
 
+// Computes the SHA1Hex() of data given a piece at a time.
+//
+//  SHA1Hasher hasher;
+//  hasher.Update(first);
+//  hasher.Update(second);
+//  const string hex = hasher.Hex();
+class SHA1Hasher {
+ public:
+  SHA1Hasher();
+  ~SHA1Hasher();
+
+  void Update(const char* data, size_t length);
+  void Update(const string& data) { Update(data.data(), data.size()); }
+
+  // Returns the SHA1Hex() of everything passed to Update() so far. Updates may
+  // continue afterwards.
+  string Hex() const;
+
+ private:
+  EVP_MD_CTX* context_;
+
+  DISALLOW_COPY_AND_ASSIGN(SHA1Hasher);
+};
+
+// Sets |hex| to the SHA1Hex() of the contents of the file at |path|. The file
+// is read a buffer at a time, so memory use does not grow with the file.
+bool SHA1HexFile(const string& path, string* hex);
+
 } // namespace lockbox
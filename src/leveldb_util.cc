@@ -2,13 +2,93 @@
 
 #include "base/logging.h"
 #include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
 
 namespace lockbox {
 
+namespace {
+
+class PrefixIterator : public leveldb::Iterator {
+ public:
+  PrefixIterator(leveldb::Iterator* base, const std::string& prefix)
+      : base_(base), prefix_(prefix) {
+  }
+
+  virtual ~PrefixIterator() {
+  }
+
+  virtual bool Valid() const {
+    return base_->Valid() && base_->key().starts_with(prefix_);
+  }
+
+  virtual void SeekToFirst() {
+    base_->Seek(prefix_);
+  }
+
+  virtual void SeekToLast() {
+    // Position just past the prefix and step back onto its last key.
+    std::string limit(prefix_);
+    while (!limit.empty() &&
+           static_cast<unsigned char>(limit[limit.size() - 1]) == 0xff) {
+      limit.resize(limit.size() - 1);
+    }
+    if (limit.empty()) {
+      base_->SeekToLast();
+      return;
+    }
+    ++limit[limit.size() - 1];
+    base_->Seek(limit);
+    if (base_->Valid()) {
+      base_->Prev();
+    } else {
+      base_->SeekToLast();
+    }
+  }
+
+  virtual void Seek(const leveldb::Slice& target) {
+    base_->Seek(prefix_ + target.ToString());
+  }
+
+  virtual void Next() {
+    base_->Next();
+  }
+
+  virtual void Prev() {
+    base_->Prev();
+  }
+
+  virtual leveldb::Slice key() const {
+    leveldb::Slice key = base_->key();
+    key.remove_prefix(prefix_.size());
+    return key;
+  }
+
+  virtual leveldb::Slice value() const {
+    return base_->value();
+  }
+
+  virtual leveldb::Status status() const {
+    return base_->status();
+  }
+
+ private:
+  scoped_ptr<leveldb::Iterator> base_;
+  const std::string prefix_;
+
+  DISALLOW_COPY_AND_ASSIGN(PrefixIterator);
+};
+
+} // namespace
+
 leveldb::DB* OpenDB(const std::string& db_location) {
-  leveldb::DB* db;
   leveldb::Options options;
   options.create_if_missing = true;
+  return OpenDB(db_location, options);
+}
+
+leveldb::DB* OpenDB(const std::string& db_location,
+                    const leveldb::Options& options) {
+  leveldb::DB* db;
 
   CHECK(file_util::CreateDirectory(base::FilePath(db_location)));
 
@@ -17,4 +97,13 @@ leveldb::DB* OpenDB(const std::string& db_location) {
   return db;
 }
 
+leveldb::Iterator* NewPrefixIterator(leveldb::Iterator* base,
+                                     const std::string& prefix) {
+  CHECK(base);
+  if (prefix.empty()) {
+    return base;
+  }
+  return new PrefixIterator(base, prefix);
+}
+
 } // namespace lockbox
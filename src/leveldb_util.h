@@ -2,9 +2,19 @@
 
 #include <string>
 #include "leveldb/db.h"
+#include "leveldb/options.h"
 
 namespace lockbox {
 
 leveldb::DB* OpenDB(const std::string& db_location);
 
+// Opens (creating if missing) the database at |db_location| with |options|.
+leveldb::DB* OpenDB(const std::string& db_location,
+                    const leveldb::Options& options);
+
+// Wraps |base| so that it only sees keys starting with |prefix| and reports them
+// with |prefix| stripped. Takes ownership of |base|.
+leveldb::Iterator* NewPrefixIterator(leveldb::Iterator* base,
+                                     const std::string& prefix);
+
 } // namespace lockbox
@@ -33,6 +33,25 @@ struct RemotePackage {
   # Contains the SHA1 hash of the delta's previous whole file hash; i.e., the
   # hash of the file that this delta should be applied to.
   6: required HybridCrypto delta_prev_hash,
+
+  # Size of payload.data in bytes. Package headers exchanged through the
+  # chunked transfer API carry an empty payload.data and set this instead.
+  7: i64 payload_size,
+
+  # Seconds since the epoch when the server stored the package; 0 if stored by
+  # a server that did not record it.
+  8: i64 uploaded_at,
+}
+
+# One piece of a package payload sent through AppendChunk. Chunks of an upload
+# must arrive in order; |offset| is where |data| starts within the payload. A
+# chunk the top dir already holds (see MissingChunks) is sent with an empty
+# |data| and its SHA1 in |chunk_sha1|.
+struct PackageChunk {
+  1: required string upload_id,
+  2: required i64 offset,
+  3: required binary data,
+  4: string chunk_sha1,
 }
 
 struct DownloadRequest {
@@ -41,6 +60,14 @@ struct DownloadRequest {
   3: required string pkg_name,
 }
 
+# Lets the holder stream a payload from the download side channel on |port| of
+# the server's host. An empty ticket means there is no side channel.
+struct DownloadTicket {
+  1: string ticket,
+  2: i32 port,
+  3: i64 payload_size,
+}
+
 struct RegisterRelativePathRequest {
   1: required UserAuth user,
   2: required string top_dir,
@@ -56,6 +83,10 @@ struct PathLockRequest {
 struct PathLockResponse {
   1: required bool acquired,
   2: required list<string> users,
+
+  # Set when the relpath's delta chain has grown long enough that the holder
+  # should upload its next version as a SNAPSHOT.
+  3: bool want_snapshot,
 }
 
 # When a user requests an update list for files to fetch, this is the list that
@@ -72,6 +103,22 @@ struct UpdateMap {
   1: map<string, string> updates,
 }
 
+# One page of a device's pending updates. Pass |cursor| back to get the next
+# page; |more| is set if there is one.
+struct UpdatePage {
+  1: map<string, string> updates,
+  2: string cursor,
+  3: bool more,
+}
+
+# One package in a relpath's history. |type| and |payload_size| are only set
+# when requested.
+struct PackageInfo {
+  1: string hash,
+  2: PackageType type,
+  3: i64 payload_size,
+}
+
 struct UpdateList {
   1: list<string> updates,
 }
@@ -113,6 +160,8 @@ enum ServerDB {
   USER_TOP_DIR, # Maps user to directories managed.
   UPDATE_ACTION_QUEUE, # Holds (TS, TDN, RPI, hash) value for updates.
   UPDATE_ACTION_LOG, # Holds (TS, TDN, RPI, hash) for creation -> completion.
+  CHUNK_DATA, # CHUNK_SHA1 -> chunk bytes, shared by all top dirs.
+  CHUNK_REFS, # CHUNK_SHA1 -> "REFERENCES,SIZE"
 
   TOP_DIR_PLACEHOLDER,
 
@@ -123,6 +172,9 @@ enum ServerDB {
   TOP_DIR_DATA, # HASH -> bytes...
   TOP_DIR_DATA_TYPE, # snapshot or delta?
   TOP_DIR_FPTRS, # HASH_i -> HASH_(i-1)
+  TOP_DIR_MANIFEST, # HASH_OFFSET -> "CHUNK_SHA1,SIZE" of the chunk at OFFSET.
+  TOP_DIR_CHAIN_DEPTH, # HASH -> DELTAs since the last SNAPSHOT, HASH included.
+  TOP_DIR_CHUNKS, # CHUNK_SHA1 -> manifest rows of the top dir holding it.
 }
 
 enum ClientDB {
@@ -157,6 +209,10 @@ enum ClientDB {
   FILE_CHANGES,
   DATA,
   FPTRS,
+
+  # Relative path to the INODE,SIZE,MTIME_NS of the file as last synced. See
+  # file_index.h.
+  FILE_INDEX,
 }
 
 # Unifying Service
@@ -193,17 +249,79 @@ service LockboxService {
 
   RemotePackage DownloadPackage(1:DownloadRequest req),
 
+  # Chunked package transfer. BeginUpload takes the package with an empty
+  # payload.data and returns an upload ID. The payload follows in order through
+  # AppendChunk (returns the bytes received so far) and the package becomes
+  # visible on CommitUpload (returns the payload size). CommitUpload returns -1
+  # and drops the upload if the payload does not match payload.data_sha1.
+  string BeginUpload(1:UserAuth user, 2:RemotePackage pkg),
+  i64 AppendChunk(1:UserAuth user, 2:PackageChunk chunk),
+  i64 CommitUpload(1:UserAuth user, 2:string upload_id),
+
+  # Returns the subset of |chunk_sha1s| that |top_dir| does not hold yet. Only
+  # chunks it holds may be appended by hash alone.
+  list<string> MissingChunks(1:UserAuth user, 2:list<string> chunk_sha1s,
+                             3:string top_dir),
+
+  # Returns the package with an empty payload.data and payload_size set.
+  RemotePackage DownloadPackageHeader(1:DownloadRequest req),
+
+  # Returns up to |length| bytes of the payload starting at |offset|.
+  binary DownloadRange(1:DownloadRequest req, 2:i64 offset, 3:i32 length),
+
+  # Returns a ticket for streaming the payload from the download side channel
+  # instead of through DownloadRange.
+  DownloadTicket GetDownloadTicket(1:DownloadRequest req),
+
   UpdateMap PollForUpdates(1:UserAuth auth, 2:DeviceID device),
 
+  # Port of the side channel that announces a device's updates, or 0 if the
+  # server has none. Waiting there holds no server thread, unlike the waits of
+  # WaitForUpdates and PollForUpdatesPage.
+  i32 GetNotifyPort(1:UserAuth auth),
+
+  # Like PollForUpdates, but when there are no updates waits up to |timeout_ms|
+  # for some to arrive before returning.
+  UpdateMap WaitForUpdates(1:UserAuth auth, 2:DeviceID device,
+                           3:i32 timeout_ms),
+
+  # Returns up to |max_updates| updates following |cursor| (from the start if
+  # empty). On the first page, waits up to |timeout_ms| for updates if there
+  # are none.
+  UpdatePage PollForUpdatesPage(1:UserAuth auth, 2:DeviceID device,
+                                3:string cursor, 4:i32 max_updates,
+                                5:i32 timeout_ms),
+
   list<string> GetFptrs(1:UserAuth auth, 2:string top_dir, 3:string hash);
 
+  # Returns package |hash| and up to |depth| - 1 of its predecessors, newest
+  # first, following TOP_DIR_FPTRS. With |with_info| each entry carries its
+  # package's type and size, and the walk stops at the first SNAPSHOT since
+  # nothing older is needed to rebuild |hash|.
+  list<PackageInfo> GetHistory(1:UserAuth auth, 2:string top_dir,
+                               3:string hash, 4:i32 depth, 5:bool with_info);
+
   # Update the UPDATE_ACTION_LOG and then set delete the values from the
   # DEVICE_SYNC.
   void PersistedUpdates(1:UserAuth auth, 2:DeviceID device,
                         3:UpdateList updates),
 
+  # Acknowledges the |count| updates from |first_key| through |last_key|, e.g.
+  # a whole page, in one write. Returns false, acknowledging nothing, if the
+  # range holds other updates too; acknowledge by list instead.
+  bool PersistedUpdateRange(1:UserAuth auth, 2:DeviceID device,
+                            3:string first_key, 4:string last_key,
+                            5:i32 count),
+
   # Hash chain service API.
   void Send(1:UserAuth sender, 2:string receiver_email, 3:VersionInfo vinfo),
 
   VersionInfo GetLatestVersion(1:UserAuth requestor, 2:string receiver_email),
+
+  # Operations.
+
+  # Call counts, latency quantiles and message sizes of the RPCs whose names
+  # start with |method_prefix|, as text. An empty prefix reports every RPC, and
+  # how many top dir databases are open and have been opened and closed.
+  string GetServerStats(1:UserAuth auth, 2:string method_prefix),
 }
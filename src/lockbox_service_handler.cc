@@ -2,26 +2,62 @@
 
 #include "base/base64.h"
 #include "base/sha1.h"
+#include "base/string_util.h"
 #include "base/strings/string_number_conversions.h"
 #include "scoped_mutex.h"
 #include "guid_creator.h"
-#include "thrift_util.h"
+#include "package_util.h"
+#include "rpc_stats.h"
+#include "trace.h"
 
-#include <thrift/protocol/TBinaryProtocol.h>
-#include <thrift/transport/TBufferTransports.h>
+#include <algorithm>
 
 using std::to_string;
 
 namespace lockbox {
 
-LockboxServiceHandler::LockboxServiceHandler(DBManagerServer* manager, Sync* sync)
-    : manager_(manager), sync_(sync) {
+namespace {
+
+// Longest a WaitForUpdates request is parked, whatever the client asks for.
+const int32_t kMaxUpdateWaitMs = 60 * 1000;
+
+// Most updates returned by one poll.
+const int32_t kMaxUpdatePage = 1000;
+
+// Acknowledging at least this many updates at once compacts their range.
+const int32_t kCompactAfterUpdates = 256;
+
+// Most packages returned by one GetHistory.
+const int32_t kMaxHistoryDepth = 10000;
+
+// Longest run of DELTAs a relpath may build up before the next upload is asked
+// to be a SNAPSHOT, bounding a restore to one snapshot and this many deltas.
+const int32_t kMaxDeltaChain = 16;
+
+} // namespace
+
+LockboxServiceHandler::LockboxServiceHandler(DBManagerServer* manager,
+                                             PackageStore* store,
+                                             UpdateQueue* update_queue,
+                                             TopDirDeviceCache* devices,
+                                             DeviceNotifier* notifier,
+                                             DownloadServer* downloads,
+                                             NotifyServer* notifications,
+                                             RangeCompactor* compactor)
+    : manager_(manager),
+      store_(store),
+      update_queue_(update_queue),
+      devices_(devices),
+      notifier_(notifier),
+      downloads_(downloads),
+      notifications_(notifications),
+      compactor_(compactor) {
   CHECK(manager);
+  CHECK(store);
+  CHECK(compactor);
 }
 
 void LockboxServiceHandler::RegisterUser(UserID& _return, const UserAuth& user) {
-  // Your implementation goes here
-  printf("RegisterUser\n");
 
   DBManagerServer::Options options;
   options.type = ServerDB::EMAIL_USER;
@@ -40,8 +76,6 @@ void LockboxServiceHandler::RegisterUser(UserID& _return, const UserAuth& user)
 
 void LockboxServiceHandler::RegisterDevice(DeviceID& _return,
                                            const UserAuth& user) {
-  // Your implementation goes here
-  printf("RegisterDevice\n");
   DBManagerServer::Options options;
   options.type = ServerDB::EMAIL_USER;
   string user_id;
@@ -58,18 +92,23 @@ void LockboxServiceHandler::RegisterDevice(DeviceID& _return,
   // address for an email account to throttle the accounts.
   options.type = ServerDB::USER_DEVICE;
   manager_->Append(options, user_id, _return);
+
+  // The user's top dirs now fan out to one more device.
+  devices_->InvalidateAll();
 }
 
 bool LockboxServiceHandler::ShareTopDir(const UserAuth& user,
                                         const string& email,
                                         const TopDirID& top_dir_id) {
-  LOG(INFO) << "ShareTopDir";
+  TRACE(1) << "Sharing " << top_dir_id << " with " << email;
   // Authenticate.
 
 
   // Add the user from |email| (who |user| wants to share |top_dir_id| with) to
   // the list for |top_dir_id|.
-  return manager_->AddEmailToTopDir(email, top_dir_id);
+  const bool ret = manager_->AddEmailToTopDir(email, top_dir_id);
+  devices_->Invalidate(top_dir_id);
+  return ret;
 }
 
 void LockboxServiceHandler::GetTopDirs(vector<TopDirID>& _return,
@@ -84,8 +123,6 @@ void LockboxServiceHandler::GetTopDirs(vector<TopDirID>& _return,
 
 void LockboxServiceHandler::RegisterTopDir(TopDirID& top_dir_id,
                                            const UserAuth& user) {
-  // Your implementation goes here
-  printf("RegisterTopDir\n");
 
   top_dir_id = manager_->GetNextTopDirID();
 
@@ -102,6 +139,7 @@ void LockboxServiceHandler::RegisterTopDir(TopDirID& top_dir_id,
   // Update the editors for the top_dir.
   CHECK(manager_->Put(DBManager::Options(ServerDB::TOP_DIR_META, top_dir_id),
                       "EDITORS_" + user_id, user.email));
+  devices_->Invalidate(top_dir_id);
 }
 
 void LockboxServiceHandler::RegisterRelativePath(
@@ -134,8 +172,7 @@ void LockboxServiceHandler::RegisterRelativePath(
 
 bool LockboxServiceHandler::AssociateKey(const UserAuth& user,
                                          const PublicKey& pub) {
-  LOG(INFO) << "Associating " << user.email << " with "
-            << string(pub.key.begin(), pub.key.end());
+  TRACE(1) << "Associating a key with " << user.email;
   string key;
   manager_->Get(DBManager::Options(ServerDB::EMAIL_KEY, ""),
                 user.email, &key);
@@ -150,16 +187,13 @@ bool LockboxServiceHandler::AssociateKey(const UserAuth& user,
 
 void LockboxServiceHandler::GetKeyFromEmail(PublicKey& _return,
                                             const string& email) {
-  LOG(INFO) << "Looking up key for " << email;
+  TRACE(1) << "Looking up key for " << email;
   manager_->Get(DBManager::Options(ServerDB::EMAIL_KEY, ""), email,
                 &(_return.key));
 }
 
 void LockboxServiceHandler::AcquireLockRelPath(PathLockResponse& _return,
                                                const PathLockRequest& lock) {
-  // Your implementation goes here
-  printf("LockRelPath\n");
-
   // TODO(tierney): Authenticate.
 
   // TODO(tierney): See if the lock is already held.
@@ -173,6 +207,13 @@ void LockboxServiceHandler::AcquireLockRelPath(PathLockResponse& _return,
   // Set the lock.
   _return.acquired = true;
 
+  // Ask for a snapshot once the head is at the end of a long delta chain.
+  string head;
+  manager_->Get(DBManager::Options(ServerDB::TOP_DIR_RELPATH, lock.top_dir),
+                lock.rel_path, &head);
+  _return.want_snapshot = !head.empty() && head != "none" &&
+      DeltaDepth(lock.user, lock.top_dir, head) >= kMaxDeltaChain;
+
   // Get the names of the individuals with whom to share the directory.
   manager_->GetList(DBManager::Options(ServerDB::TOP_DIR_META, lock.top_dir),
                     "EDITORS", &(_return.users));
@@ -182,30 +223,74 @@ void LockboxServiceHandler::AcquireLockRelPath(PathLockResponse& _return,
 }
 
 void LockboxServiceHandler::ReleaseLockRelPath(const PathLockRequest& lock) {
-  printf("ReleaseLockRelPath");
 }
 
 int64_t LockboxServiceHandler::UploadPackage(const UserAuth& user,
                                              const RemotePackage& pkg) {
-  // Your implementation goes here
-  printf("UploadPackage\n");
-  int64_t ret = pkg.payload.data.size();
+  TRACE(1) << "Received data (" << pkg.payload.data.size() << ") :"
+           << pkg.rel_path_id;
+
+  // Store the payload in chunks and the rest of the package as its header.
+  const int64_t ret = store_->Put(pkg);
+
+  RemotePackage header;
+  CopyPackageHeader(pkg, &header);
+  RecordPackage(user, header);
+  return ret;
+}
+
+void LockboxServiceHandler::BeginUpload(string& _return,
+                                        const UserAuth& user,
+                                        const RemotePackage& pkg) {
+  // Authenticate.
+
+  _return = store_->BeginUpload(pkg);
+}
+
+int64_t LockboxServiceHandler::AppendChunk(const UserAuth& user,
+                                           const PackageChunk& chunk) {
+  // Authenticate.
+
+  int64_t received = 0;
+  if (!store_->AppendChunk(chunk, &received)) {
+    return -1;
+  }
+  return received;
+}
+
+void LockboxServiceHandler::MissingChunks(vector<string>& _return,
+                                          const UserAuth& user,
+                                          const vector<string>& chunk_sha1s,
+                                          const string& top_dir) {
+  // Authenticate.
 
-  LOG(INFO) << "Received data (" << pkg.payload.data.size() << ") :"
-            << pkg.rel_path_id;
+  store_->MissingChunks(top_dir, chunk_sha1s, &_return);
+}
+
+int64_t LockboxServiceHandler::CommitUpload(const UserAuth& user,
+                                            const string& upload_id) {
+  // Authenticate.
 
-  string mem;
-  ThriftToString(pkg, &mem);
-  LOG(INFO) << "Did it work?: " << mem.size();
+  RemotePackage header;
+  if (!store_->CommitUpload(upload_id, &header)) {
+    return -1;
+  }
+  TRACE(1) << "Committed upload (" << header.payload_size << ") :"
+           << header.rel_path_id;
+  RecordPackage(user, header);
+  return header.payload_size;
+}
 
+void LockboxServiceHandler::RecordPackage(const UserAuth& user,
+                                          const RemotePackage& header) {
   // Hash the input content.
   // TODO(tierney): This should actually be just the encrypted contents.
-  const string& hash_of_prot = pkg.payload.data_sha1;
+  const string& hash_of_prot = header.payload.data_sha1;
 
   // Associate the rel path GUID with the package. If the rel_path's latest is
   // empty then this is the first.
   DBManagerServer::Options options;
-  options.name = pkg.top_dir;
+  options.name = header.top_dir;
 
   // TODO(tierney): Check that for the directory we have the correct GUID.
 
@@ -215,54 +300,101 @@ int64_t LockboxServiceHandler::UploadPackage(const UserAuth& user,
   // Check if this is the first doc for the relpath.
   string previous;
   options.type = ServerDB::TOP_DIR_RELPATH;
-  manager_->Get(options, pkg.rel_path_id, &previous);
+  manager_->Get(options, header.rel_path_id, &previous);
   if (previous.empty()) {
-    LOG(INFO) << "First upload for a file." << pkg.rel_path_id;
+    TRACE(1) << "First upload for a file." << header.rel_path_id;
   }
 
-  // Point the relpath's HEAD to this one.
-  manager_->Put(options, pkg.rel_path_id, hash_of_prot);
+  // Point the relpath's HEAD to this one, set the previous pointer to whatever
+  // previous is and queue the update, all in one write.
+  DBManager::Batch batch(manager_);
+  batch.Put(options, header.rel_path_id, hash_of_prot);
 
-  // Set the previous pointer to whatever previous is.
   options.type = ServerDB::TOP_DIR_FPTRS;
-  manager_->Put(options, hash_of_prot, previous);
-
-  // Write the file to disk.
-  options.type = ServerDB::TOP_DIR_DATA;
-  manager_->Put(options, hash_of_prot, mem);
+  batch.Put(options, hash_of_prot, previous);
 
-  // TODO(tierney): Update the appropriate queues.
-  options.type = ServerDB::UPDATE_ACTION_QUEUE;
-  options.name = "";
+  int32_t depth = 0;
+  if (header.type == PackageType::DELTA) {
+    depth = 1;
+    if (!previous.empty() && previous != "none") {
+      depth += DeltaDepth(user, header.top_dir, previous);
+    }
+  }
+  options.type = ServerDB::TOP_DIR_CHAIN_DEPTH;
+  batch.Put(options, hash_of_prot, base::IntToString(depth));
+
+  // Hand the update to the fan-out workers.
+  CHECK(update_queue_->Enqueue(header.top_dir,
+                               to_string(time(NULL)) + "_" + header.top_dir +
+                               "_" + header.rel_path_id + "_" + user.device +
+                               "_" + hash_of_prot,
+                               &batch));
+}
 
-  std::unique_lock<std::mutex> lock(sync_->db_mutex);
-  manager_->Put(options,
-                to_string(time(NULL)) + "_" + pkg.top_dir + "_" +
-                pkg.rel_path_id + "_" + user.device + "_" +
-                hash_of_prot,
-                "");
-  lock.unlock();
-  LOG(INFO) << "Notifying the CV to wake someone up";
-  sync_->cv.notify_one();
+int32_t LockboxServiceHandler::DeltaDepth(const UserAuth& user,
+                                          const string& top_dir,
+                                          const string& hash) {
+  string stored;
+  manager_->Get(DBManager::Options(ServerDB::TOP_DIR_CHAIN_DEPTH, top_dir),
+                hash, &stored);
+  int32_t depth = 0;
+  if (base::StringToInt(stored, &depth)) {
+    return depth;
+  }
 
-  return mem.size();
+  // Packages uploaded before depths were recorded: count back to the snapshot,
+  // which only matters up to the limit.
+  vector<PackageInfo> history;
+  GetHistory(history, user, top_dir, hash, kMaxDeltaChain + 1,
+             true /* with_info */);
+  for (const PackageInfo& info : history) {
+    if (info.type == PackageType::DELTA) {
+      ++depth;
+    }
+  }
+  return depth;
 }
 
 void LockboxServiceHandler::DownloadPackage(RemotePackage& _return,
                                             const DownloadRequest& req) {
-  // Your implementation goes here
-  printf("DownloadPackage\n");
-
   // Authenticate.
 
   // Get the package.
-  string package_str;
-  manager_->Get(DBManager::Options(ServerDB::TOP_DIR_DATA, req.top_dir),
-            req.pkg_name, &package_str);
+  store_->Get(req.top_dir, req.pkg_name, &_return);
+}
+
+void LockboxServiceHandler::DownloadPackageHeader(RemotePackage& _return,
+                                                  const DownloadRequest& req) {
+  // Authenticate.
+
+  store_->GetHeader(req.top_dir, req.pkg_name, &_return);
+}
+
+void LockboxServiceHandler::DownloadRange(string& _return,
+                                          const DownloadRequest& req,
+                                          const int64_t offset,
+                                          const int32_t length) {
+  // Authenticate.
+
+  store_->ReadRange(req.top_dir, req.pkg_name, offset,
+                    std::min<int64_t>(length, kMaxChunkSize), &_return);
+}
+
+void LockboxServiceHandler::GetDownloadTicket(DownloadTicket& _return,
+                                              const DownloadRequest& req) {
+  // Authenticate.
 
-  RemotePackage package;
-  ThriftFromString(package_str, &package);
-  _return = package;
+  RemotePackage header;
+  if (!downloads_ || !store_->GetHeader(req.top_dir, req.pkg_name, &header)) {
+    return;
+  }
+  _return.ticket = downloads_->IssueTicket(req.top_dir, req.pkg_name);
+  _return.port = downloads_->port();
+  _return.payload_size = header.payload_size;
+}
+
+int32_t LockboxServiceHandler::GetNotifyPort(const UserAuth& auth) {
+  return notifications_ ? notifications_->port() : 0;
 }
 
 void LockboxServiceHandler::PollForUpdates(UpdateMap& _return,
@@ -271,12 +403,49 @@ void LockboxServiceHandler::PollForUpdates(UpdateMap& _return,
   // TODO: authenticate.
 
   // Get the updates for the device and send back to the user. DEVICE_SYNC.
-  DBManagerServer::Options options;
-  options.type = ServerDB::DEVICE_SYNC;
+  UpdatePage page;
+  PollForUpdatesPage(page, auth, device, "", kMaxUpdatePage, 0);
+  _return.updates.swap(page.updates);
+}
+
+void LockboxServiceHandler::WaitForUpdates(UpdateMap& _return,
+                                           const UserAuth& auth,
+                                           const DeviceID& device,
+                                           const int32_t timeout_ms) {
+  UpdatePage page;
+  PollForUpdatesPage(page, auth, device, "", kMaxUpdatePage, timeout_ms);
+  _return.updates.swap(page.updates);
+}
+
+void LockboxServiceHandler::PollForUpdatesPage(UpdatePage& _return,
+                                               const UserAuth& auth,
+                                               const DeviceID& device,
+                                               const string& cursor,
+                                               const int32_t max_updates,
+                                               const int32_t timeout_ms) {
+  // TODO: authenticate.
 
-  // TODO(tierney): This should be first or a list...
-  LOG(INFO) << "Requesting updates for " << device;
-  manager_->GetMap(options, device, &(_return.updates));
+  // A cursor from some other device's queue is ignored rather than followed.
+  const string key_prefix = device + "_";
+  const string start_after =
+      StartsWithASCII(cursor, key_prefix, true /* case sensitive */) ?
+      cursor : "";
+  const size_t max = std::max(1, std::min(max_updates, kMaxUpdatePage));
+
+  // Take the token first so that an update fanned out between the check and
+  // the wait still wakes us.
+  DBManagerServer::Options options(ServerDB::DEVICE_SYNC, "");
+  const uint64_t token = notifier_->Token(device);
+  manager_->GetMapPage(options, key_prefix, start_after, max,
+                       &(_return.updates), &(_return.more));
+  if (_return.updates.empty() && start_after.empty() && timeout_ms > 0 &&
+      notifier_->Wait(device, token, std::min(timeout_ms, kMaxUpdateWaitMs))) {
+    manager_->GetMapPage(options, key_prefix, start_after, max,
+                         &(_return.updates), &(_return.more));
+  }
+
+  _return.cursor = _return.updates.empty() ?
+      start_after : _return.updates.rbegin()->first;
 }
 
 void LockboxServiceHandler::GetFptrs(vector<string>& _return,
@@ -291,31 +460,112 @@ void LockboxServiceHandler::GetFptrs(vector<string>& _return,
   _return.push_back(prev);
 }
 
+void LockboxServiceHandler::GetHistory(vector<PackageInfo>& _return,
+                                       const UserAuth& auth,
+                                       const string& top_dir,
+                                       const string& hash,
+                                       const int32_t depth,
+                                       const bool with_info) {
+  // Authenticate.
+
+  _return.clear();
+  const DBManager::Options options(ServerDB::TOP_DIR_FPTRS, top_dir);
+  string current = hash;
+  RemotePackage header;
+  for (int32_t i = 0; i < std::min(depth, kMaxHistoryDepth); ++i) {
+    PackageInfo info;
+    info.hash = current;
+    if (with_info) {
+      if (!store_->GetHeader(top_dir, current, &header)) {
+        LOG(WARNING) << "Missing package " << current << " in " << top_dir;
+        break;
+      }
+      info.type = header.type;
+      info.payload_size = header.payload_size;
+    }
+    _return.push_back(info);
+    if (with_info && info.type == PackageType::SNAPSHOT) {
+      break;
+    }
+
+    // The first package of a relpath points at its placeholder.
+    string previous;
+    manager_->Get(options, current, &previous);
+    if (previous.empty() || previous == "none" || previous == current) {
+      break;
+    }
+    current.swap(previous);
+  }
+}
+
 void LockboxServiceHandler::PersistedUpdates(const UserAuth& auth,
                                              const DeviceID& device,
                                              const UpdateList& updates) {
-  LOG(INFO) << "Persisted updates.";
   // TODO: Need to grab lock on this database row.
-  DBManagerServer::Options options;
-  options.type = ServerDB::DEVICE_SYNC;
+  const string key_prefix = device + "_";
+  DBManagerServer::Options options(ServerDB::DEVICE_SYNC, "");
+  DBManager::Batch batch(manager_);
   for (const string& update : updates.updates) {
-    LOG(INFO) << "  Deleting Update: " << update;
-    manager_->Delete(options, update);
+    if (!StartsWithASCII(update, key_prefix, true /* case sensitive */)) {
+      LOG(WARNING) << device << " acknowledged foreign update " << update;
+      continue;
+    }
+    batch.Delete(options, update);
+  }
+  manager_->Write(&batch, false /* sync */);
+}
+
+bool LockboxServiceHandler::PersistedUpdateRange(const UserAuth& auth,
+                                                 const DeviceID& device,
+                                                 const string& first_key,
+                                                 const string& last_key,
+                                                 const int32_t count) {
+  // TODO: authenticate.
+
+  const string key_prefix = device + "_";
+  if (count <= 0 ||
+      !StartsWithASCII(first_key, key_prefix, true /* case sensitive */) ||
+      !StartsWithASCII(last_key, key_prefix, true /* case sensitive */)) {
+    return false;
+  }
+
+  DBManagerServer::Options options(ServerDB::DEVICE_SYNC, "");
+  if (!manager_->DeleteRange(options, first_key, last_key, count)) {
+    return false;
   }
+
+  // Large acknowledgements leave a run of tombstones that every later poll
+  // would have to step over. The compaction runs later, merged with the
+  // device's other acknowledgements.
+  if (count >= kCompactAfterUpdates) {
+    compactor_->Add(options, device, first_key, last_key);
+  }
+  return true;
 }
 
 void LockboxServiceHandler::Send(const UserAuth& sender,
                                  const std::string& receiver_email,
                                  const VersionInfo& vinfo) {
   // Your implementation goes here
-  printf("Send\n");
+  TRACE(1) << "Send";
 }
 
 void LockboxServiceHandler::GetLatestVersion(VersionInfo& _return,
                                              const UserAuth& requestor,
                                              const std::string& receiver_email) {
   // Your implementation goes here
-  printf("GetLatestVersion\n");
+  TRACE(1) << "GetLatestVersion";
+}
+
+void LockboxServiceHandler::GetServerStats(string& _return,
+                                           const UserAuth& auth,
+                                           const string& method_prefix) {
+  // TODO: authenticate.
+  _return.clear();
+  RpcStats::Dump(method_prefix, &_return);
+  if (method_prefix.empty()) {
+    manager_->DumpStats(&_return);
+  }
 }
 
 } // namespace lockbox
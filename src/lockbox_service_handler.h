@@ -4,8 +4,15 @@
 
 #include "LockboxService.h"
 #include "counter.h"
+#include "base/memory/scoped_ptr.h"
 #include "db_manager_server.h"
-#include "update_queue_sync.h"
+#include "device_notifier.h"
+#include "download_server.h"
+#include "notify_server.h"
+#include "package_store.h"
+#include "range_compactor.h"
+#include "top_dir_device_cache.h"
+#include "update_queue.h"
 
 using std::string;
 
@@ -13,8 +20,14 @@ namespace lockbox {
 
 class LockboxServiceHandler : virtual public LockboxServiceIf {
  public:
-  // Does not take ownershi of |manager|.
-  LockboxServiceHandler(DBManagerServer* manager, Sync* sync);
+  // Does not take ownershi of |manager|, |store|, |update_queue|, |devices|,
+  // |notifier|, |downloads|, |notifications| or |compactor|. |downloads| and
+  // |notifications| may be NULL if there is no such side channel.
+  LockboxServiceHandler(DBManagerServer* manager, PackageStore* store,
+                        UpdateQueue* update_queue, TopDirDeviceCache* devices,
+                        DeviceNotifier* notifier, DownloadServer* downloads,
+                        NotifyServer* notifications,
+                        RangeCompactor* compactor);
 
   void RegisterUser(UserID& _return, const UserAuth& user);
 
@@ -43,16 +56,51 @@ class LockboxServiceHandler : virtual public LockboxServiceIf {
 
   void DownloadPackage(RemotePackage& _return, const DownloadRequest& req);
 
+  void BeginUpload(string& _return, const UserAuth& user,
+                   const RemotePackage& pkg);
+
+  int64_t AppendChunk(const UserAuth& user, const PackageChunk& chunk);
+
+  void MissingChunks(vector<string>& _return, const UserAuth& user,
+                     const vector<string>& chunk_sha1s, const string& top_dir);
+
+  int64_t CommitUpload(const UserAuth& user, const string& upload_id);
+
+  void DownloadPackageHeader(RemotePackage& _return,
+                             const DownloadRequest& req);
+
+  void DownloadRange(string& _return, const DownloadRequest& req,
+                     const int64_t offset, const int32_t length);
+
+  void GetDownloadTicket(DownloadTicket& _return, const DownloadRequest& req);
+
+  int32_t GetNotifyPort(const UserAuth& auth);
+
   void PollForUpdates(UpdateMap& _return,
                       const UserAuth& auth,
                       const DeviceID& device);
 
+  void WaitForUpdates(UpdateMap& _return, const UserAuth& auth,
+                      const DeviceID& device, const int32_t timeout_ms);
+
+  void PollForUpdatesPage(UpdatePage& _return, const UserAuth& auth,
+                          const DeviceID& device, const string& cursor,
+                          const int32_t max_updates, const int32_t timeout_ms);
+
   void GetFptrs(vector<string>& _return, const UserAuth& auth,
                 const string& top_dir, const string& hash);
 
+  void GetHistory(vector<PackageInfo>& _return, const UserAuth& auth,
+                  const string& top_dir, const string& hash,
+                  const int32_t depth, const bool with_info);
+
   void PersistedUpdates(const UserAuth& auth, const DeviceID& device,
                         const UpdateList& updates);
 
+  bool PersistedUpdateRange(const UserAuth& auth, const DeviceID& device,
+                            const string& first_key, const string& last_key,
+                            const int32_t count);
+
   void Send(const UserAuth& sender,
             const std::string& receiver_email,
             const VersionInfo& vinfo);
@@ -60,9 +108,27 @@ class LockboxServiceHandler : virtual public LockboxServiceIf {
   void GetLatestVersion(VersionInfo& _return,
                         const UserAuth& requestor,
                         const std::string& receiver_email);
+
+  void GetServerStats(string& _return, const UserAuth& auth,
+                      const string& method_prefix);
+
  private:
+  // Points the relpath's head at the stored package |header| and queues the
+  // update for the other devices.
+  void RecordPackage(const UserAuth& user, const RemotePackage& header);
+
+  // Number of DELTAs from |hash| back to the relpath's last SNAPSHOT.
+  int32_t DeltaDepth(const UserAuth& user, const string& top_dir,
+                     const string& hash);
+
   DBManagerServer* manager_;
-  Sync* sync_;
+  PackageStore* store_;
+  UpdateQueue* update_queue_;
+  TopDirDeviceCache* devices_;
+  DeviceNotifier* notifier_;
+  DownloadServer* downloads_;
+  NotifyServer* notifications_;
+  RangeCompactor* compactor_;
 };
 
 } // namespace lockbox
@@ -0,0 +1,256 @@
+#include "notify_server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <vector>
+
+#include "base/logging.h"
+#include "base/posix/eintr_wrapper.h"
+#include "scoped_mutex.h"
+
+using std::vector;
+
+namespace lockbox {
+
+namespace {
+
+// Longest request line accepted.
+const size_t kMaxRequestBytes = 256;
+
+bool SetNonBlocking(int fd) {
+  const int flags = fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Sends a newline without blocking. A full send buffer already holds one, so
+// only other errors fail.
+bool SendNewline(int socket) {
+  const ssize_t count =
+      HANDLE_EINTR(send(socket, "\n", 1, MSG_DONTWAIT | MSG_NOSIGNAL));
+  return count == 1 || (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+} // namespace
+
+NotifyServer::NotifyServer(DeviceNotifier* notifier, int port,
+                           int max_connections)
+    : notifier_(notifier), port_(port), max_connections_(max_connections),
+      listen_fd_(-1), stopping_(false) {
+  CHECK(notifier);
+  CHECK_GT(max_connections, 0);
+  wake_fds_[0] = wake_fds_[1] = -1;
+}
+
+NotifyServer::~NotifyServer() {
+  if (listen_fd_ < 0) {
+    return;
+  }
+  stopping_ = true;
+  HANDLE_EINTR(write(wake_fds_[1], "x", 1));
+  thread_->join();
+  while (!connections_.empty()) {
+    Close(connections_.begin()->first);
+  }
+  close(listen_fd_);
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
+}
+
+bool NotifyServer::Start() {
+  CHECK_LT(listen_fd_, 0);
+
+  // A client hanging up just as it is notified must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  if (pipe(wake_fds_) != 0 || !SetNonBlocking(wake_fds_[0]) ||
+      !SetNonBlocking(wake_fds_[1])) {
+    PLOG(ERROR) << "Cannot create notify wake pipe";
+    return false;
+  }
+
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    PLOG(ERROR) << "Cannot create notify socket";
+    return false;
+  }
+  const int on = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port_);
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listen_fd_, 128) != 0 || !SetNonBlocking(listen_fd_)) {
+    PLOG(ERROR) << "Cannot listen for notifications on " << port_;
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+
+  notifier_->AddListener(boost::bind(&NotifyServer::Notify, this, _1));
+  thread_.reset(new boost::thread(boost::bind(&NotifyServer::Serve, this)));
+  LOG(INFO) << "Serving notifications on " << port_;
+  return true;
+}
+
+void NotifyServer::Serve() {
+  vector<struct pollfd> fds;
+  while (!stopping_) {
+    fds.clear();
+    struct pollfd wake = { wake_fds_[0], POLLIN, 0 };
+    fds.push_back(wake);
+    if (static_cast<int>(connections_.size()) < max_connections_) {
+      struct pollfd listening = { listen_fd_, POLLIN, 0 };
+      fds.push_back(listening);
+    }
+    for (const auto& connection : connections_) {
+      struct pollfd client = { connection.first, POLLIN, 0 };
+      fds.push_back(client);
+    }
+
+    if (HANDLE_EINTR(poll(&fds[0], fds.size(), -1)) < 0) {
+      PLOG(ERROR) << "Notify poll failed";
+      continue;
+    }
+
+    for (const struct pollfd& fd : fds) {
+      if (fd.revents == 0) {
+        continue;
+      }
+      if (fd.fd == wake_fds_[0]) {
+        char drain[64];
+        while (read(wake_fds_[0], drain, sizeof(drain)) > 0) {
+        }
+        Announce();
+      } else if (fd.fd == listen_fd_) {
+        Accept();
+      } else {
+        auto iter = connections_.find(fd.fd);
+        if (iter != connections_.end() && !Read(fd.fd, &(iter->second))) {
+          Close(fd.fd);
+        }
+      }
+    }
+  }
+}
+
+void NotifyServer::Notify(const DeviceID& device) {
+  ScopedMutexLock lock(&notified_mutex_);
+  const bool idle = notified_.empty();
+  notified_.insert(device);
+  if (idle) {
+    HANDLE_EINTR(write(wake_fds_[1], "x", 1));
+  }
+}
+
+void NotifyServer::Accept() {
+  while (static_cast<int>(connections_.size()) < max_connections_) {
+    const int socket = HANDLE_EINTR(accept(listen_fd_, NULL, NULL));
+    if (socket < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        PLOG(WARNING) << "Notify accept failed";
+      }
+      return;
+    }
+    // Idle for as long as the client runs, so let TCP find dead peers.
+    const int on = 1;
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    if (!SetNonBlocking(socket)) {
+      close(socket);
+      continue;
+    }
+    connections_[socket];
+  }
+}
+
+bool NotifyServer::Read(int socket, Connection* connection) {
+  char buffer[256];
+  while (true) {
+    const ssize_t count = HANDLE_EINTR(recv(socket, buffer, sizeof(buffer), 0));
+    if (count == 0) {
+      return false;
+    }
+    if (count < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (!connection->device.empty()) {
+      // Nothing more is expected from a registered client.
+      continue;
+    }
+
+    connection->request.append(buffer, count);
+    const size_t end = connection->request.find('\n');
+    if (end == string::npos) {
+      if (connection->request.size() > kMaxRequestBytes) {
+        LOG(WARNING) << "Bad notify request";
+        return false;
+      }
+      continue;
+    }
+    connection->device = connection->request.substr(0, end);
+    connection->request.clear();
+    if (connection->device.empty()) {
+      return false;
+    }
+    sockets_[connection->device].insert(socket);
+    if (!SendNewline(socket)) {
+      return false;
+    }
+  }
+}
+
+void NotifyServer::Announce() {
+  set<DeviceID> notified;
+  {
+    ScopedMutexLock lock(&notified_mutex_);
+    notified.swap(notified_);
+  }
+
+  vector<int> failed;
+  for (const DeviceID& device : notified) {
+    auto iter = sockets_.find(device);
+    if (iter == sockets_.end()) {
+      continue;
+    }
+    for (int socket : iter->second) {
+      if (!SendNewline(socket)) {
+        failed.push_back(socket);
+      }
+    }
+  }
+  for (int socket : failed) {
+    Close(socket);
+  }
+}
+
+void NotifyServer::Close(int socket) {
+  auto iter = connections_.find(socket);
+  if (iter == connections_.end()) {
+    return;
+  }
+  const DeviceID& device = iter->second.device;
+  if (!device.empty()) {
+    set<int>& sockets = sockets_[device];
+    sockets.erase(socket);
+    if (sockets.empty()) {
+      sockets_.erase(device);
+    }
+  }
+  connections_.erase(iter);
+  close(socket);
+}
+
+} // namespace lockbox
@@ -0,0 +1,103 @@
+// Side channel that tells clients when their device has updates, so that they
+// need not park a WaitForUpdates request, and with it a server thread, to
+// hear of them.
+//
+// A client connects to this port and sends "DEVICE\n". The server answers with
+// a newline once the device is registered and with another each time the
+// device is notified after that, and otherwise leaves the connection idle. The
+// client polls for updates after each newline, and anything fanned out since
+// the first one is announced by a later one. One thread serves every
+// connection.
+//
+//  lockbox::NotifyServer notifications(&notifier, 9092, 10000);
+//  CHECK(notifications.Start());
+
+#pragma once
+
+#if defined(OS_MACOSX)
+#define BOOST_NO_CXX11_NUMERIC_LIMITS 1
+#endif
+
+#include <atomic>
+#include <boost/thread/thread.hpp>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/memory/scoped_ptr.h"
+#include "device_notifier.h"
+#include "lockbox_types.h"
+
+using std::map;
+using std::mutex;
+using std::set;
+using std::string;
+
+namespace lockbox {
+
+class NotifyServer {
+ public:
+  // Does not take ownership of |notifier|, which must outlive the server.
+  // Holds at most |max_connections| connections; past that, new ones wait to be
+  // accepted.
+  NotifyServer(DeviceNotifier* notifier, int port, int max_connections);
+
+  ~NotifyServer();
+
+  // Starts listening and serving.
+  bool Start();
+
+  int port() const { return port_; }
+
+ private:
+  struct Connection {
+    // What the client sent until its device is known.
+    string request;
+
+    // Empty until registered.
+    DeviceID device;
+  };
+
+  // Serves connections until the server is destroyed.
+  void Serve();
+
+  // Called by the notifier on any thread.
+  void Notify(const DeviceID& device);
+
+  void Accept();
+
+  // Reads what the client at |socket| sent. Returns false once it is to be
+  // closed.
+  bool Read(int socket, Connection* connection);
+
+  // Sends a newline to each connection of the devices notified since the last
+  // call.
+  void Announce();
+
+  void Close(int socket);
+
+  DeviceNotifier* notifier_;
+  const int port_;
+  const int max_connections_;
+
+  int listen_fd_;
+
+  // Written to wake Serve() out of poll().
+  int wake_fds_[2];
+
+  std::atomic<bool> stopping_;
+  scoped_ptr<boost::thread> thread_;
+
+  mutex notified_mutex_;
+  set<DeviceID> notified_;
+
+  // Only used by Serve().
+  map<int, Connection> connections_;
+  map<DeviceID, set<int> > sockets_;
+
+  DISALLOW_COPY_AND_ASSIGN(NotifyServer);
+};
+
+} // namespace lockbox
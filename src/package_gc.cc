@@ -0,0 +1,330 @@
+#include "package_gc.h"
+
+#include <boost/bind.hpp>
+
+#include "base/logging.h"
+#include "base/stl_util.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "leveldb/db.h"
+#include "thrift_util.h"
+
+using std::pair;
+
+namespace lockbox {
+
+namespace {
+
+const time_t kSecondsPerDay = 24 * 60 * 60;
+
+// Packages deleted per write.
+const int kPackagesPerBatch = 32;
+
+// Update log entries deleted per write.
+const int kLogEntriesPerBatch = 1024;
+
+// Packages that no head reaches yet may be between upload and being recorded.
+const time_t kUnreachableGraceSeconds = kSecondsPerDay;
+
+// Whether |hash| names a package rather than the start of a chain.
+bool IsPackage(const string& hash) {
+  return !hash.empty() && hash != "none";
+}
+
+} // namespace
+
+PackageGC::PackageGC(DBManagerServer* manager, PackageStore* store,
+                     const Policy& policy, int duty_percent)
+    : manager_(manager), store_(store), policy_(policy),
+      duty_percent_(duty_percent) {
+  CHECK(manager);
+  CHECK(store);
+  CHECK_GT(duty_percent, 0);
+  CHECK_LE(duty_percent, 100);
+}
+
+PackageGC::~PackageGC() {
+  if (thread_.get()) {
+    thread_->interrupt();
+    thread_->join();
+  }
+}
+
+void PackageGC::Start(int interval_seconds) {
+  CHECK(!thread_.get());
+  CHECK_GT(interval_seconds, 0);
+  thread_.reset(new boost::thread(
+      boost::bind(&PackageGC::Loop, this, interval_seconds)));
+}
+
+void PackageGC::RunOnce() {
+  DBManager::Batch batch(manager_);
+  batch_started_ = base::TimeTicks::Now();
+
+  Roots roots;
+  QueuedRoots(&roots);
+
+  set<string> top_dirs;
+  manager_->GetTopDirs(&top_dirs);
+  int64_t deleted = 0;
+  for (const string& top_dir : top_dirs) {
+    Pass pass(top_dir, &batch);
+    CollectTopDir(top_dir, roots[top_dir], &pass);
+    deleted += pass.deleted;
+  }
+  LOG(INFO) << "GC deleted " << deleted << " packages from "
+            << top_dirs.size() << " top dirs";
+
+  if (policy_.update_log_days > 0) {
+    Pass pass("", &batch);
+    TrimUpdateLog(&pass);
+    LOG(INFO) << "GC trimmed " << pass.deleted << " update log entries";
+  }
+
+  vector<uint32_t> segments;
+  store_->BlobSegments(&segments);
+  int64_t reclaimed = 0;
+  for (uint32_t segment : segments) {
+    reclaimed += store_->CompactBlobSegment(segment);
+    Throttle();
+  }
+  if (!segments.empty()) {
+    LOG(INFO) << "GC reclaimed " << reclaimed << " bytes from "
+              << segments.size() << " blob segments";
+  }
+}
+
+void PackageGC::Loop(int interval_seconds) {
+  try {
+    while (true) {
+      RunOnce();
+      boost::this_thread::sleep(boost::posix_time::seconds(interval_seconds));
+    }
+  } catch (boost::thread_interrupted&) {
+  }
+}
+
+void PackageGC::QueuedRoots(Roots* roots) {
+  // Both tables hold ts_topdir_relpath_device_hash tuples; older servers queued
+  // the tuple as the key. An update moves from the queue to the devices' in
+  // one write, so reading the queue first sees it in one or the other.
+  const int tables[] = { ServerDB::UPDATE_ACTION_QUEUE, ServerDB::DEVICE_SYNC };
+  for (int table : tables) {
+    scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(
+        DBManager::Options(table, "")));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      string tuple = it->value().ToString();
+      if (tuple.empty()) {
+        tuple = it->key().ToString();
+      }
+      vector<string> update;
+      base::SplitString(tuple, '_', &update);
+      if (update.size() == 5 && IsPackage(update[4])) {
+        (*roots)[update[1]].insert(update[4]);
+      }
+    }
+  }
+}
+
+void PackageGC::CollectTopDir(const string& top_dir, const set<string>& roots,
+                              Pass* pass) {
+  // Mark every relpath before deleting anything: a package's hash is its key
+  // within the top dir, so relpaths holding the same content share it.
+  scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(
+      DBManager::Options(ServerDB::TOP_DIR_RELPATH, top_dir)));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    const string head = it->value().ToString();
+    if (IsPackage(head)) {
+      MarkRelPath(top_dir, head, pass);
+    }
+  }
+
+  // Before cutting, so that cuts stop short of what queued updates need.
+  for (const string& root : roots) {
+    MarkRoot(top_dir, root, pass);
+  }
+
+  for (const pair<string, string>& cut : pass->cuts) {
+    Cut(top_dir, cut, pass);
+  }
+  MaybeFlush(pass, 0);
+  SweepUnreachable(top_dir, pass);
+  MaybeFlush(pass, 0);
+  store_->SweepAbandonedUploads(top_dir);
+}
+
+void PackageGC::MarkRelPath(const string& top_dir, const string& head,
+                            Pass* pass) {
+  const DBManager::Options fptrs(ServerDB::TOP_DIR_FPTRS, top_dir);
+  string current = head;
+  string last_kept;
+  bool needs_base = false;
+  for (int version = 0; IsPackage(current); ++version) {
+    if (ContainsKey(pass->seen, current)) {
+      return;
+    }
+    RemotePackage header;
+    if (!ReadHeader(top_dir, current, &header)) {
+      // Keep what is left of a broken chain.
+      return;
+    }
+    if (version > 0 && !needs_base &&
+        !Retained(version, header, pass->started)) {
+      pass->cuts.push_back(std::make_pair(last_kept, current));
+      return;
+    }
+
+    // A kept DELTA needs the version before it too.
+    pass->seen.insert(current);
+    needs_base = header.type == PackageType::DELTA;
+    last_kept = current;
+
+    string previous;
+    manager_->Get(fptrs, current, &previous);
+    current.swap(previous);
+  }
+}
+
+void PackageGC::MarkRoot(const string& top_dir, const string& root,
+                         Pass* pass) {
+  const DBManager::Options fptrs(ServerDB::TOP_DIR_FPTRS, top_dir);
+  string current = root;
+  while (IsPackage(current) && !ContainsKey(pass->seen, current)) {
+    RemotePackage header;
+    if (!ReadHeader(top_dir, current, &header)) {
+      return;
+    }
+    pass->seen.insert(current);
+    if (header.type != PackageType::DELTA) {
+      return;
+    }
+    string previous;
+    manager_->Get(fptrs, current, &previous);
+    current.swap(previous);
+  }
+}
+
+bool PackageGC::ReadHeader(const string& top_dir, const string& hash,
+                           RemotePackage* header) {
+  string package_str;
+  manager_->Get(DBManager::Options(ServerDB::TOP_DIR_DATA, top_dir), hash,
+                &package_str);
+  if (package_str.empty()) {
+    return false;
+  }
+  ThriftFromString(package_str, header);
+  return true;
+}
+
+bool PackageGC::Retained(int version, const RemotePackage& header,
+                         time_t now) const {
+  if (policy_.keep_versions == 0 && policy_.keep_days == 0) {
+    return true;
+  }
+  if (version < policy_.keep_versions) {
+    return true;
+  }
+  return policy_.keep_days > 0 &&
+      (header.uploaded_at == 0 ||
+       now - header.uploaded_at < policy_.keep_days * kSecondsPerDay);
+}
+
+void PackageGC::Cut(const string& top_dir, const pair<string, string>& cut,
+                    Pass* pass) {
+  const DBManager::Options fptrs(ServerDB::TOP_DIR_FPTRS, top_dir);
+  pass->batch->Put(fptrs, cut.first, "none");
+
+  // Stop at a version another relpath keeps; that relpath owns what precedes
+  // it.
+  string current = cut.second;
+  while (IsPackage(current) && !ContainsKey(pass->seen, current)) {
+    string previous;
+    manager_->Get(fptrs, current, &previous);
+    DeletePackage(top_dir, current, pass);
+    current.swap(previous);
+  }
+}
+
+void PackageGC::SweepUnreachable(const string& top_dir, Pass* pass) {
+  scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(
+      DBManager::Options(ServerDB::TOP_DIR_DATA, top_dir)));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    const string hash = it->key().ToString();
+    if (ContainsKey(pass->seen, hash)) {
+      continue;
+    }
+    RemotePackage header;
+    ThriftFromString(it->value().ToString(), &header);
+    if (header.uploaded_at != 0 &&
+        pass->started - header.uploaded_at < kUnreachableGraceSeconds) {
+      continue;
+    }
+    DeletePackage(top_dir, hash, pass);
+  }
+}
+
+void PackageGC::DeletePackage(const string& top_dir, const string& hash,
+                              Pass* pass) {
+  pass->seen.insert(hash);
+  pass->doomed.push_back(hash);
+  ++pass->pending;
+  MaybeFlush(pass, kPackagesPerBatch);
+}
+
+void PackageGC::TrimUpdateLog(Pass* pass) {
+  // Entries are keyed by the tuple, which starts with the upload time.
+  const int64_t cutoff =
+      pass->started - policy_.update_log_days * kSecondsPerDay;
+  const DBManager::Options log(ServerDB::UPDATE_ACTION_LOG, "");
+  scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(log));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    const string key = it->key().ToString();
+    int64_t uploaded = 0;
+    if (!base::StringToInt64(key.substr(0, key.find('_')), &uploaded) ||
+        uploaded >= cutoff) {
+      break;
+    }
+    pass->batch->Delete(log, key);
+    ++pass->pending;
+    ++pass->deleted;
+    MaybeFlush(pass, kLogEntriesPerBatch);
+  }
+  MaybeFlush(pass, 0);
+}
+
+void PackageGC::MaybeFlush(Pass* pass, int limit) {
+  if (pass->pending < limit) {
+    return;
+  }
+  if (!pass->doomed.empty()) {
+    // The store checks again, under the packages' locks, that none was stored
+    // since the pass started.
+    DBManager::Batch* batch = pass->batch;
+    const DBManager::Options fptrs(ServerDB::TOP_DIR_FPTRS, pass->top_dir);
+    const DBManager::Options depth(ServerDB::TOP_DIR_CHAIN_DEPTH,
+                                   pass->top_dir);
+    int64_t deleted = 0;
+    store_->DeletePackages(pass->top_dir, pass->doomed, pass->started, batch,
+                           [&](const string& hash) {
+                             batch->Delete(fptrs, hash);
+                             batch->Delete(depth, hash);
+                           },
+                           &deleted);
+    pass->deleted += deleted;
+  } else if (!pass->batch->empty() &&
+             !manager_->Write(pass->batch, false /* sync */)) {
+    LOG(ERROR) << "GC write failed";
+  }
+  pass->doomed.clear();
+  pass->pending = 0;
+  Throttle();
+}
+
+void PackageGC::Throttle() {
+  const base::TimeDelta busy = base::TimeTicks::Now() - batch_started_;
+  boost::this_thread::sleep(boost::posix_time::microseconds(
+      busy.InMicroseconds() * (100 - duty_percent_) / duty_percent_));
+  batch_started_ = base::TimeTicks::Now();
+}
+
+} // namespace lockbox
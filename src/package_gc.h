@@ -0,0 +1,169 @@
+// Retention-driven garbage collection of stored packages.
+//
+// Each pass marks, per relpath, the versions the policy keeps by walking back
+// from the TOP_DIR_RELPATH head through TOP_DIR_FPTRS, plus whatever older
+// packages the kept DELTAs need to be rebuilt. Packages named by updates still
+// queued in UPDATE_ACTION_QUEUE or DEVICE_SYNC are kept the same way, so that
+// a device that lags behind can still apply them. Everything older is deleted
+// along with its manifest and chunk references, and the oldest kept version
+// becomes the start of the chain. Packages that no head reaches at all, e.g.
+// uploads that were never recorded, are swept once they are a day old, and
+// UPDATE_ACTION_LOG is trimmed by age. Last, blob log segments that are mostly
+// dead space are compacted.
+//
+// Deletes go out in small batches, and the collector sleeps between them so
+// that it uses at most a fixed share of one thread's time.
+//
+//  lockbox::PackageGC::Policy policy;
+//  policy.keep_versions = 10;
+//  lockbox::PackageGC gc(&manager, &store, policy, 10 /* duty percent */);
+//  gc.Start(3600);
+
+#pragma once
+
+#if defined(OS_MACOSX)
+#define BOOST_NO_CXX11_NUMERIC_LIMITS 1
+#endif
+
+#include <boost/thread/thread.hpp>
+#include <ctime>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/time.h"
+#include "db_manager_server.h"
+#include "package_store.h"
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace lockbox {
+
+class PackageGC {
+ public:
+  // A version is kept if any rule keeps it. The head of every relpath is always
+  // kept.
+  struct Policy {
+    Policy() : keep_versions(0), keep_days(0), update_log_days(0) {}
+
+    // Newest versions of each relpath to keep. 0 keeps all of them unless
+    // |keep_days| is set.
+    int keep_versions;
+
+    // Versions uploaded in the last this many days are kept. Versions stored
+    // without an upload time count as recent.
+    int keep_days;
+
+    // UPDATE_ACTION_LOG entries older than this many days are dropped. 0 keeps
+    // the log.
+    int update_log_days;
+  };
+
+  // Does not take ownership of |manager| or |store|. The collector works at
+  // most |duty_percent| of the time while a pass runs.
+  PackageGC(DBManagerServer* manager, PackageStore* store,
+            const Policy& policy, int duty_percent);
+
+  ~PackageGC();
+
+  // Runs a pass every |interval_seconds| on a background thread.
+  void Start(int interval_seconds);
+
+  // Runs one pass on the calling thread.
+  void RunOnce();
+
+ private:
+  // State of a pass over one top dir, or over the update log.
+  struct Pass {
+    Pass(const string& top_dir, DBManager::Batch* batch)
+        : top_dir(top_dir), started(time(NULL)), batch(batch), pending(0),
+          deleted(0) {}
+
+    // Empty for the update log.
+    const string top_dir;
+
+    const time_t started;
+
+    // Hashes of the top dir that some relpath or queued update keeps, or that
+    // were deleted.
+    set<string> seen;
+
+    // Where a relpath's kept versions end: the oldest kept version and the
+    // newest one to delete.
+    vector<std::pair<string, string> > cuts;
+
+    DBManager::Batch* batch;
+
+    // Packages to delete with |batch|.
+    vector<string> doomed;
+
+    // Deletions in |batch| or |doomed|.
+    int pending;
+
+    int64_t deleted;
+  };
+
+  // Packages named by queued updates, by top dir.
+  typedef map<string, set<string> > Roots;
+
+  void Loop(int interval_seconds);
+
+  // Sets |roots| to the packages that updates not yet taken by every device
+  // name.
+  void QueuedRoots(Roots* roots);
+
+  void CollectTopDir(const string& top_dir, const set<string>& roots,
+                     Pass* pass);
+
+  // Reads the header of package |hash| as stored.
+  bool ReadHeader(const string& top_dir, const string& hash,
+                  RemotePackage* header);
+
+  // Marks the versions of the relpath at |head| that are kept and records
+  // where its chain is to be cut.
+  void MarkRelPath(const string& top_dir, const string& head, Pass* pass);
+
+  // Marks |root| and the versions it needs to be rebuilt.
+  void MarkRoot(const string& top_dir, const string& root, Pass* pass);
+
+  // Whether the policy keeps the |version|th newest package, |header|.
+  bool Retained(int version, const RemotePackage& header, time_t now) const;
+
+  // Deletes the versions behind |cut|.
+  void Cut(const string& top_dir, const std::pair<string, string>& cut,
+           Pass* pass);
+
+  // Deletes the packages of |top_dir| that no head reaches.
+  void SweepUnreachable(const string& top_dir, Pass* pass);
+
+  void DeletePackage(const string& top_dir, const string& hash, Pass* pass);
+
+  void TrimUpdateLog(Pass* pass);
+
+  // Once |pass| holds |limit| deletions, writes them, then throttles.
+  void MaybeFlush(Pass* pass, int limit);
+
+  // Sleeps off the time spent since the last call to stay within the duty
+  // cycle.
+  void Throttle();
+
+  DBManagerServer* manager_;
+  PackageStore* store_;
+  const Policy policy_;
+  const int duty_percent_;
+
+  // When the work that the next Throttle() makes up for started.
+  base::TimeTicks batch_started_;
+
+  scoped_ptr<boost::thread> thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(PackageGC);
+};
+
+} // namespace lockbox
@@ -0,0 +1,755 @@
+#include "package_store.h"
+
+#include <algorithm>
+#include <set>
+
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/stl_util.h"
+#include "base/string_util.h"
+#include "base/stringprintf.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "chunker.h"
+#include "guid_creator.h"
+#include "leveldb/db.h"
+#include "package_util.h"
+#include "scoped_mutex.h"
+#include "thrift_util.h"
+
+using std::min;
+using std::set;
+
+namespace lockbox {
+
+namespace {
+
+// Uploads that have not been committed after this long are dropped.
+const time_t kUploadTimeoutSeconds = 60 * 60;
+
+string ManifestKey(const string& hash, int64_t offset) {
+  return base::StringPrintf("%s_%020lld", hash.c_str(),
+                            static_cast<long long>(offset));
+}
+
+} // namespace
+
+PackageStore::PackageStore(DBManagerServer* manager, BlobLog* blobs)
+    : manager_(manager), chunks_(new ChunkStore(manager, blobs)) {
+  CHECK(manager);
+}
+
+PackageStore::~PackageStore() {
+}
+
+int64_t PackageStore::Put(const RemotePackage& pkg) {
+  Manifest manifest;
+  ChunkPayload(pkg, &manifest);
+
+  RemotePackage header;
+  CopyPackageHeader(pkg, &header);
+  header.uploaded_at = time(NULL);
+  CHECK(SyncChunks(header.top_dir, manifest));
+  ScopedMutexLock lock(PackageLock(header.top_dir,
+                                   header.payload.data_sha1));
+  CHECK(CommitManifest(header, manifest, ""));
+  return header.payload_size;
+}
+
+string PackageStore::BeginUpload(const RemotePackage& header) {
+  if (!header.payload.data.empty() || header.payload.data_sha1.empty()) {
+    LOG(WARNING) << "Bad upload header for " << header.rel_path_id;
+    return "";
+  }
+
+  const time_t now = time(NULL);
+  const string upload_id = CreateGUIDString();
+
+  // Idle uploads are dropped, but not while a chunk is being written to one or
+  // it is being committed.
+  vector<std::pair<string, string> > stale;
+  {
+    ScopedMutexLock lock(&pending_mutex_);
+    for (auto iter = pending_.begin(); iter != pending_.end();) {
+      const PendingUpload& pending = iter->second;
+      if (now - pending.last_active > kUploadTimeoutSeconds &&
+          pending.appending == 0 && !pending.committing) {
+        LOG(WARNING) << "Dropping stale upload " << iter->first;
+        stale.push_back(std::make_pair(pending.header.top_dir, iter->first));
+        pending_.erase(iter++);
+      } else {
+        ++iter;
+      }
+    }
+
+    PendingUpload& pending = pending_[upload_id];
+    pending.header = header;
+    pending.last_active = now;
+    pending.sha1.reset(new SHA1Hasher());
+  }
+
+  for (const std::pair<string, string>& upload : stale) {
+    DropStaged(upload.first, upload.second);
+  }
+  return upload_id;
+}
+
+bool PackageStore::AppendChunk(const PackageChunk& chunk, int64_t* received) {
+  CHECK(received);
+  if (static_cast<int64_t>(chunk.data.size()) > kMaxChunkSize) {
+    LOG(WARNING) << "Chunk too large for " << chunk.upload_id << ": "
+                 << chunk.data.size();
+    return false;
+  }
+
+  string top_dir;
+  {
+    ScopedMutexLock lock(&pending_mutex_);
+    auto iter = pending_.find(chunk.upload_id);
+    if (iter == pending_.end() || iter->second.committing) {
+      LOG(WARNING) << "Unknown upload " << chunk.upload_id;
+      *received = 0;
+      return false;
+    }
+    top_dir = iter->second.header.top_dir;
+  }
+
+  std::shared_ptr<SHA1Hasher> sha1;
+
+  // Take the chunk's reference first; it is dropped again if the chunk turns
+  // out not to belong at |offset|.
+  string chunk_hash;
+  int64_t size = 0;
+  if (!chunk.data.empty()) {
+    if (!PutChunk(top_dir, chunk.data, &chunk_hash)) {
+      return false;
+    }
+    size = chunk.data.size();
+  } else {
+    chunk_hash = chunk.chunk_sha1;
+    if (chunk_hash.empty() || !AddChunkRef(top_dir, chunk_hash, &size)) {
+      LOG(WARNING) << "Unknown chunk " << chunk_hash << " for "
+                   << chunk.upload_id;
+      return false;
+    }
+  }
+
+  // Reserve the range under the lock and write the manifest row outside of it
+  // so that concurrent uploads do not serialize on the database write. One row
+  // of an upload is written at a time, so a failed write can simply rewind.
+  {
+    ScopedMutexLock lock(&pending_mutex_);
+    auto iter = pending_.find(chunk.upload_id);
+    PendingUpload* pending =
+        iter == pending_.end() ? NULL : &(iter->second);
+    if (!pending || pending->committing || pending->appending > 0 ||
+        chunk.offset != pending->received) {
+      LOG(WARNING) << "Unknown upload or out of order chunk for "
+                   << chunk.upload_id << " at " << chunk.offset;
+      *received = pending ? pending->received : 0;
+      ReleaseChunk(top_dir, chunk_hash);
+      return false;
+    }
+    pending->received += size;
+    pending->last_active = time(NULL);
+    ++pending->appending;
+    *received = pending->received;
+    sha1 = pending->sha1;
+  }
+
+  // A chunk given by hash is hashed from the bytes stored under it, so that
+  // CommitUpload() checks the payload the manifest actually lists.
+  string stored;
+  const string* bytes = &chunk.data;
+  if (chunk.data.empty()) {
+    bytes = &stored;
+    if (!chunks_->Get(chunk_hash, &stored) ||
+        static_cast<int64_t>(stored.size()) != size) {
+      LOG(ERROR) << "Cannot read chunk " << chunk_hash;
+      stored.clear();
+      bytes = NULL;
+    }
+  }
+  const bool written = bytes && WriteManifestEntry(
+      top_dir, StagedName(chunk.upload_id), chunk.offset, chunk_hash, size);
+  if (written) {
+    sha1->Update(*bytes);
+  }
+  {
+    ScopedMutexLock lock(&pending_mutex_);
+    PendingUpload& pending = pending_[chunk.upload_id];
+    --pending.appending;
+    if (!written) {
+      pending.received = chunk.offset;
+    }
+  }
+  if (!written) {
+    *received = chunk.offset;
+    ReleaseChunk(top_dir, chunk_hash);
+    return false;
+  }
+  return true;
+}
+
+void PackageStore::MissingChunks(const string& top_dir,
+                                 const vector<string>& hashes,
+                                 vector<string>* missing) {
+  CHECK(missing);
+  missing->clear();
+  for (const string& hash : hashes) {
+    if (TopDirRefs(top_dir, hash) <= 0) {
+      missing->push_back(hash);
+    }
+  }
+}
+
+bool PackageStore::CommitUpload(const string& upload_id,
+                                RemotePackage* header) {
+  CHECK(header);
+  bool matches = false;
+  {
+    ScopedMutexLock lock(&pending_mutex_);
+    auto iter = pending_.find(upload_id);
+    if (iter == pending_.end() || iter->second.committing ||
+        iter->second.appending > 0) {
+      LOG(WARNING) << "Unknown or busy upload " << upload_id;
+      return false;
+    }
+    *header = iter->second.header;
+    header->payload_size = iter->second.received;
+    matches = iter->second.sha1->Hex() == header->payload.data_sha1;
+    if (matches) {
+      iter->second.committing = true;
+    } else {
+      pending_.erase(iter);
+    }
+  }
+  if (!matches) {
+    LOG(WARNING) << "Payload of upload " << upload_id << " does not match "
+                 << header->payload.data_sha1;
+    DropStaged(header->top_dir, upload_id);
+    return false;
+  }
+
+  const string staged = StagedName(upload_id);
+  Manifest manifest;
+  ReadManifest(header->top_dir, staged, &manifest);
+  header->uploaded_at = time(NULL);
+  bool committed = false;
+  if (SyncChunks(header->top_dir, manifest)) {
+    ScopedMutexLock lock(PackageLock(header->top_dir,
+                                     header->payload.data_sha1));
+    committed = CommitManifest(*header, manifest, staged);
+  }
+
+  ScopedMutexLock lock(&pending_mutex_);
+  if (committed) {
+    pending_.erase(upload_id);
+  } else {
+    pending_[upload_id].committing = false;
+  }
+  return committed;
+}
+
+bool PackageStore::GetHeader(const string& top_dir, const string& hash,
+                             RemotePackage* header) {
+  CHECK(header);
+  if (!GetStored(top_dir, hash, header)) {
+    return false;
+  }
+  header->payload.data.clear();
+  return true;
+}
+
+bool PackageStore::ReadRange(const string& top_dir, const string& hash,
+                             int64_t offset, int64_t length, string* data) {
+  CHECK(data);
+  data->clear();
+
+  RemotePackage stored;
+  if (!GetStored(top_dir, hash, &stored)) {
+    return false;
+  }
+  if (!stored.payload.data.empty()) {
+    if (offset < 0 || length < 0) {
+      return false;
+    }
+    if (offset < stored.payload_size) {
+      data->assign(stored.payload.data, offset, length);
+    }
+    return true;
+  }
+  return ReadPayload(top_dir, stored, offset, length, data);
+}
+
+bool PackageStore::Get(const string& top_dir, const string& hash,
+                       RemotePackage* pkg) {
+  CHECK(pkg);
+  if (!GetStored(top_dir, hash, pkg)) {
+    return false;
+  }
+  if (pkg->payload_size == 0 || !pkg->payload.data.empty()) {
+    return true;
+  }
+  return ReadPayload(top_dir, *pkg, 0, pkg->payload_size,
+                     &(pkg->payload.data));
+}
+
+bool PackageStore::ReadPayload(const string& top_dir,
+                               const RemotePackage& header, int64_t offset,
+                               int64_t length, string* data) {
+  string chunk;
+  return VisitPayload(
+      top_dir, header, offset, length,
+      [&](const string& chunk_hash, int64_t chunk_size, int64_t from,
+          int64_t count) {
+        if (!chunks_->Get(chunk_hash, &chunk) ||
+            static_cast<int64_t>(chunk.size()) != chunk_size) {
+          LOG(ERROR) << "Lost chunk " << chunk_hash << " of "
+                     << header.payload.data_sha1;
+          return false;
+        }
+        if (data->empty()) {
+          data->reserve(min(length, header.payload_size - offset));
+        }
+        data->append(chunk, from, count);
+        return true;
+      });
+}
+
+bool PackageStore::SendRange(const string& top_dir,
+                             const RemotePackage& header, int64_t offset,
+                             int64_t length, int socket) {
+  return VisitPayload(
+      top_dir, header, offset, length,
+      [&](const string& chunk_hash, int64_t chunk_size, int64_t from,
+          int64_t count) {
+        return chunks_->Send(chunk_hash, chunk_size, from, count, socket);
+      });
+}
+
+bool PackageStore::VisitPayload(const string& top_dir,
+                                const RemotePackage& header, int64_t offset,
+                                int64_t length, const ChunkVisitor& visit) {
+  if (offset < 0 || length < 0) {
+    return false;
+  }
+  const string& hash = header.payload.data_sha1;
+
+  const int64_t want = min(length, header.payload_size - offset);
+  if (want <= 0) {
+    return true;
+  }
+
+  scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(
+      DBManager::Options(ServerDB::TOP_DIR_MANIFEST, top_dir)));
+
+  // Find the chunk containing |offset|: either the one starting exactly there
+  // or the one before the first chunk starting after it.
+  const string prefix = hash + "_";
+  const string start_key = ManifestKey(hash, offset);
+  it->Seek(start_key);
+  if (!it->Valid()) {
+    it->SeekToLast();
+  } else if (it->key().ToString() != start_key) {
+    it->Prev();
+  }
+
+  int64_t done = 0;
+  for (; it->Valid() && done < want; it->Next()) {
+    const string key = it->key().ToString();
+    if (!StartsWithASCII(key, prefix, true /* case sensitive */)) {
+      break;
+    }
+    int64_t chunk_offset = 0;
+    CHECK(base::StringToInt64(key.substr(prefix.size()), &chunk_offset)) << key;
+
+    vector<string> hash_size;
+    base::SplitString(it->value().ToString(), ',', &hash_size);
+    CHECK(hash_size.size() == 2) << it->value().ToString();
+    int64_t chunk_size = 0;
+    CHECK(base::StringToInt64(hash_size[1], &chunk_size));
+
+    const int64_t position = offset + done;
+    if (chunk_offset + chunk_size <= position) {
+      continue;
+    }
+    if (chunk_offset > position) {
+      LOG(ERROR) << "Missing chunk for " << hash << " at " << position;
+      return false;
+    }
+
+    const int64_t from = position - chunk_offset;
+    const int64_t count = min(chunk_size - from, want - done);
+    if (!visit(hash_size[0], chunk_size, from, count)) {
+      return false;
+    }
+    done += count;
+  }
+
+  if (done != want) {
+    LOG(ERROR) << "Short read for " << hash << ": " << done << " of " << want;
+    return false;
+  }
+  return true;
+}
+
+bool PackageStore::DeletePackages(
+    const string& top_dir, const vector<string>& hashes, time_t stored_before,
+    DBManager::Batch* batch, const std::function<void(const string&)>& deleting,
+    int64_t* deleted) {
+  CHECK(batch);
+  CHECK(deleted);
+  *deleted = 0;
+
+  // Hold the packages' locks from the check through the write, taking them in
+  // address order so that overlapping callers cannot deadlock.
+  set<mutex*> locks;
+  for (const string& hash : hashes) {
+    locks.insert(PackageLock(top_dir, hash));
+  }
+  for (mutex* lock : locks) {
+    lock->lock();
+  }
+
+  // Read the headers as stored; there is no point chunking an old whole
+  // package just to delete it.
+  const DBManager::Options data(ServerDB::TOP_DIR_DATA, top_dir);
+  vector<string> chunks;
+  for (const string& hash : hashes) {
+    string package_str;
+    manager_->Get(data, hash, &package_str);
+    if (!package_str.empty()) {
+      RemotePackage header;
+      ThriftFromString(package_str, &header);
+      if (header.uploaded_at >= stored_before) {
+        continue;
+      }
+    }
+    DeleteManifest(top_dir, hash, batch, &chunks);
+    batch->Delete(data, hash);
+    deleting(hash);
+    ++*deleted;
+  }
+  const bool written = batch->empty() || manager_->Write(batch, false);
+
+  for (mutex* lock : locks) {
+    lock->unlock();
+  }
+
+  // Chunks are only released once nothing refers to them any more; a failed
+  // write leaks their references rather than losing data.
+  if (!written) {
+    LOG(ERROR) << "Failed to delete packages of " << top_dir;
+    *deleted = 0;
+    return false;
+  }
+  ReleaseChunks(top_dir, chunks);
+  return true;
+}
+
+void PackageStore::ReleaseChunks(const string& top_dir,
+                                 const vector<string>& chunks) {
+  for (const string& chunk : chunks) {
+    ReleaseChunk(top_dir, chunk);
+  }
+}
+
+void PackageStore::SweepAbandonedUploads(const string& top_dir) {
+  set<string> upload_ids;
+  scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(
+      DBManager::Options(ServerDB::TOP_DIR_MANIFEST, top_dir)));
+  const string prefix = StagedName("");
+  for (it->Seek(prefix); it->Valid(); it->Next()) {
+    const string key = it->key().ToString();
+    if (!StartsWithASCII(key, prefix, true /* case sensitive */)) {
+      break;
+    }
+    upload_ids.insert(key.substr(prefix.size(),
+                                 key.rfind('_') - prefix.size()));
+  }
+  it.reset();
+
+  // Rows are only staged for an upload in |pending_|, and it leaves |pending_|
+  // only once they are moved or dropped, so the rows of any other upload are
+  // left over.
+  for (const string& upload_id : upload_ids) {
+    {
+      ScopedMutexLock lock(&pending_mutex_);
+      if (ContainsKey(pending_, upload_id)) {
+        continue;
+      }
+    }
+    LOG(INFO) << "Dropping abandoned upload " << upload_id;
+    DropStaged(top_dir, upload_id);
+  }
+}
+
+void PackageStore::BlobSegments(vector<uint32_t>* segments) {
+  chunks_->BlobSegments(segments);
+}
+
+int64_t PackageStore::CompactBlobSegment(uint32_t segment) {
+  return chunks_->CompactBlobSegment(segment);
+}
+
+int64_t PackageStore::ChunkWholePackages() {
+  set<string> top_dirs;
+  manager_->GetTopDirs(&top_dirs);
+  int64_t chunked = 0;
+  for (const string& top_dir : top_dirs) {
+    vector<string> whole;
+    scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(
+        DBManager::Options(ServerDB::TOP_DIR_DATA, top_dir)));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      RemotePackage header;
+      ThriftFromString(it->value().ToString(), &header);
+      if (!header.payload.data.empty()) {
+        whole.push_back(it->key().ToString());
+      }
+    }
+    it.reset();
+
+    for (const string& hash : whole) {
+      if (ChunkWhole(top_dir, hash)) {
+        ++chunked;
+      }
+    }
+  }
+  LOG(INFO) << "Chunked " << chunked
+            << " packages stored whole by an older server";
+  return chunked;
+}
+
+bool PackageStore::GetStored(const string& top_dir, const string& hash,
+                             RemotePackage* pkg) {
+  string package_str;
+  manager_->Get(DBManager::Options(ServerDB::TOP_DIR_DATA, top_dir),
+                hash, &package_str);
+  if (package_str.empty()) {
+    return false;
+  }
+  ThriftFromString(package_str, pkg);
+  if (!pkg->payload.data.empty()) {
+    pkg->payload.data_sha1 = hash;
+    pkg->payload_size = pkg->payload.data.size();
+  }
+  return true;
+}
+
+bool PackageStore::ChunkWhole(const string& top_dir, const string& hash) {
+  // Under the package's lock, so that an upload of the same hash meanwhile is
+  // neither lost nor given the old upload time.
+  ScopedMutexLock lock(PackageLock(top_dir, hash));
+  RemotePackage pkg;
+  if (!GetStored(top_dir, hash, &pkg) || pkg.payload.data.empty()) {
+    return false;
+  }
+  pkg.top_dir = top_dir;
+  Manifest manifest;
+  ChunkPayload(pkg, &manifest);
+
+  RemotePackage header;
+  CopyPackageHeader(pkg, &header);
+  header.uploaded_at = pkg.uploaded_at;
+  return SyncChunks(top_dir, manifest) &&
+      CommitManifest(header, manifest, "");
+}
+
+void PackageStore::ChunkPayload(const RemotePackage& pkg,
+                                Manifest* manifest) {
+  const string& data = pkg.payload.data;
+  vector<size_t> lengths;
+  ContentChunker().Split(data.data(), data.size(), &lengths);
+
+  manifest->clear();
+  size_t offset = 0;
+  for (size_t length : lengths) {
+    string chunk_hash;
+    CHECK(PutChunk(pkg.top_dir, data.substr(offset, length), &chunk_hash));
+    (*manifest)[offset] = chunk_hash + "," + base::Int64ToString(length);
+    offset += length;
+  }
+}
+
+string PackageStore::StagedName(const string& upload_id) {
+  // Package hashes are hex, so this cannot name a package.
+  return "~" + upload_id;
+}
+
+void PackageStore::ReadManifest(const string& top_dir, const string& name,
+                                Manifest* manifest) {
+  CHECK(manifest);
+  manifest->clear();
+  scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(
+      DBManager::Options(ServerDB::TOP_DIR_MANIFEST, top_dir)));
+  const string prefix = name + "_";
+  for (it->Seek(prefix); it->Valid(); it->Next()) {
+    const string key = it->key().ToString();
+    if (!StartsWithASCII(key, prefix, true /* case sensitive */)) {
+      break;
+    }
+    int64_t offset = 0;
+    CHECK(base::StringToInt64(key.substr(prefix.size()), &offset)) << key;
+    (*manifest)[offset] = it->value().ToString();
+  }
+}
+
+void PackageStore::DeleteManifest(const string& top_dir, const string& name,
+                                  DBManager::Batch* batch,
+                                  vector<string>* chunks) {
+  const DBManager::Options manifest(ServerDB::TOP_DIR_MANIFEST, top_dir);
+  scoped_ptr<leveldb::Iterator> it(manager_->NewIterator(manifest));
+  const string prefix = name + "_";
+  for (it->Seek(prefix); it->Valid(); it->Next()) {
+    const string key = it->key().ToString();
+    if (!StartsWithASCII(key, prefix, true /* case sensitive */)) {
+      break;
+    }
+    vector<string> hash_size;
+    base::SplitString(it->value().ToString(), ',', &hash_size);
+    CHECK(hash_size.size() == 2) << it->value().ToString();
+    chunks->push_back(hash_size[0]);
+    batch->Delete(manifest, key);
+  }
+}
+
+bool PackageStore::WriteManifestEntry(const string& top_dir,
+                                      const string& name, int64_t offset,
+                                      const string& chunk_hash, int64_t size) {
+  return manager_->Put(DBManager::Options(ServerDB::TOP_DIR_MANIFEST, top_dir),
+                       ManifestKey(name, offset),
+                       chunk_hash + "," + base::Int64ToString(size));
+}
+
+bool PackageStore::SyncChunks(const string& top_dir,
+                              const Manifest& manifest) {
+  vector<string> hashes;
+  for (const auto& row : manifest) {
+    vector<string> hash_size;
+    base::SplitString(row.second, ',', &hash_size);
+    CHECK(hash_size.size() == 2) << row.second;
+    hashes.push_back(hash_size[0]);
+  }
+  if (!chunks_->Sync(hashes) ||
+      !manager_->Sync(DBManager::Options(ServerDB::TOP_DIR_CHUNKS, top_dir))) {
+    LOG(ERROR) << "Cannot sync the chunks of a package in " << top_dir;
+    return false;
+  }
+  return true;
+}
+
+bool PackageStore::CommitManifest(const RemotePackage& header,
+                                  const Manifest& manifest,
+                                  const string& staged) {
+  const string& top_dir = header.top_dir;
+  const string& hash = header.payload.data_sha1;
+  const DBManager::Options manifest_options(ServerDB::TOP_DIR_MANIFEST,
+                                            top_dir);
+
+  // The new rows take over the staged rows' references; those of the rows
+  // they replace are dropped once the batch is written.
+  DBManager::Batch batch(manager_);
+  vector<string> replaced, moved;
+  DeleteManifest(top_dir, hash, &batch, &replaced);
+  if (!staged.empty()) {
+    DeleteManifest(top_dir, staged, &batch, &moved);
+  }
+  for (const auto& row : manifest) {
+    batch.Put(manifest_options, ManifestKey(hash, row.first), row.second);
+  }
+
+  string mem;
+  ThriftToString(header, &mem);
+  batch.Put(DBManager::Options(ServerDB::TOP_DIR_DATA, top_dir), hash, mem);
+  if (!manager_->Write(&batch, true /* sync */)) {
+    LOG(ERROR) << "Failed to store " << hash;
+    return false;
+  }
+  ReleaseChunks(top_dir, replaced);
+  return true;
+}
+
+void PackageStore::DropStaged(const string& top_dir,
+                              const string& upload_id) {
+  ScopedMutexLock lock(&drop_mutex_);
+  DBManager::Batch batch(manager_);
+  vector<string> chunks;
+  DeleteManifest(top_dir, StagedName(upload_id), &batch, &chunks);
+  if (batch.empty()) {
+    return;
+  }
+  if (!manager_->Write(&batch, false /* sync */)) {
+    LOG(ERROR) << "Failed to drop upload " << upload_id;
+    return;
+  }
+  ReleaseChunks(top_dir, chunks);
+}
+
+bool PackageStore::PutChunk(const string& top_dir, const string& data,
+                            string* hash) {
+  if (!chunks_->Put(data, hash)) {
+    return false;
+  }
+  ScopedMutexLock lock(ChunkLock(top_dir, *hash));
+  if (!SetTopDirRefs(top_dir, *hash, TopDirRefs(top_dir, *hash) + 1)) {
+    chunks_->Release(*hash);
+    return false;
+  }
+  return true;
+}
+
+bool PackageStore::AddChunkRef(const string& top_dir, const string& hash,
+                               int64_t* size) {
+  ScopedMutexLock lock(ChunkLock(top_dir, hash));
+  const int64_t refs = TopDirRefs(top_dir, hash);
+  if (refs <= 0 || !chunks_->AddRef(hash, size)) {
+    return false;
+  }
+  if (!SetTopDirRefs(top_dir, hash, refs + 1)) {
+    chunks_->Release(hash);
+    return false;
+  }
+  return true;
+}
+
+void PackageStore::ReleaseChunk(const string& top_dir, const string& hash) {
+  {
+    // Rows written before the counts were kept have none to drop.
+    ScopedMutexLock lock(ChunkLock(top_dir, hash));
+    const int64_t refs = TopDirRefs(top_dir, hash);
+    if (refs > 0) {
+      SetTopDirRefs(top_dir, hash, refs - 1);
+    }
+  }
+  chunks_->Release(hash);
+}
+
+int64_t PackageStore::TopDirRefs(const string& top_dir, const string& hash) {
+  string value;
+  manager_->Get(DBManager::Options(ServerDB::TOP_DIR_CHUNKS, top_dir), hash,
+                &value);
+  int64_t refs = 0;
+  return base::StringToInt64(value, &refs) ? refs : 0;
+}
+
+bool PackageStore::SetTopDirRefs(const string& top_dir, const string& hash,
+                                 int64_t refs) {
+  const DBManager::Options options(ServerDB::TOP_DIR_CHUNKS, top_dir);
+  if (refs <= 0) {
+    return manager_->Delete(options, hash);
+  }
+  return manager_->Put(options, hash, base::Int64ToString(refs));
+}
+
+mutex* PackageStore::PackageLock(const string& top_dir, const string& hash) {
+  return &package_locks_[std::hash<string>()(top_dir + "/" + hash) %
+                         kNumLockStripes];
+}
+
+mutex* PackageStore::ChunkLock(const string& top_dir, const string& hash) {
+  return &chunk_locks_[std::hash<string>()(top_dir + "/" + hash) %
+                       kNumLockStripes];
+}
+
+} // namespace lockbox
@@ -0,0 +1,240 @@
+// Chunked package storage for the Lockbox server.
+//
+// A package is kept as a header (the RemotePackage with an empty payload.data
+// and payload_size set) in TOP_DIR_DATA, and its payload as a manifest of
+// chunks in TOP_DIR_MANIFEST keyed by HASH_OFFSET. The chunk bytes live once in
+// the shared ChunkStore, however many packages list them. Payloads are written
+// and read a chunk at a time so that memory use on the server is bounded by the
+// chunk size rather than by the package size.
+//
+// The manifest of an upload is staged under its upload ID and replaces that of
+// the package on commit, so readers never see a partial one. TOP_DIR_CHUNKS
+// counts the manifest rows of each top dir that hold a chunk; a client may only
+// refer to, or learn of, a chunk by its hash within a top dir that holds it.
+//
+//  lockbox::PackageStore store(&manager, NULL /* blobs */);
+//  const string upload_id = store.BeginUpload(user, header);
+//  int64_t received = 0;
+//  store.AppendChunk(chunk, &received);
+//  store.CommitUpload(upload_id, &header);
+
+#pragma once
+
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/memory/scoped_ptr.h"
+#include "chunk_store.h"
+#include "db_manager_server.h"
+#include "hash_util.h"
+#include "lockbox_types.h"
+
+using std::map;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace lockbox {
+
+// Largest chunk accepted from a client or returned by a single ranged read.
+const int64_t kMaxChunkSize = 8 << 20;
+
+class PackageStore {
+ public:
+  // Does not take ownership of |manager| or |blobs|. Large chunks go to
+  // |blobs| unless it is NULL.
+  PackageStore(DBManagerServer* manager, BlobLog* blobs);
+
+  ~PackageStore();
+
+  // Stores the whole of |pkg|, splitting its payload at content-defined chunk
+  // boundaries. Returns the payload size.
+  int64_t Put(const RemotePackage& pkg);
+
+  // Starts a chunked upload for |header|, whose payload.data must be empty.
+  // Returns the ID used by AppendChunk and CommitUpload.
+  string BeginUpload(const RemotePackage& header);
+
+  // Stores |chunk|, which must start where the previous chunk ended. A chunk
+  // with empty data refers to the chunk named by its chunk_sha1, which the
+  // upload's top dir must hold. Sets |received| to the number of payload bytes
+  // stored so far.
+  bool AppendChunk(const PackageChunk& chunk, int64_t* received);
+
+  // Sets |missing| to the entries of |hashes| that |top_dir| does not hold.
+  void MissingChunks(const string& top_dir, const vector<string>& hashes,
+                     vector<string>* missing);
+
+  // Finishes an upload, replacing any package stored under the same hash. The
+  // completed header is returned through |header|. An upload whose payload
+  // does not match the header's payload.data_sha1 is dropped instead.
+  bool CommitUpload(const string& upload_id, RemotePackage* header);
+
+  // Reads the header of package |hash|.
+  bool GetHeader(const string& top_dir, const string& hash,
+                 RemotePackage* header);
+
+  // Reads up to |length| bytes of the payload of package |hash| starting at
+  // |offset|.
+  bool ReadRange(const string& top_dir, const string& hash,
+                 int64_t offset, int64_t length, string* data);
+
+  // Writes the |length| bytes of the payload of |header|, stored in |top_dir|,
+  // that start at |offset| to |socket|. Chunks in the blob log are copied to
+  // the socket by the kernel. Fails for a package stored whole by an older
+  // server until ChunkWholePackages() gets to it; use ReadRange() then.
+  bool SendRange(const string& top_dir, const RemotePackage& header,
+                 int64_t offset, int64_t length, int socket);
+
+  // Reads the whole package, payload included.
+  bool Get(const string& top_dir, const string& hash, RemotePackage* pkg);
+
+  // Deletes those of packages |hashes| of |top_dir| that were last stored
+  // before |stored_before|, with their manifests, in one write with the rest
+  // of |batch|. |deleting| is called with each so that the caller can add its
+  // own rows to |batch|. Stores of the same hashes wait for the write, so a
+  // package stored again since the caller chose it is kept. Sets |deleted| to
+  // the number deleted.
+  bool DeletePackages(const string& top_dir, const vector<string>& hashes,
+                      time_t stored_before, DBManager::Batch* batch,
+                      const std::function<void(const string&)>& deleting,
+                      int64_t* deleted);
+
+  // Drops the staged manifests of |top_dir| whose uploads are gone, e.g. with a
+  // restart of the server.
+  void SweepAbandonedUploads(const string& top_dir);
+
+  // Moves the payloads of packages stored whole by older servers into chunks,
+  // keeping their upload times. Reads serve such packages from the header
+  // until then, so this only needs to run once, in the background, after an
+  // upgrade. Returns the number of packages chunked.
+  int64_t ChunkWholePackages();
+
+  // See ChunkStore::BlobSegments() and ChunkStore::CompactBlobSegment().
+  void BlobSegments(vector<uint32_t>* segments);
+  int64_t CompactBlobSegment(uint32_t segment);
+
+ private:
+  // Called with a chunk's hash and size, and the offset and count of the bytes
+  // wanted from it. Returns false to stop.
+  typedef std::function<bool(const string& chunk_hash, int64_t chunk_size,
+                             int64_t from, int64_t count)> ChunkVisitor;
+
+  struct PendingUpload {
+    PendingUpload() : received(0), last_active(0), appending(0),
+                      committing(false) {}
+
+    RemotePackage header;
+    int64_t received;
+    time_t last_active;
+
+    // Over the payload bytes received so far, in order. Only updated while
+    // |appending|, so one AppendChunk() call at a time.
+    std::shared_ptr<SHA1Hasher> sha1;
+
+    // AppendChunk() calls writing a manifest row. The upload is only dropped
+    // while there are none.
+    int appending;
+
+    // Set once CommitUpload() starts; no more chunks are taken.
+    bool committing;
+  };
+
+  // Manifest rows by chunk offset, as "CHUNK_SHA1,SIZE".
+  typedef map<int64_t, string> Manifest;
+
+  static const int kNumLockStripes = 64;
+
+  // Reads the stored header of package |hash| and sets its payload_size. The
+  // payload of a package stored whole by an older server is left in
+  // payload.data.
+  bool GetStored(const string& top_dir, const string& hash,
+                 RemotePackage* pkg);
+
+  // Chunks package |hash| if it is still stored whole.
+  bool ChunkWhole(const string& top_dir, const string& hash);
+
+  // Stores the payload of |pkg| as chunks of |pkg|'s top dir and sets
+  // |manifest| to them.
+  void ChunkPayload(const RemotePackage& pkg, Manifest* manifest);
+
+  // Reads up to |length| bytes of the chunked payload of |header|, stored in
+  // |top_dir|, starting at |offset|.
+  bool ReadPayload(const string& top_dir, const RemotePackage& header,
+                   int64_t offset, int64_t length, string* data);
+
+  // Calls |visit|, in order, for each chunk holding some of the |length| bytes
+  // of the payload of |header| that start at |offset|. Fails if |visit| does.
+  bool VisitPayload(const string& top_dir, const RemotePackage& header,
+                    int64_t offset, int64_t length, const ChunkVisitor& visit);
+
+  // Name under which the manifest of upload |upload_id| is staged.
+  static string StagedName(const string& upload_id);
+
+  void ReadManifest(const string& top_dir, const string& name,
+                    Manifest* manifest);
+
+  // Adds to |batch| the removal of the manifest rows of |name| and appends the
+  // chunks they hold to |chunks|.
+  void DeleteManifest(const string& top_dir, const string& name,
+                      DBManager::Batch* batch, vector<string>* chunks);
+
+  bool WriteManifestEntry(const string& top_dir, const string& name,
+                          int64_t offset, const string& chunk_hash,
+                          int64_t size);
+
+  // Makes the chunks of |manifest| and |top_dir|'s references to them durable
+  // ahead of the synced CommitManifest() that lists them.
+  bool SyncChunks(const string& top_dir, const Manifest& manifest);
+
+  // Stores |header| with |manifest| in place of whatever manifest the package
+  // had, dropping the rows of |staged| unless it is empty, in one synced write.
+  // The replaced rows' references are released. Requires the package's
+  // PackageLock() and a SyncChunks() of |manifest|.
+  bool CommitManifest(const RemotePackage& header, const Manifest& manifest,
+                      const string& staged);
+
+  // Drops the staged manifest of |upload_id| along with its references.
+  void DropStaged(const string& top_dir, const string& upload_id);
+
+  // Take a reference of |top_dir| on a chunk, given its bytes or, if |top_dir|
+  // holds it already, its hash.
+  bool PutChunk(const string& top_dir, const string& data, string* hash);
+  bool AddChunkRef(const string& top_dir, const string& hash, int64_t* size);
+
+  void ReleaseChunk(const string& top_dir, const string& hash);
+  void ReleaseChunks(const string& top_dir, const vector<string>& chunks);
+
+  // Rows of |top_dir|'s manifests that hold chunk |hash|. Updates are made
+  // under ChunkLock(top_dir, hash).
+  int64_t TopDirRefs(const string& top_dir, const string& hash);
+  bool SetTopDirRefs(const string& top_dir, const string& hash, int64_t refs);
+
+  // Serializes the writes of package |hash| of |top_dir|.
+  mutex* PackageLock(const string& top_dir, const string& hash);
+
+  // Serializes the TOP_DIR_CHUNKS updates of chunk |hash| in |top_dir|.
+  mutex* ChunkLock(const string& top_dir, const string& hash);
+
+  DBManagerServer* manager_;
+  scoped_ptr<ChunkStore> chunks_;
+
+  mutex pending_mutex_;
+  map<string, PendingUpload> pending_;
+
+  // Serializes DropStaged(), so that a staged manifest is released once.
+  mutex drop_mutex_;
+
+  mutex package_locks_[kNumLockStripes];
+  mutex chunk_locks_[kNumLockStripes];
+
+  DISALLOW_COPY_AND_ASSIGN(PackageStore);
+};
+
+} // namespace lockbox
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "lockbox_types.h"
+
+namespace lockbox {
+
+// Copies everything but the payload bytes of |pkg| into |header|, recording the
+// payload's size in payload_size. Avoids copying the payload just to clear it.
+inline void CopyPackageHeader(const RemotePackage& pkg, RemotePackage* header) {
+  header->top_dir = pkg.top_dir;
+  header->rel_path_id = pkg.rel_path_id;
+  header->type = pkg.type;
+  header->path = pkg.path;
+  header->delta_prev_hash = pkg.delta_prev_hash;
+  header->payload.data.clear();
+  header->payload.user_enc_session = pkg.payload.user_enc_session;
+  header->payload.data_sha1 = pkg.payload.data_sha1;
+  header->payload_size = pkg.payload.data.empty() ?
+      pkg.payload_size : pkg.payload.data.size();
+}
+
+} // namespace lockbox
@@ -88,35 +88,34 @@ class Queue {
           LOG(ERROR) << "Queue is full.";
           CHECK_EQ(pthread_mutex_unlock(&mutex_), 0);
           return false;
-        } else if (timeout == 0) {
-          while (queue_.size() == maxsize_) {
-            pthread_cond_wait(&not_full_, &mutex_);
-          }
-        } else if (timeout < 0) {
-          CHECK_EQ(pthread_mutex_unlock(&mutex_), 0);
-          LOG(FATAL) << "'timeout' must be a positive number";
-        } else {
-          time_t endtime = time(NULL) + timeout;
-          while (queue_.size() == maxsize_) {
-            time_t remaining = endtime - time(NULL);
-            if (remaining <= 0.0) {
-              CHECK_EQ(pthread_mutex_unlock(&mutex_), 0);
-              return false;
-            }
-
-            // Following example from 'man pthread_cond_timedwait' to figure out
-            // what is the remaining time to call a pthread conditional variable
-            // timed wait.
-            struct timeval tv;
-            struct timespec ts;
-            gettimeofday(&tv, NULL);
-            ts.tv_sec = tv.tv_sec + remaining;
-            ts.tv_nsec = 0;
-
-            pthread_cond_timedwait(&not_full_, &mutex_, &ts);
-          }
         }
+      } else if (timeout == 0) {
+        while (queue_.size() == maxsize_) {
+          pthread_cond_wait(&not_full_, &mutex_);
+        }
+      } else if (timeout < 0) {
+        CHECK_EQ(pthread_mutex_unlock(&mutex_), 0);
+        LOG(FATAL) << "'timeout' must be a positive number";
+      } else {
+        time_t endtime = time(NULL) + timeout;
+        while (queue_.size() == maxsize_) {
+          time_t remaining = endtime - time(NULL);
+          if (remaining <= 0.0) {
+            CHECK_EQ(pthread_mutex_unlock(&mutex_), 0);
+            return false;
+          }
 
+          // Following example from 'man pthread_cond_timedwait' to figure out
+          // what is the remaining time to call a pthread conditional variable
+          // timed wait.
+          struct timeval tv;
+          struct timespec ts;
+          gettimeofday(&tv, NULL);
+          ts.tv_sec = tv.tv_sec + remaining;
+          ts.tv_nsec = 0;
+
+          pthread_cond_timedwait(&not_full_, &mutex_, &ts);
+        }
       }
     }
     queue_.push_back(value);
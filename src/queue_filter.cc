@@ -27,9 +27,8 @@ void QueueFilter::Run() {
 
   while (true) {
     // Read the key from the queue.
-    leveldb::DB* db = dbm_->db(unfiltered_queue_options);
-
-    scoped_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+    scoped_ptr<leveldb::Iterator> it(
+        dbm_->NewIterator(unfiltered_queue_options));
     it->SeekToFirst();
     if (!it->Valid()) {
       sleep(1);
@@ -49,8 +48,7 @@ void QueueFilter::Run() {
     // to see that the location string is a prefix of the location.
     DBManagerClient::Options top_dir_loc_options;
     top_dir_loc_options.type = ClientDB::TOP_DIR_LOCATION;
-    leveldb::DB* top_dir_loc = dbm_->db(top_dir_loc_options);
-    it.reset(top_dir_loc->NewIterator(leveldb::ReadOptions()));
+    it.reset(dbm_->NewIterator(top_dir_loc_options));
     string top_dir_num;
     // TODO(tierney): Cache this information.
     for (it->SeekToFirst(); it->Valid(); it->Next()) {
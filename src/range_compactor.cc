@@ -0,0 +1,72 @@
+#include "range_compactor.h"
+
+#include "base/logging.h"
+#include "base/stringprintf.h"
+#include "scoped_mutex.h"
+
+namespace lockbox {
+
+RangeCompactor::RangeCompactor(DBManager* manager, int interval_ms)
+    : manager_(manager), interval_ms_(interval_ms) {
+  CHECK(manager);
+  CHECK_GT(interval_ms, 0);
+}
+
+RangeCompactor::~RangeCompactor() {
+  if (thread_.get()) {
+    thread_->interrupt();
+    thread_->join();
+  }
+}
+
+void RangeCompactor::Start() {
+  CHECK(!thread_.get());
+  thread_.reset(new boost::thread(boost::bind(&RangeCompactor::Loop, this)));
+}
+
+void RangeCompactor::Add(const DBManager::Options& options,
+                         const string& group, const string& first_key,
+                         const string& last_key) {
+  // Table names and groups come from clients, so their lengths keep the key
+  // unambiguous.
+  const string key = base::StringPrintf(
+      "%d_%zu_%s_%s", options.type, options.name.size(), options.name.c_str(),
+      group.c_str());
+  ScopedMutexLock lock(&mutex_);
+  auto found = pending_.find(key);
+  if (found == pending_.end()) {
+    Range& range = pending_[key];
+    range.options = options;
+    range.first_key = first_key;
+    range.last_key = last_key;
+    return;
+  }
+  Range& range = found->second;
+  if (first_key < range.first_key) {
+    range.first_key = first_key;
+  }
+  if (last_key > range.last_key) {
+    range.last_key = last_key;
+  }
+}
+
+void RangeCompactor::Loop() {
+  try {
+    while (true) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(interval_ms_));
+      Range range;
+      {
+        ScopedMutexLock lock(&mutex_);
+        if (pending_.empty()) {
+          continue;
+        }
+        range = pending_.begin()->second;
+        pending_.erase(pending_.begin());
+      }
+      manager_->CompactRange(range.options, range.first_key, range.last_key);
+    }
+  } catch (boost::thread_interrupted&) {
+  }
+}
+
+} // namespace lockbox
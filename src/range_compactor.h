@@ -0,0 +1,73 @@
+// Compacts key ranges of the server's tables on a background thread, so that
+// the request that left a run of tombstones behind need not wait for it.
+//
+// Ranges queued under the same group of the same table while one waits are
+// merged into one covering them all, and at most one range is compacted per
+// interval, so a burst of deletes costs a bounded amount of compaction.
+//
+//  lockbox::RangeCompactor compactor(&manager, 1000 /* interval ms */);
+//  compactor.Start();
+//  compactor.Add(options, device, first_key, last_key);
+
+#pragma once
+
+#if defined(OS_MACOSX)
+#define BOOST_NO_CXX11_NUMERIC_LIMITS 1
+#endif
+
+#include <boost/thread/thread.hpp>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/memory/scoped_ptr.h"
+#include "db_manager.h"
+
+using std::map;
+using std::mutex;
+using std::string;
+
+namespace lockbox {
+
+class RangeCompactor {
+ public:
+  // Does not take ownership of |manager|. Compacts at most one range every
+  // |interval_ms|.
+  RangeCompactor(DBManager* manager, int interval_ms);
+
+  ~RangeCompactor();
+
+  // Starts compacting queued ranges on a background thread.
+  void Start();
+
+  // Queues the keys from |first_key| through |last_key| of the table of
+  // |options| for compaction, widening the range already queued under |group|
+  // of that table, if any.
+  void Add(const DBManager::Options& options, const string& group,
+           const string& first_key, const string& last_key);
+
+ private:
+  struct Range {
+    DBManager::Options options;
+    string first_key;
+    string last_key;
+  };
+
+  void Loop();
+
+  DBManager* manager_;
+  const int interval_ms_;
+
+  // Guards |pending_|.
+  mutex mutex_;
+
+  // Queued ranges by table and group.
+  map<string, Range> pending_;
+
+  scoped_ptr<boost::thread> thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(RangeCompactor);
+};
+
+} // namespace lockbox
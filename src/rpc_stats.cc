@@ -0,0 +1,152 @@
+#include "rpc_stats.h"
+
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/metrics/histogram.h"
+#include "base/metrics/histogram_samples.h"
+#include "base/metrics/statistics_recorder.h"
+#include "base/stringprintf.h"
+#include "base/time.h"
+#include "timed_thread_manager.h"
+#include "trace.h"
+
+using base::Histogram;
+using base::HistogramBase;
+using base::HistogramSamples;
+using base::SampleCountIterator;
+using base::StatisticsRecorder;
+
+namespace lockbox {
+
+namespace {
+
+const char kHistogramPrefix[] = "Lockbox.Rpc.";
+
+// Long polls park for up to a minute.
+const HistogramBase::Sample kMaxMicros = 120 * 1000 * 1000;
+const HistogramBase::Sample kMaxBytes = 64 << 20;
+const size_t kBuckets = 50;
+
+HistogramBase* Get(const string& method, const char* name,
+                   HistogramBase::Sample max) {
+  return Histogram::FactoryGet(kHistogramPrefix + method + "." + name, 1, max,
+                               kBuckets, HistogramBase::kNoFlags);
+}
+
+// Upper bound of the bucket holding the |fraction| quantile of |samples|.
+HistogramBase::Sample Quantile(const HistogramSamples& samples,
+                               double fraction) {
+  const int64_t target = samples.TotalCount() * fraction;
+  int64_t seen = 0;
+  HistogramBase::Sample max = 0;
+  for (scoped_ptr<SampleCountIterator> it(samples.Iterator()); !it->Done();
+       it->Next()) {
+    HistogramBase::Count count = 0;
+    it->Get(NULL, &max, &count);
+    seen += count;
+    if (seen > target) {
+      break;
+    }
+  }
+  return max;
+}
+
+} // namespace
+
+struct RpcStats::Call {
+  const Histograms* histograms;
+  base::TimeTicks started;
+  int64_t queue_micros;
+  uint32_t bytes_in;
+  uint32_t bytes_out;
+  bool failed;
+};
+
+RpcStats::RpcStats() {
+}
+
+RpcStats::~RpcStats() {
+}
+
+void* RpcStats::getContext(const char* fn_name, void* server_context) {
+  Trace::BeginRequest();
+  Call* call = new Call;
+  call->histograms = ForMethod(fn_name);
+  call->started = base::TimeTicks::Now();
+  call->queue_micros = TimedThreadManager::TakeQueueMicros();
+  call->bytes_in = 0;
+  call->bytes_out = 0;
+  call->failed = false;
+  call->histograms->queue_micros->Add(call->queue_micros);
+  return call;
+}
+
+void RpcStats::freeContext(void* ctx, const char* fn_name) {
+  Call* call = static_cast<Call*>(ctx);
+  const int64_t service_micros =
+      (base::TimeTicks::Now() - call->started).InMicroseconds();
+  call->histograms->service_micros->Add(service_micros);
+  call->histograms->failed->Add(call->failed);
+  TRACE(1) << "rpc=" << fn_name << " queue_us=" << call->queue_micros
+           << " service_us=" << service_micros << " in=" << call->bytes_in
+           << " out=" << call->bytes_out << " failed=" << call->failed;
+  Trace::EndRequest();
+  delete call;
+}
+
+void RpcStats::postRead(void* ctx, const char* fn_name, uint32_t bytes) {
+  Call* call = static_cast<Call*>(ctx);
+  call->bytes_in = bytes;
+  call->histograms->bytes_in->Add(bytes);
+}
+
+void RpcStats::postWrite(void* ctx, const char* fn_name, uint32_t bytes) {
+  Call* call = static_cast<Call*>(ctx);
+  call->bytes_out = bytes;
+  call->histograms->bytes_out->Add(bytes);
+}
+
+void RpcStats::handlerError(void* ctx, const char* fn_name) {
+  static_cast<Call*>(ctx)->failed = true;
+}
+
+// static
+void RpcStats::Dump(const string& method_prefix, string* out) {
+  CHECK(out);
+  const string query = kHistogramPrefix + method_prefix;
+  StatisticsRecorder::Histograms histograms;
+  StatisticsRecorder::GetSnapshot(query, &histograms);
+  for (const HistogramBase* histogram : histograms) {
+    scoped_ptr<HistogramSamples> samples(histogram->SnapshotSamples());
+    const int64_t count = samples->TotalCount();
+    if (count == 0) {
+      continue;
+    }
+    base::StringAppendF(
+        out, "%s count=%lld mean=%lld p50<%d p99<%d\n",
+        histogram->histogram_name().c_str(), static_cast<long long>(count),
+        static_cast<long long>(samples->sum() / count),
+        Quantile(*samples, 0.5), Quantile(*samples, 0.99));
+  }
+  StatisticsRecorder::WriteGraph(query, out);
+}
+
+const RpcStats::Histograms* RpcStats::ForMethod(const char* fn_name) {
+  std::lock_guard<mutex> lock(mutex_);
+  auto iter = methods_.find(fn_name);
+  if (iter != methods_.end()) {
+    return &(iter->second);
+  }
+
+  const string method(fn_name);
+  Histograms& histograms = methods_[method];
+  histograms.queue_micros = Get(method, "QueueMicros", kMaxMicros);
+  histograms.service_micros = Get(method, "ServiceMicros", kMaxMicros);
+  histograms.bytes_in = Get(method, "BytesIn", kMaxBytes);
+  histograms.bytes_out = Get(method, "BytesOut", kMaxBytes);
+  histograms.failed = base::BooleanHistogram::FactoryGet(
+      kHistogramPrefix + method + ".Failed", HistogramBase::kNoFlags);
+  return &histograms;
+}
+
+} // namespace lockbox
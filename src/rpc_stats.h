@@ -0,0 +1,72 @@
+// Per-method latency and size histograms for the Thrift server.
+//
+// Installed as the processor's event handler, it times every call from the
+// moment a worker starts on it until the reply is written, and charges it the
+// time its task spent queued for a worker as reported by TimedThreadManager.
+// Each method gets base/metrics histograms named
+//
+//   Lockbox.Rpc.METHOD.{QueueMicros,ServiceMicros,BytesIn,BytesOut,Failed}
+//
+// so that they can be read back through StatisticsRecorder, e.g. with Dump().
+//
+//  base::StatisticsRecorder::Initialize();
+//  shared_ptr<lockbox::RpcStats> stats(new lockbox::RpcStats());
+//  processor->setEventHandler(stats);
+//  ...
+//  string report;
+//  lockbox::RpcStats::Dump("", &report);
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <thrift/TProcessor.h>
+
+#include "base/basictypes.h"
+#include "base/metrics/histogram_base.h"
+
+using std::map;
+using std::mutex;
+using std::string;
+
+namespace lockbox {
+
+class RpcStats : public apache::thrift::TProcessorEventHandler {
+ public:
+  RpcStats();
+
+  virtual ~RpcStats();
+
+  virtual void* getContext(const char* fn_name, void* server_context);
+  virtual void freeContext(void* ctx, const char* fn_name);
+  virtual void postRead(void* ctx, const char* fn_name, uint32_t bytes);
+  virtual void postWrite(void* ctx, const char* fn_name, uint32_t bytes);
+  virtual void handlerError(void* ctx, const char* fn_name);
+
+  // Appends to |out| the count, mean, p50 and p99 of every RPC histogram whose
+  // method name starts with |method_prefix|, followed by their bucket graphs.
+  static void Dump(const string& method_prefix, string* out);
+
+ private:
+  struct Histograms {
+    base::HistogramBase* queue_micros;
+    base::HistogramBase* service_micros;
+    base::HistogramBase* bytes_in;
+    base::HistogramBase* bytes_out;
+    base::HistogramBase* failed;
+  };
+
+  struct Call;
+
+  // Histograms for |fn_name|, created on its first call.
+  const Histograms* ForMethod(const char* fn_name);
+
+  mutex mutex_;
+  map<string, Histograms> methods_;
+
+  DISALLOW_COPY_AND_ASSIGN(RpcStats);
+};
+
+} // namespace lockbox
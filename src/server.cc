@@ -2,20 +2,39 @@
 
 #include "lockbox_service_handler.h"
 
+#include <algorithm>
+#include <csignal>
 #include <ctime>
 
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
 #include <thrift/server/TSimpleServer.h>
 #include <thrift/transport/TServerSocket.h>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/concurrency/ThreadManager.h>
 #include <thrift/concurrency/PosixThreadFactory.h>
 #include <thrift/server/TNonblockingServer.h>
+#include "blob_log.h"
 #include "counter.h"
 #include "db_manager_server.h"
+#include "device_notifier.h"
+#include "download_server.h"
+#include "notify_server.h"
+#include "package_gc.h"
+#include "range_compactor.h"
+#include "package_store.h"
+#include "rpc_stats.h"
+#include "timed_thread_manager.h"
+#include "trace.h"
+#include "top_dir_device_cache.h"
+#include "update_queue.h"
 #include "update_queuer.h"
 
+#include "base/files/file_path.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/metrics/statistics_recorder.h"
 #include "crypto/random.h"
+#include "gflags/gflags.h"
 #include "guid_creator.h"
 
 using namespace ::apache::thrift;
@@ -27,11 +46,115 @@ using apache::thrift::concurrency::ThreadManager;
 using apache::thrift::concurrency::PosixThreadFactory;
 using boost::shared_ptr;
 
+DEFINE_int32(db_shards, 0,
+             "Number of shared databases holding all tables. 0 opens one "
+             "database per table.");
+DEFINE_int32(db_block_cache_mb, 8,
+             "Block cache shared by all databases, in MB.");
+DEFINE_int32(db_write_buffer_mb, 16,
+             "Memtable budget split across the database shards, in MB.");
+DEFINE_int32(update_queuers, 1,
+             "Worker threads fanning uploaded updates out to devices.");
+DEFINE_int32(update_partitions, 64,
+             "Partitions of the update queue. Each top dir's updates stay in "
+             "one partition, which one worker drains at a time.");
+DEFINE_int32(max_parked_polls, 0,
+             "Most WaitForUpdates requests parked at once, each holding a "
+             "worker thread. 0 allows half of the worker threads. Clients "
+             "that wait on --notify_port park nothing.");
+DEFINE_int32(db_max_open_tables, 0,
+             "Without shards, the most top dir databases to keep open. They "
+             "open on first use and the least recently used close first. 0 "
+             "opens them all at startup.");
+
+DEFINE_int32(io_threads, 1,
+             "Threads reading and writing client connections. Connections are "
+             "spread across them.");
+DEFINE_int32(max_pending_tasks, 0,
+             "Most requests waiting for a worker thread. Past it, the I/O "
+             "threads stop reading requests and new connections are closed. 0 "
+             "does not bound the queue.");
+DEFINE_int32(max_connections, 0,
+             "Most open client connections. 0 does not limit them.");
+DEFINE_bool(compact_protocol, false,
+            "Speak TCompactProtocol instead of TBinaryProtocol. Clients must "
+            "be started with the same setting.");
+DEFINE_int32(rpc_stats_log_seconds, 60,
+             "How often to log per-method call counts, latencies and sizes. 0 "
+             "only logs them on SIGUSR1.");
+DEFINE_int32(trace_level, 0,
+             "Trace request handling: 1 logs a line per request, 2 adds "
+             "per-key detail. 0 traces nothing.");
+DEFINE_int32(trace_sample, 100,
+             "Trace one of every this many requests.");
+DEFINE_int32(blob_min_kb, 0,
+             "Chunks of at least this many KB are kept in an append-only blob "
+             "log rather than in leveldb. 0 keeps every chunk in leveldb.");
+DEFINE_int32(blob_segment_mb, 256,
+             "Size at which the blob log starts a new segment file.");
+DEFINE_int32(download_port, 0,
+             "Port of the side channel that streams payloads to clients with "
+             "sendfile. 0 serves downloads through Thrift only.");
+DEFINE_int32(download_threads, 8,
+             "Downloads streamed from the side channel at a time.");
+DEFINE_int32(notify_port, 0,
+             "Port of the side channel that announces updates to clients "
+             "without holding a worker thread per client. 0 leaves clients "
+             "to park WaitForUpdates requests.");
+DEFINE_int32(notify_max_connections, 10000,
+             "Most clients waiting on the notify side channel at once.");
+DEFINE_bool(chunk_whole_packages, true,
+            "On startup, chunk in the background the packages that older "
+            "servers stored whole.");
+DEFINE_int32(gc_interval_minutes, 0,
+             "How often to garbage collect old package versions. 0 never "
+             "collects.");
+DEFINE_int32(gc_keep_versions, 0,
+             "Newest versions of each file kept by the collector. 0 keeps all "
+             "of them unless --gc_keep_days is set.");
+DEFINE_int32(gc_keep_days, 0,
+             "Versions uploaded in the last this many days are kept by the "
+             "collector.");
+DEFINE_int32(gc_update_log_days, 30,
+             "Update log entries older than this many days are collected. 0 "
+             "keeps the log.");
+DEFINE_int32(gc_duty_percent, 10,
+             "Share of one thread's time the collector may use while it runs.");
+DEFINE_int32(compact_interval_ms, 1000,
+             "Least time between the background compactions of acknowledged "
+             "update ranges.");
+
 namespace lockbox {
 
+void LogRpcStats() {
+  string report;
+  RpcStats::Dump("", &report);
+  LOG(INFO) << "RPC stats:\n" << report;
+}
+
+void LogRpcStatsPeriodically() {
+  while (true) {
+    sleep(FLAGS_rpc_stats_log_seconds);
+    LogRpcStats();
+  }
+}
+
+// Logs the RPC stats whenever the process receives SIGUSR1, which every other
+// thread must have blocked.
+void LogRpcStatsOnSignal() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  int signal = 0;
+  while (sigwait(&signals, &signal) == 0) {
+    LogRpcStats();
+  }
+}
+
 } // namespace lockbox
 
 int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
   if (argc != 3) {
     std::cerr << "Please check code for usage." << std::endl;
     return 1;
@@ -39,28 +162,104 @@ int main(int argc, char **argv) {
 
   lockbox::Counter counter;
 
+  // Threads inherit the mask, so SIGUSR1 only reaches the stats thread.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  CHECK_EQ(pthread_sigmask(SIG_BLOCK, &signals, NULL), 0);
+  base::StatisticsRecorder::Initialize();
+  lockbox::Trace::Configure(FLAGS_trace_level, FLAGS_trace_sample);
+  boost::thread(boost::bind(&lockbox::LogRpcStatsOnSignal));
+
   const int port = atoi(argv[1]);
   const int num_threads = atoi(argv[2]);
 
-  lockbox::Sync sync;
-  lockbox::DBManagerServer manager("/tmp");
+  lockbox::DBManager::StoreOptions store_options;
+  store_options.shards = FLAGS_db_shards;
+  store_options.block_cache_bytes = FLAGS_db_block_cache_mb * (1LL << 20);
+  store_options.write_buffer_bytes = FLAGS_db_write_buffer_mb * (1LL << 20);
+  store_options.max_open_tables = FLAGS_db_max_open_tables;
+  lockbox::DBManagerServer manager("/tmp", store_options);
+
+  // Updates left over from the last run go out before any new ones.
+  lockbox::UpdateQueue update_queue(&manager, FLAGS_update_partitions);
+  update_queue.Recover();
 
   // Thread pool of watchers that will pick off the queued results and send them
   // to the appropriate fillers.
-  lockbox::UpdateQueuer update_queue(&manager, &sync);
-  // TODO(tierney): Can loop over this Increment() call in order to start
-  // multiple queue helpers.
-  update_queue.Increment();
+  lockbox::TopDirDeviceCache device_cache(&manager);
+  lockbox::DeviceNotifier notifier(FLAGS_max_parked_polls > 0 ?
+                                   FLAGS_max_parked_polls :
+                                   std::max(1, num_threads / 2));
+  lockbox::UpdateQueuer update_queuer(&manager, &update_queue, &device_cache,
+                                      &notifier);
+  for (int i = 0; i < FLAGS_update_queuers; ++i) {
+    update_queuer.Increment();
+  }
+
+  scoped_ptr<lockbox::BlobLog> blobs;
+  if (FLAGS_blob_min_kb > 0) {
+    blobs.reset(new lockbox::BlobLog(base::FilePath("/tmp/BLOBS"),
+                                     FLAGS_blob_segment_mb * (1LL << 20),
+                                     FLAGS_blob_min_kb * (1LL << 10)));
+    CHECK(blobs->Open());
+  }
+  lockbox::PackageStore store(&manager, blobs.get());
+  if (FLAGS_chunk_whole_packages) {
+    boost::thread(boost::bind(&lockbox::PackageStore::ChunkWholePackages,
+                              &store));
+  }
+  lockbox::PackageGC::Policy gc_policy;
+  gc_policy.keep_versions = FLAGS_gc_keep_versions;
+  gc_policy.keep_days = FLAGS_gc_keep_days;
+  gc_policy.update_log_days = FLAGS_gc_update_log_days;
+  lockbox::PackageGC gc(&manager, &store, gc_policy, FLAGS_gc_duty_percent);
+  if (FLAGS_gc_interval_minutes > 0) {
+    gc.Start(FLAGS_gc_interval_minutes * 60);
+  }
+
+  scoped_ptr<lockbox::DownloadServer> downloads;
+  if (FLAGS_download_port > 0) {
+    downloads.reset(new lockbox::DownloadServer(&store, FLAGS_download_port,
+                                                FLAGS_download_threads));
+    CHECK(downloads->Start());
+  }
+
+  scoped_ptr<lockbox::NotifyServer> notifications;
+  if (FLAGS_notify_port > 0) {
+    notifications.reset(new lockbox::NotifyServer(
+        &notifier, FLAGS_notify_port, FLAGS_notify_max_connections));
+    CHECK(notifications->Start());
+  }
+
+  lockbox::RangeCompactor compactor(&manager, FLAGS_compact_interval_ms);
+  compactor.Start();
 
   shared_ptr<lockbox::LockboxServiceHandler> handler(
-      new lockbox::LockboxServiceHandler(&manager, &sync));
+      new lockbox::LockboxServiceHandler(&manager, &store, &update_queue,
+                                         &device_cache, &notifier,
+                                         downloads.get(),
+                                         notifications.get(), &compactor));
   shared_ptr<TProcessor> processor(
       new lockbox::LockboxServiceProcessor(handler));
-  shared_ptr<TProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
+  shared_ptr<lockbox::RpcStats> rpc_stats(new lockbox::RpcStats());
+  processor->setEventHandler(rpc_stats);
+  if (FLAGS_rpc_stats_log_seconds > 0) {
+    boost::thread(boost::bind(&lockbox::LogRpcStatsPeriodically));
+  }
+
+  shared_ptr<TProtocolFactory> protocolFactory;
+  if (FLAGS_compact_protocol) {
+    protocolFactory.reset(new TCompactProtocolFactory());
+  } else {
+    protocolFactory.reset(new TBinaryProtocolFactory());
+  }
 
-  // Setup for the server that instantiates |num_threads| to handle requests.
-  shared_ptr<ThreadManager> threadManager =
-      ThreadManager::newSimpleThreadManager(num_threads);
+  // Setup for the server that instantiates |num_threads| to handle requests,
+  // with at most --max_pending_tasks waiting for one of them.
+  shared_ptr<ThreadManager> threadManager(new lockbox::TimedThreadManager(
+      ThreadManager::newSimpleThreadManager(num_threads,
+                                            FLAGS_max_pending_tasks)));
 
   shared_ptr<PosixThreadFactory> threadFactory =
       shared_ptr<PosixThreadFactory>(new PosixThreadFactory());
@@ -68,6 +267,13 @@ int main(int argc, char **argv) {
   threadManager->threadFactory(threadFactory);
   threadManager->start();
   TNonblockingServer server(processor, protocolFactory, port, threadManager);
+  server.setNumIOThreads(FLAGS_io_threads);
+  if (FLAGS_max_connections > 0) {
+    server.setMaxConnections(FLAGS_max_connections);
+  }
+  if (FLAGS_max_connections > 0 || FLAGS_max_pending_tasks > 0) {
+    server.setOverloadAction(T_OVERLOAD_CLOSE_ON_ACCEPT);
+  }
   server.serve();
   return 0;
 }
@@ -0,0 +1,141 @@
+#include "timed_thread_manager.h"
+
+#include <boost/pointer_cast.hpp>
+
+#include "base/logging.h"
+#include "base/time.h"
+
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::ThreadFactory;
+using boost::shared_ptr;
+
+namespace lockbox {
+
+namespace {
+
+thread_local int64_t queue_micros = 0;
+
+} // namespace
+
+class TimedThreadManager::TimedTask : public Runnable {
+ public:
+  explicit TimedTask(shared_ptr<Runnable> task)
+      : task_(task), queued_(base::TimeTicks::Now()) {
+  }
+
+  virtual void run() {
+    queue_micros = (base::TimeTicks::Now() - queued_).InMicroseconds();
+    task_->run();
+    queue_micros = 0;
+  }
+
+  shared_ptr<Runnable> task() const { return task_; }
+
+ private:
+  shared_ptr<Runnable> task_;
+  const base::TimeTicks queued_;
+};
+
+TimedThreadManager::TimedThreadManager(shared_ptr<ThreadManager> impl)
+    : impl_(impl) {
+  CHECK(impl);
+}
+
+TimedThreadManager::~TimedThreadManager() {
+}
+
+// static
+int64_t TimedThreadManager::TakeQueueMicros() {
+  const int64_t micros = queue_micros;
+  queue_micros = 0;
+  return micros;
+}
+
+void TimedThreadManager::start() {
+  impl_->start();
+}
+
+void TimedThreadManager::stop() {
+  impl_->stop();
+}
+
+void TimedThreadManager::join() {
+  impl_->join();
+}
+
+const TimedThreadManager::STATE TimedThreadManager::state() const {
+  return impl_->state();
+}
+
+shared_ptr<ThreadFactory> TimedThreadManager::threadFactory() const {
+  return impl_->threadFactory();
+}
+
+void TimedThreadManager::threadFactory(shared_ptr<ThreadFactory> value) {
+  impl_->threadFactory(value);
+}
+
+void TimedThreadManager::addWorker(size_t value) {
+  impl_->addWorker(value);
+}
+
+void TimedThreadManager::removeWorker(size_t value) {
+  impl_->removeWorker(value);
+}
+
+size_t TimedThreadManager::idleWorkerCount() const {
+  return impl_->idleWorkerCount();
+}
+
+size_t TimedThreadManager::workerCount() const {
+  return impl_->workerCount();
+}
+
+size_t TimedThreadManager::pendingTaskCount() const {
+  return impl_->pendingTaskCount();
+}
+
+size_t TimedThreadManager::totalTaskCount() const {
+  return impl_->totalTaskCount();
+}
+
+size_t TimedThreadManager::pendingTaskCountMax() const {
+  return impl_->pendingTaskCountMax();
+}
+
+size_t TimedThreadManager::expiredTaskCount() {
+  return impl_->expiredTaskCount();
+}
+
+void TimedThreadManager::add(shared_ptr<Runnable> task, int64_t timeout,
+                             int64_t expiration) {
+  impl_->add(shared_ptr<Runnable>(new TimedTask(task)), timeout, expiration);
+}
+
+void TimedThreadManager::remove(shared_ptr<Runnable> task) {
+  // The queued copy is the wrapper, which the caller never saw. Nothing in the
+  // nonblocking server removes tasks this way.
+  impl_->remove(task);
+}
+
+shared_ptr<Runnable> TimedThreadManager::removeNextPending() {
+  return Unwrap(impl_->removeNextPending());
+}
+
+void TimedThreadManager::removeExpiredTasks() {
+  impl_->removeExpiredTasks();
+}
+
+void TimedThreadManager::setExpireCallback(ExpireCallback expire_callback) {
+  impl_->setExpireCallback([expire_callback](shared_ptr<Runnable> task) {
+    expire_callback(Unwrap(task));
+  });
+}
+
+// static
+shared_ptr<Runnable> TimedThreadManager::Unwrap(shared_ptr<Runnable> runnable) {
+  shared_ptr<TimedTask> timed = boost::dynamic_pointer_cast<TimedTask>(runnable);
+  return timed ? timed->task() : runnable;
+}
+
+} // namespace lockbox
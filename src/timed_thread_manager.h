@@ -0,0 +1,67 @@
+// ThreadManager that remembers how long each task waited for a worker.
+//
+// Wraps another ThreadManager and stamps every task handed to add(). When a
+// worker picks the task up, the wait is made available to that worker thread
+// through TakeQueueMicros(), e.g. for RpcStats to charge it to the RPC the task
+// runs.
+//
+//  shared_ptr<ThreadManager> thread_manager(new lockbox::TimedThreadManager(
+//      ThreadManager::newSimpleThreadManager(num_threads, max_pending)));
+
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include <thrift/concurrency/ThreadManager.h>
+
+#include "base/basictypes.h"
+
+namespace lockbox {
+
+class TimedThreadManager : public apache::thrift::concurrency::ThreadManager {
+ public:
+  typedef apache::thrift::concurrency::Runnable Runnable;
+  typedef apache::thrift::concurrency::ThreadFactory ThreadFactory;
+
+  explicit TimedThreadManager(boost::shared_ptr<ThreadManager> impl);
+
+  virtual ~TimedThreadManager();
+
+  // Microseconds the task running on the calling thread spent queued. Returns 0
+  // when called again for the same task.
+  static int64_t TakeQueueMicros();
+
+  virtual void start();
+  virtual void stop();
+  virtual void join();
+  virtual const STATE state() const;
+  virtual boost::shared_ptr<ThreadFactory> threadFactory() const;
+  virtual void threadFactory(boost::shared_ptr<ThreadFactory> value);
+  virtual void addWorker(size_t value);
+  virtual void removeWorker(size_t value);
+  virtual size_t idleWorkerCount() const;
+  virtual size_t workerCount() const;
+  virtual size_t pendingTaskCount() const;
+  virtual size_t totalTaskCount() const;
+  virtual size_t pendingTaskCountMax() const;
+  virtual size_t expiredTaskCount();
+  virtual void add(boost::shared_ptr<Runnable> task, int64_t timeout,
+                   int64_t expiration);
+  virtual void remove(boost::shared_ptr<Runnable> task);
+  virtual boost::shared_ptr<Runnable> removeNextPending();
+  virtual void removeExpiredTasks();
+  virtual void setExpireCallback(ExpireCallback expire_callback);
+
+ private:
+  class TimedTask;
+
+  // Returns the task |runnable| wraps, so that callers such as
+  // TNonblockingServer get back the tasks they added.
+  static boost::shared_ptr<Runnable> Unwrap(
+      boost::shared_ptr<Runnable> runnable);
+
+  boost::shared_ptr<ThreadManager> impl_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimedThreadManager);
+};
+
+} // namespace lockbox
@@ -0,0 +1,78 @@
+#include "top_dir_device_cache.h"
+
+#include "base/logging.h"
+#include "scoped_mutex.h"
+
+namespace lockbox {
+
+TopDirDeviceCache::TopDirDeviceCache(DBManagerServer* dbm)
+    : dbm_(dbm), generation_(0) {
+  CHECK(dbm);
+}
+
+TopDirDeviceCache::~TopDirDeviceCache() {
+}
+
+void TopDirDeviceCache::GetDevices(const string& top_dir,
+                                   vector<string>* devices) {
+  CHECK(devices);
+  uint64_t generation = 0;
+  {
+    ScopedMutexLock lock(&mutex_);
+    auto iter = devices_.find(top_dir);
+    if (iter != devices_.end()) {
+      *devices = iter->second;
+      return;
+    }
+    generation = generation_;
+  }
+
+  Resolve(top_dir, devices);
+
+  ScopedMutexLock lock(&mutex_);
+  if (generation == generation_) {
+    devices_[top_dir] = *devices;
+  }
+}
+
+void TopDirDeviceCache::Invalidate(const string& top_dir) {
+  ScopedMutexLock lock(&mutex_);
+  devices_.erase(top_dir);
+  ++generation_;
+}
+
+void TopDirDeviceCache::InvalidateAll() {
+  ScopedMutexLock lock(&mutex_);
+  devices_.clear();
+  ++generation_;
+}
+
+void TopDirDeviceCache::Resolve(const string& top_dir,
+                                vector<string>* devices) {
+  devices->clear();
+
+  // Iterate through the EDITORS.
+  vector<string> emails;
+  CHECK(dbm_->GetList(DBManager::Options(ServerDB::TOP_DIR_META, top_dir),
+                      "EDITORS", &emails));
+
+  vector<string> user_ids;
+  for (const string& email : emails) {
+    string user_id;
+    CHECK(dbm_->Get(
+        DBManager::Options(ServerDB::EMAIL_USER, ""), email, &user_id))
+        << email;
+    user_ids.push_back(user_id);
+  }
+
+  // USER_DEVICE
+  for (const string& user : user_ids) {
+    vector<string> user_devices;
+    CHECK(dbm_->GetList(DBManager::Options(ServerDB::USER_DEVICE, ""), user,
+                        &user_devices))
+        << user << " not in USER_DEVICE";
+    devices->insert(devices->end(), user_devices.begin(), user_devices.end());
+  }
+}
+
+} // namespace lockbox
@@ -0,0 +1,57 @@
+// Cache from a top dir to the devices of everyone who can edit it, which is
+// what update fan-out needs for every upload.
+//
+// Resolving it from the databases takes a scan of the top dir's EDITORS, an
+// EMAIL_USER lookup per editor and a USER_DEVICE scan per user. Anything that
+// changes the editors or their devices must call Invalidate() or
+// InvalidateAll() after writing the change.
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "db_manager_server.h"
+
+using std::map;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace lockbox {
+
+class TopDirDeviceCache {
+ public:
+  // Does not take ownership of |dbm|.
+  explicit TopDirDeviceCache(DBManagerServer* dbm);
+
+  ~TopDirDeviceCache();
+
+  // Sets |devices| to every device of every editor of |top_dir|.
+  void GetDevices(const string& top_dir, vector<string>* devices);
+
+  // Drops what is cached for |top_dir|, e.g. after its editors change.
+  void Invalidate(const string& top_dir);
+
+  // Drops everything, e.g. after a user gains a device.
+  void InvalidateAll();
+
+ private:
+  void Resolve(const string& top_dir, vector<string>* devices);
+
+  DBManagerServer* dbm_;
+
+  mutex mutex_;
+  map<string, vector<string> > devices_;
+
+  // Bumped by every invalidation so that a lookup that read the databases
+  // before a change does not cache what it read.
+  uint64_t generation_;
+
+  DISALLOW_COPY_AND_ASSIGN(TopDirDeviceCache);
+};
+
+} // namespace lockbox
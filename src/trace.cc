@@ -0,0 +1,32 @@
+#include "trace.h"
+
+namespace lockbox {
+
+std::atomic<int> Trace::level_(0);
+std::atomic<int> Trace::sample_every_(1);
+std::atomic<uint64_t> Trace::requests_(0);
+thread_local bool Trace::sampled_ = true;
+
+// static
+void Trace::Configure(int level, int sample_every) {
+  CHECK_GT(sample_every, 0);
+  level_.store(level);
+  sample_every_.store(sample_every);
+}
+
+// static
+void Trace::BeginRequest() {
+  if (level_.load(std::memory_order_relaxed) == 0) {
+    sampled_ = false;
+    return;
+  }
+  sampled_ = requests_.fetch_add(1, std::memory_order_relaxed) %
+      sample_every_.load(std::memory_order_relaxed) == 0;
+}
+
+// static
+void Trace::EndRequest() {
+  sampled_ = true;
+}
+
+} // namespace lockbox
@@ -0,0 +1,55 @@
+// Level-gated, sampled diagnostics for request handling.
+//
+// TRACE(level) streams to the INFO log like LOG(INFO), but only if |level| is
+// at or below the configured level and, on a thread serving a request, only if
+// that request was sampled. Otherwise nothing after TRACE(level) is evaluated,
+// so traces cost a couple of loads when off and may format freely when on.
+//
+//   1  One line per request.
+//   2  Per-key detail within a request.
+//
+//  lockbox::Trace::Configure(1, 100);  // Level 1 for every 100th request.
+//  ...
+//  lockbox::Trace::BeginRequest();
+//  TRACE(2) << "Appending " << key;
+//  lockbox::Trace::EndRequest();
+
+#pragma once
+
+#include <atomic>
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+
+#define TRACE(level) \
+  LAZY_STREAM(LOG_STREAM(INFO), ::lockbox::Trace::IsOn(level))
+
+namespace lockbox {
+
+class Trace {
+ public:
+  // Traces up to |level|, 0 turning tracing off, in one of every
+  // |sample_every| requests. Threads outside requests always trace up to
+  // |level|.
+  static void Configure(int level, int sample_every);
+
+  // Decides whether the request the calling thread is starting is sampled.
+  static void BeginRequest();
+
+  // Marks the calling thread as outside of any request again.
+  static void EndRequest();
+
+  static bool IsOn(int level) {
+    return level <= level_.load(std::memory_order_relaxed) && sampled_;
+  }
+
+ private:
+  static std::atomic<int> level_;
+  static std::atomic<int> sample_every_;
+  static std::atomic<uint64_t> requests_;
+  static thread_local bool sampled_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(Trace);
+};
+
+} // namespace lockbox
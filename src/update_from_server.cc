@@ -1,16 +1,34 @@
 #include "update_from_server.h"
 
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
 #include <chrono>
 #include <functional>
+#include <set>
 
 #include "LockboxService.h"
 #include "lockbox_types.h"
+#include "base/posix/eintr_wrapper.h"
 #include "base/strings/string_split.h"
 
 using std::bind;
+using std::set;
 
 namespace lockbox {
 
+namespace {
+
+// How long the server may hold a request for the first page of updates.
+const int32_t kUpdateWaitMs = 30 * 1000;
+
+// Updates requested per page.
+const int32_t kUpdatePageSize = 256;
+
+} // namespace
+
 UpdateFromServer::UpdateFromServer(UserAuth* user_auth,
                                    Client* client,
                                    DBManagerClient* dbm)
@@ -25,24 +43,53 @@ UpdateFromServer::~UpdateFromServer() {
 }
 
 void UpdateFromServer::Run() {
+  // Servers without the notify side channel, older ones included, hold the
+  // first page request instead.
+  int32_t notify_port = 0;
+  try {
+    notify_port = client_->Exec<int32_t, const UserAuth&>(
+        &LockboxServiceClient::GetNotifyPort, *user_auth_);
+  } catch (std::exception& e) {
+    LOG(WARNING) << "No notify side channel: " << e.what();
+  }
+  int notify_fd = -1;
+
+  string cursor;
   while (true) {
     // Format of UpdateList.updates (underscore-separated):
     // 1367949789_1_25baec40-5a1f-108b-4ca31a19-3ab710a6_yUCJ/6CWfX2Uin3kzy6cZC7L9Wc=,1367949886_1_15d0b173-399d-714f-1006a1f4-36212573_EsrNz+zxVv3Zy3eXoElaeAHZWsk=
 
-    // Grab updates from the server.
-    UpdateMap updates;
+    const bool notified = cursor.empty() && notify_port > 0 &&
+        WaitForNotify(notify_port, &notify_fd);
+
+    // Grab a page of updates from the server. On the first page the server
+    // holds the request until there are updates or the wait runs out, unless
+    // the side channel did the waiting.
+    UpdatePage updates;
     try {
-      client_->Exec<void, UpdateMap&, const UserAuth&, const DeviceID&>(
-          &LockboxServiceClient::PollForUpdates, updates,
-          *user_auth_, user_auth_->device);
+      client_->Exec<void, UpdatePage&, const UserAuth&, const DeviceID&,
+                    const string&, int32_t, int32_t>(
+          &LockboxServiceClient::PollForUpdatesPage, updates,
+          *user_auth_, user_auth_->device, cursor, kUpdatePageSize,
+          cursor.empty() && !notified ? kUpdateWaitMs : 0);
     } catch (std::exception& e) {
       LOG(WARNING) << "Could not poll: " << e.what();
+      cursor.clear();
       sleep(7);
       continue;
     }
+
+    // Follow the cursor while there are more pages. After the last one start
+    // over, which also picks up anything appended behind the cursor.
+    cursor = updates.more ? updates.cursor : "";
     if (updates.updates.empty()) {
-      std::chrono::milliseconds dura(1000);
-      std::this_thread::sleep_for(dura);
+      // Also the answer when the server is too busy to park the request, so
+      // back off a little before asking again. Waiting on the side channel
+      // needs no back off.
+      if (!notified) {
+        std::chrono::milliseconds dura(1000);
+        std::this_thread::sleep_for(dura);
+      }
       continue;
     }
 
@@ -51,21 +98,79 @@ void UpdateFromServer::Run() {
     // Persist the updates.
     DBManagerClient::Options options;
     options.type = ClientDB::UPDATE_QUEUE_SERVER;
-    UpdateList updates_persisted;
+    DBManager::Batch batch(dbm_);
+    set<string> top_dirs;
     for (auto& update : updates.updates) {
       vector<string> update_params;
       base::SplitString(update.second, '_', &update_params);
       options.name = update_params[1];
+      top_dirs.insert(options.name);
 
-      dbm_->Append(options, update.second, "");
-      updates_persisted.updates.push_back(update.first);
+      batch.Append(options, update.second, "");
+    }
+    CHECK(dbm_->Write(&batch, true /* sync */));
+    for (const string& top_dir : top_dirs) {
+      dbm_->NotifyUpdateQueues(top_dir);
     }
 
-    // Delete the updates on the server.
-    client_->Exec<void, const UserAuth&, const DeviceID&, const UpdateList&>(
-        &LockboxServiceClient::PersistedUpdates,
-        *user_auth_, user_auth_->device, updates_persisted);
+    // Delete the updates on the server, as one range if nothing arrived in
+    // between since we polled.
+    const bool acknowledged =
+        client_->Exec<bool, const UserAuth&, const DeviceID&, const string&,
+                      const string&, int32_t>(
+            &LockboxServiceClient::PersistedUpdateRange,
+            *user_auth_, user_auth_->device, updates.updates.begin()->first,
+            updates.updates.rbegin()->first,
+            static_cast<int32_t>(updates.updates.size()));
+    if (!acknowledged) {
+      UpdateList updates_persisted;
+      for (auto& update : updates.updates) {
+        updates_persisted.updates.push_back(update.first);
+      }
+      client_->Exec<void, const UserAuth&, const DeviceID&, const UpdateList&>(
+          &LockboxServiceClient::PersistedUpdates,
+          *user_auth_, user_auth_->device, updates_persisted);
+    }
+  }
+}
+
+bool UpdateFromServer::WaitForNotify(int port, int* notify_fd) {
+  if (*notify_fd < 0) {
+    *notify_fd = client_->ConnectSideChannel(port);
+    if (*notify_fd < 0) {
+      return false;
+    }
+    // The server answers once the device is registered, so the poll that
+    // answer triggers comes after registration and nothing falls in between.
+    const string request = user_auth_->device + "\n";
+    if (HANDLE_EINTR(send(*notify_fd, request.data(), request.size(),
+                          MSG_NOSIGNAL)) !=
+        static_cast<ssize_t>(request.size())) {
+      close(*notify_fd);
+      *notify_fd = -1;
+      return false;
+    }
+  }
+
+  // A timeout polls anyway, in case an announcement was lost.
+  struct pollfd notify = { *notify_fd, POLLIN, 0 };
+  if (HANDLE_EINTR(poll(&notify, 1, kUpdateWaitMs)) <= 0) {
+    return true;
+  }
+
+  // Several announcements call for one poll.
+  char buffer[64];
+  ssize_t count;
+  while ((count = HANDLE_EINTR(recv(*notify_fd, buffer, sizeof(buffer),
+                                    MSG_DONTWAIT))) > 0) {
+  }
+  if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    LOG(WARNING) << "Notify side channel closed";
+    close(*notify_fd);
+    *notify_fd = -1;
+    return false;
   }
+  return true;
 }
 
 } // namespace lockbox
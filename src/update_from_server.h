@@ -20,6 +20,11 @@ class UpdateFromServer {
   void Run();
 
  private:
+  // Waits on the server's notify side channel at |port|, connecting |notify_fd|
+  // to it first if it is -1, until updates are announced or a while passes.
+  // Returns false if the channel failed, and the server should do the waiting.
+  bool WaitForNotify(int port, int* notify_fd);
+
   thread* thread_;
 
   DeviceID device_id_;
@@ -0,0 +1,159 @@
+#include "update_queue.h"
+
+#include <algorithm>
+#include <functional>
+
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/stringprintf.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "leveldb/db.h"
+
+using std::min;
+
+namespace lockbox {
+
+namespace {
+
+// Zero-padded so that the durable queue iterates in arrival order.
+string QueueKey(int64_t sequence) {
+  return base::StringPrintf("%020lld", static_cast<long long>(sequence));
+}
+
+// Top dir of a ts_topdir_relpath_device_hash tuple.
+string TopDirOf(const string& tuple) {
+  vector<string> update;
+  base::SplitString(tuple, '_', &update);
+  CHECK(update.size() == 5) << tuple;
+  return update[1];
+}
+
+} // namespace
+
+UpdateQueue::UpdateQueue(DBManagerServer* dbm, int num_partitions)
+    : dbm_(dbm), partitions_(num_partitions), shutdown_(false) {
+  CHECK(dbm);
+  CHECK_GT(num_partitions, 0);
+}
+
+UpdateQueue::~UpdateQueue() {
+}
+
+void UpdateQueue::Recover() {
+  scoped_ptr<leveldb::Iterator> it(dbm_->NewIterator(
+      DBManager::Options(ServerDB::UPDATE_ACTION_QUEUE, "")));
+
+  boost::mutex::scoped_lock lock(mutex_);
+  int64_t max_sequence = 0;
+  size_t recovered = 0;
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    Entry entry;
+    entry.key = it->key().ToString();
+    entry.tuple = it->value().ToString();
+
+    // Older servers queued the tuple itself as the key.
+    int64_t sequence = 0;
+    if (entry.tuple.empty()) {
+      entry.tuple = entry.key;
+    } else if (base::StringToInt64(entry.key, &sequence)) {
+      max_sequence = std::max(max_sequence, sequence);
+    }
+    const int partition = PartitionFor(TopDirOf(entry.tuple));
+    partitions_[partition].entries.push_back(entry);
+    MaybeReady(partition);
+    ++recovered;
+  }
+  sequence_.Set(max_sequence);
+  LOG(INFO) << "Recovered " << recovered << " queued updates";
+}
+
+bool UpdateQueue::Enqueue(const string& top_dir, const string& tuple,
+                          DBManager::Batch* batch) {
+  CHECK(batch);
+  Entry entry;
+  entry.key = QueueKey(sequence_.Increment());
+  entry.tuple = tuple;
+  batch->Put(DBManager::Options(ServerDB::UPDATE_ACTION_QUEUE, ""),
+             entry.key, entry.tuple);
+  if (!dbm_->Write(batch, true /* sync */)) {
+    return false;
+  }
+
+  const int partition = PartitionFor(top_dir);
+  boost::mutex::scoped_lock lock(mutex_);
+  partitions_[partition].entries.push_back(entry);
+  MaybeReady(partition);
+  lock.unlock();
+  cv_.notify_one();
+  return true;
+}
+
+bool UpdateQueue::Pop(size_t max, int* partition, vector<Entry>* entries) {
+  CHECK(partition);
+  CHECK(entries);
+  entries->clear();
+
+  boost::mutex::scoped_lock lock(mutex_);
+  while (ready_.empty() && !shutdown_) {
+    cv_.wait(lock);
+  }
+  if (shutdown_) {
+    return false;
+  }
+
+  *partition = ready_.front();
+  ready_.pop_front();
+  Partition& p = partitions_[*partition];
+  p.ready = false;
+  p.owned = true;
+  const size_t count = min(max, p.entries.size());
+  entries->assign(p.entries.begin(), p.entries.begin() + count);
+  p.entries.erase(p.entries.begin(), p.entries.begin() + count);
+  return true;
+}
+
+void UpdateQueue::Done(const vector<Entry>& entries,
+                       DBManager::Batch* batch) {
+  CHECK(batch);
+  for (const Entry& entry : entries) {
+    batch->Put(DBManager::Options(ServerDB::UPDATE_ACTION_LOG, ""),
+               entry.tuple, "");
+    batch->Delete(DBManager::Options(ServerDB::UPDATE_ACTION_QUEUE, ""),
+                  entry.key);
+  }
+}
+
+void UpdateQueue::Release(int partition) {
+  boost::mutex::scoped_lock lock(mutex_);
+  CHECK(partitions_[partition].owned);
+  partitions_[partition].owned = false;
+  MaybeReady(partition);
+  const bool ready = !ready_.empty();
+  lock.unlock();
+  if (ready) {
+    cv_.notify_one();
+  }
+}
+
+void UpdateQueue::Shutdown() {
+  boost::mutex::scoped_lock lock(mutex_);
+  shutdown_ = true;
+  lock.unlock();
+  cv_.notify_all();
+}
+
+int UpdateQueue::PartitionFor(const string& top_dir) const {
+  return std::hash<string>()(top_dir) % partitions_.size();
+}
+
+void UpdateQueue::MaybeReady(int partition) {
+  Partition& p = partitions_[partition];
+  if (p.owned || p.ready || p.entries.empty()) {
+    return;
+  }
+  p.ready = true;
+  ready_.push_back(partition);
+}
+
+} // namespace lockbox
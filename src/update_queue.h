@@ -0,0 +1,121 @@
+// In-memory queue of uploaded updates waiting to be fanned out to devices.
+//
+// Every update is first written to UPDATE_ACTION_QUEUE, in the same batch as
+// the package pointers it announces, and only then handed to the workers, so a
+// restart loses nothing: Recover() reloads whatever was not yet fanned out.
+//
+// Updates are partitioned by top dir. A worker that pops from a partition owns
+// it until it calls Release(), so each top dir's updates are fanned out in
+// order while different top dirs proceed in parallel.
+//
+//  lockbox::UpdateQueue queue(&manager, 64);
+//  queue.Recover();
+//  queue.Enqueue(top_dir, tuple, &batch);
+//  ...
+//  int partition = 0;
+//  vector<lockbox::UpdateQueue::Entry> entries;
+//  while (queue.Pop(kMaxBatch, &partition, &entries)) {
+//    ...
+//    queue.Done(entries, &batch);
+//    manager.Write(&batch, true);
+//    queue.Release(partition);
+//  }
+
+#pragma once
+
+#if defined(OS_MACOSX)
+#define BOOST_NO_CXX11_NUMERIC_LIMITS 1
+#endif
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "counter.h"
+#include "db_manager_server.h"
+
+using std::deque;
+using std::string;
+using std::vector;
+
+namespace lockbox {
+
+class UpdateQueue {
+ public:
+  struct Entry {
+    // Key of the durable copy in UPDATE_ACTION_QUEUE.
+    string key;
+
+    // ts_topdir_relpath_device_hash.
+    string tuple;
+  };
+
+  // Does not take ownership of |dbm|.
+  UpdateQueue(DBManagerServer* dbm, int num_partitions);
+
+  ~UpdateQueue();
+
+  // Loads the updates left in UPDATE_ACTION_QUEUE by a previous run. Call
+  // before any Enqueue().
+  void Recover();
+
+  // Writes |batch| together with the durable copy of |tuple|, an update to
+  // |top_dir|, and hands the update to the workers.
+  bool Enqueue(const string& top_dir, const string& tuple,
+               DBManager::Batch* batch);
+
+  // Waits until a partition that no other worker owns has updates, takes
+  // ownership of it and moves up to |max| of its updates, oldest first, into
+  // |entries|. Returns false once Shutdown() has been called. Interruptible
+  // through boost::thread::interrupt().
+  bool Pop(size_t max, int* partition, vector<Entry>* entries);
+
+  // Adds to |batch| the removal of |entries| from the durable queue and their
+  // record in UPDATE_ACTION_LOG.
+  void Done(const vector<Entry>& entries, DBManager::Batch* batch);
+
+  // Gives up ownership of |partition| once its popped updates are written.
+  void Release(int partition);
+
+  // Wakes every waiting Pop() and makes it return false.
+  void Shutdown();
+
+ private:
+  struct Partition {
+    Partition() : owned(false), ready(false) {}
+
+    deque<Entry> entries;
+
+    // Set while a worker is fanning out updates popped from the partition.
+    bool owned;
+
+    // Set while the partition is on |ready_|.
+    bool ready;
+  };
+
+  int PartitionFor(const string& top_dir) const;
+
+  // Queues |partition| for the workers if it has updates and no owner.
+  // Requires |mutex_|.
+  void MaybeReady(int partition);
+
+  DBManagerServer* dbm_;
+
+  // Sequence number of the last durable key handed out.
+  Counter sequence_;
+
+  boost::mutex mutex_;
+  boost::condition_variable cv_;
+  vector<Partition> partitions_;
+
+  // Partitions with updates and no owner, in the order they became so.
+  deque<int> ready_;
+  bool shutdown_;
+
+  DISALLOW_COPY_AND_ASSIGN(UpdateQueue);
+};
+
+} // namespace lockbox
@@ -5,14 +5,18 @@
 #endif
 
 #include <boost/thread/thread.hpp>
+#include <set>
 #include <string>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
 
 #include "db_manager_server.h"
-#include "update_queue_sync.h"
+#include "device_notifier.h"
+#include "top_dir_device_cache.h"
+#include "update_queue.h"
 
+using std::set;
 using std::string;
 using std::vector;
 using std::mutex;
@@ -22,11 +26,15 @@ using std::unique_lock;
 
 namespace lockbox {
 
+// Pool of workers that take uploaded updates off |queue| and append them to the
+// DEVICE_SYNC queues of every other device that shares the top dir.
+//
 // TODO(tierney): Graceful shutdown of the thread_group threads.
 class UpdateQueuer {
  public:
-  // Does not take ownership of |dbm|.
-  UpdateQueuer(DBManagerServer* dbm, Sync* sync);
+  // Does not take ownership of |dbm|, |queue|, |devices| or |notifier|.
+  UpdateQueuer(DBManagerServer* dbm, UpdateQueue* queue,
+               TopDirDeviceCache* devices, DeviceNotifier* notifier);
 
   ~UpdateQueuer();
 
@@ -39,9 +47,18 @@ class UpdateQueuer {
   void Decrement();
 
  private:
+  // Adds to |batch| the DEVICE_SYNC appends announcing |tuple| and the devices
+  // appended to to |notify|.
+  void FanOut(const string& tuple, DBManager::Batch* batch,
+              set<DeviceID>* notify);
+
   DBManagerServer* dbm_;
 
-  Sync* sync_;
+  UpdateQueue* queue_;
+
+  TopDirDeviceCache* devices_;
+
+  DeviceNotifier* notifier_;
 
   vector<boost::thread*> threads_;
   boost::thread_group group_;